@@ -25,6 +25,7 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/sort.h>
 #include "nova.h"
 #include "inode.h"
 #include "entry.h"
@@ -505,20 +506,123 @@ out:
 	return ret;
 }
 
+static int nova_free_range_cmp(const void *a, const void *b)
+{
+	const struct nova_free_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/*
+ * Give the batched ranges back to the allocator in block order, so ranges
+ * freed by different callers that turn out adjacent go back as one.
+ */
+int nova_free_batch_flush(struct super_block *sb,
+	struct nova_free_batch *batch)
+{
+	struct nova_free_range *range = batch->ranges;
+	unsigned long start, len;
+	int ret = 0, err;
+	int i;
+
+	if (batch->nr == 0)
+		return 0;
+
+	sort(range, batch->nr, sizeof(*range), nova_free_range_cmp, NULL);
+
+	start = range[0].start;
+	len = range[0].len;
+	for (i = 1; i <= batch->nr; i++) {
+		if (i < batch->nr && range[i].start == start + len) {
+			len += range[i].len;
+			continue;
+		}
+		err = nova_free_blocks(sb, start, len, NOVA_BLOCK_TYPE_4K, 0);
+		if (err)
+			ret = err;
+		NOVA_STATS_ADD(free_batch_ranges, 1);
+		if (i < batch->nr) {
+			start = range[i].start;
+			len = range[i].len;
+		}
+	}
+
+	NOVA_STATS_ADD(free_batch_flushes, 1);
+	batch->nr = 0;
+	return ret;
+}
+
+static int nova_free_batch_queue(struct super_block *sb,
+	struct nova_free_batch *batch, unsigned long start, unsigned long len)
+{
+	struct nova_free_range *last;
+	int ret = 0;
+
+	if (batch->nr) {
+		last = &batch->ranges[batch->nr - 1];
+		if (last->start + last->len == start) {
+			last->len += len;
+			return 0;
+		}
+	}
+
+	if (batch->nr == NOVA_FREE_BATCH_RANGES)
+		ret = nova_free_batch_flush(sb, batch);
+
+	batch->ranges[batch->nr].start = start;
+	batch->ranges[batch->nr].len = len;
+	batch->nr++;
+	return ret;
+}
+
+/*
+ * Like nova_free_data_blocks() for 4K blocks, but the blocks whose last
+ * dedup reference is dropped are only queued in @batch. The caller frees
+ * them with nova_free_batch_flush() when done.
+ */
+int nova_free_batch_add(struct super_block *sb,
+	struct nova_free_batch *batch, unsigned long blocknr,
+	unsigned long num)
+{
+	unsigned long i, start = 0, len = 0;
+	int ret = 0, err;
+
+	if (blocknr == 0) {
+		nova_dbg("%s: ERROR: %lu, %lu\n", __func__, blocknr, num);
+		return -EINVAL;
+	}
+
+	for (i = blocknr; i < blocknr + num; i++) {
+		if (nova_dedup_put_block(sb, i)) {
+			if (len == 0)
+				start = i;
+			len++;
+			continue;
+		}
+		if (len) {
+			err = nova_free_batch_queue(sb, batch, start, len);
+			if (err)
+				ret = err;
+			len = 0;
+		}
+	}
+	if (len) {
+		err = nova_free_batch_queue(sb, batch, start, len);
+		if (err)
+			ret = err;
+	}
+
+	return ret;
+}
+
 int nova_free_data_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num)
 {
-	int ret;
-	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_pmm_entry *pentry, *pentries;
-	u32 weak_idx;
-	u64 strong_idx;
-	int64_t to_be_free_idx = 0;
-	// struct nova_hentry *weak_hentry, *strong_hentry;
-	struct nova_hentry *weak_find_hentry, *strong_find_hentry;
-	bool is_free = false;
+	int ret = 0, err;
+	unsigned long i, start = 0, len = 0;
 	INIT_TIMING(free_time);
-    INIT_TIMING(hash_table_time);
 
 	nova_dbgv("Inode %lu: free %d data block from %lu to %lu\n",
 			sih->ino, num, blocknr, blocknr + num - 1);
@@ -527,58 +631,36 @@ int nova_free_data_blocks(struct super_block *sb,
 		return -EINVAL;
 	}
 	NOVA_START_TIMING(free_data_t, free_time);
-	if(sih->i_blk_type == NOVA_BLOCK_TYPE_4K) {
-		pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
-		// kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
-		to_be_free_idx = sbi->blocknr_to_entry[blocknr];
-		if (to_be_free_idx >= 0) {
-			/* an entry's refcount is never changed */
-			pentry = pentries + to_be_free_idx;
-			spin_lock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
-			/* NOTE: pentry->fp_weak could be changed by calc_no_fin thread  */
-			weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
-			strong_idx = (pentry->fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-
-			spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-			NOVA_START_TIMING(hash_table_t, hash_table_time);
-			weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &pentry->fp_weak);
-			NOVA_END_TIMING(hash_table_t, hash_table_time);
-			
-			spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-			NOVA_START_TIMING(hash_table_t, hash_table_time);
-			strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &pentry->fp_strong);
-			NOVA_END_TIMING(hash_table_t, hash_table_time);
-
-			--pentry->refcount;
-			if (pentry->refcount == 0) {
-				is_free = true;
-				if (strong_find_hentry) {
-					if (strong_find_hentry->entrynr == to_be_free_idx) {
-						hlist_del(&strong_find_hentry->node);
-						kmem_cache_free(sbi->nova_hentry_cachep, strong_find_hentry);
-					}
-				}
-				if (weak_find_hentry) {
-					if (weak_find_hentry->entrynr == to_be_free_idx) {
-						hlist_del(&weak_find_hentry->node);
-						kmem_cache_free(sbi->nova_hentry_cachep, weak_find_hentry);
-					}
-				}
-				pentry->blocknr = 0;
-				/* NON_FIN_FLAG entry is freed by background */
-				if (pentry->flag != NON_FIN_FLAG) {
-					nova_free_entry(sb, to_be_free_idx);
-				}
-			}
-			spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-			spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-			spin_unlock(sbi->non_dedup_fp_locks + to_be_free_idx % NON_DEDUP_FP_LOCK_NUM);
-			if (!is_free) {
-				return 0;
-			} 
+	if (sih->i_blk_type != NOVA_BLOCK_TYPE_4K) {
+		ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, 0);
+		goto out;
+	}
+
+	/*
+	 * Drop the dedup reference of every block in the extent, and give
+	 * the unreferenced ones back to the allocator as coalesced ranges.
+	 */
+	for (i = blocknr; i < blocknr + num; i++) {
+		if (nova_dedup_put_block(sb, i)) {
+			if (len == 0)
+				start = i;
+			len++;
+			continue;
+		}
+		if (len) {
+			err = nova_free_blocks(sb, start, len, sih->i_blk_type, 0);
+			if (err)
+				ret = err;
+			len = 0;
 		}
 	}
-	ret = nova_free_blocks(sb, blocknr, num, sih->i_blk_type, 0);
+	if (len) {
+		err = nova_free_blocks(sb, start, len, sih->i_blk_type, 0);
+		if (err)
+			ret = err;
+	}
+
+out:
 	if (ret) {
 		nova_err(sb, "Inode %lu: free %d data block from %lu to %lu "
 			 "failed!\n",
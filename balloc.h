@@ -3,6 +3,19 @@
 
 #include "inode.h"
 
+/* Ranges of 4K data blocks waiting to go back to the allocator */
+#define NOVA_FREE_BATCH_RANGES	64
+
+struct nova_free_range {
+	unsigned long start;
+	unsigned long len;
+};
+
+struct nova_free_batch {
+	int nr;
+	struct nova_free_range ranges[NOVA_FREE_BATCH_RANGES];
+};
+
 /* DRAM structure to hold a list of free PMEM blocks */
 struct free_list {
 	spinlock_t s_lock;
@@ -83,6 +96,7 @@ struct nova_range_node *nova_alloc_blocknode(struct super_block *sb);
 struct nova_range_node *nova_alloc_inode_node(struct super_block *sb);
 struct nova_range_node *nova_alloc_dir_node(struct super_block *sb);
 struct vma_item *nova_alloc_vma_item(struct super_block *sb);
+struct nova_file_extent *nova_alloc_file_extent(struct super_block *sb);
 void nova_free_range_node(struct nova_range_node *node);
 void nova_free_snapshot_info(struct snapshot_info *info);
 void nova_free_blocknode(struct nova_range_node *bnode);
@@ -90,11 +104,17 @@ void nova_free_inode_node(struct nova_range_node *bnode);
 void nova_free_dir_node(struct nova_range_node *bnode);
 void nova_free_vma_item(struct super_block *sb,
 	struct vma_item *item);
+void nova_free_file_extent(struct nova_file_extent *ext);
 extern void nova_init_blockmap(struct super_block *sb, int recovery);
 extern int nova_free_data_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num);
 extern int nova_free_log_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr, int num);
+extern int nova_free_batch_add(struct super_block *sb,
+	struct nova_free_batch *batch, unsigned long blocknr,
+	unsigned long num);
+extern int nova_free_batch_flush(struct super_block *sb,
+	struct nova_free_batch *batch);
 extern int nova_new_data_blocks(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long *blocknr,
 	unsigned long start_blk, unsigned int num,
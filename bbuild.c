@@ -33,6 +33,7 @@
 #include "super.h"
 #include "inode.h"
 #include "log.h"
+#include "dedup.h"
 
 void nova_init_header(struct super_block *sb,
 	struct nova_inode_info_header *sih, u16 i_mode)
@@ -43,7 +44,7 @@ void nova_init_header(struct super_block *sb,
 	sih->i_blocks = 0;
 	sih->pi_addr = 0;
 	sih->alter_pi_addr = 0;
-	INIT_RADIX_TREE(&sih->tree, GFP_ATOMIC);
+	sih->tree = RB_ROOT;
 	sih->rb_tree = RB_ROOT;
 	sih->vma_tree = RB_ROOT;
 	sih->num_vmas = 0;
@@ -61,6 +62,9 @@ void nova_init_header(struct super_block *sb,
 	sih->alter_log_head = 0;
 	sih->alter_log_tail = 0;
 	sih->i_blk_type = NOVA_DEFAULT_BLOCK_TYPE;
+	INIT_LIST_HEAD(&sih->gc_list);
+	sih->gc_cpu = 0;
+	sih->gc_deferred_pages = 0;
 }
 
 static inline void set_scan_bm(unsigned long bit,
@@ -770,6 +774,7 @@ struct task_ring {
 	int inodes_used_count;
 	u64 *entry_array;
 	u64 *nvmm_array;
+	struct nova_dedup_rebuild_stats dedup_stats;
 };
 
 static struct task_ring *task_rings;
@@ -777,6 +782,30 @@ static struct task_struct **threads;
 wait_queue_head_t finish_wq;
 int *finished;
 
+/*
+ * References to each data block found in the inode logs. Dedup entries are
+ * reconciled against them once every log has been crawled, which the
+ * recovery threads wait for on crawl_wq.
+ */
+static atomic_t *block_refs;
+static atomic_t crawl_pending;
+static DECLARE_WAIT_QUEUE_HEAD(crawl_wq);
+
+/* A data block mapped by a file or kept for a snapshot */
+static inline void nova_set_data_bm(struct super_block *sb,
+	unsigned long nvmm, struct scan_bitmap *bm)
+{
+	set_bm(nvmm, bm, BM_4K);
+	if (nvmm < NOVA_SB(sb)->num_blocks)
+		atomic_inc(&block_refs[nvmm]);
+}
+
+static void nova_crawl_done(void)
+{
+	if (atomic_dec_and_test(&crawl_pending))
+		wake_up_all(&crawl_wq);
+}
+
 static int nova_traverse_inode_log(struct super_block *sb,
 	struct nova_inode *pi, struct scan_bitmap *bm, u64 head)
 {
@@ -848,7 +877,7 @@ static unsigned int nova_check_old_entry(struct super_block *sb,
 	for (i = 0; i < num_free; i++) {
 		nvmm = ring->nvmm_array[index];
 		if (nvmm)
-			set_bm(nvmm, bm, BM_4K);
+			nova_set_data_bm(sb, nvmm, bm);
 		index++;
 	}
 
@@ -922,7 +951,7 @@ static int nova_set_file_bm(struct super_block *sb,
 	for (pgoff = 0; pgoff <= last_blocknr; pgoff++) {
 		nvmm = ring->nvmm_array[pgoff];
 		if (nvmm) {
-			set_bm(nvmm, bm, BM_4K);
+			nova_set_data_bm(sb, nvmm, bm);
 			ring->nvmm_array[pgoff] = 0;
 			ring->entry_array[pgoff] = 0;
 		}
@@ -1182,6 +1211,8 @@ static void free_resources(struct super_block *sb)
 	kfree(task_rings);
 	kfree(threads);
 	kfree(finished);
+	vfree(block_refs);
+	block_refs = NULL;
 }
 
 static int failure_thread_func(void *data);
@@ -1215,7 +1246,13 @@ static int allocate_resources(struct super_block *sb, int cpus)
 	if (!finished)
 		goto fail;
 
+	block_refs = vzalloc(sizeof(atomic_t) * NOVA_SB(sb)->num_blocks);
+	if (!block_refs)
+		goto fail;
+
 	init_waitqueue_head(&finish_wq);
+	/* One per recovery thread plus the caller crawling the root inode */
+	atomic_set(&crawl_pending, cpus + 1);
 
 	for (i = 0; i < cpus; i++) {
 		threads[i] = kthread_create(failure_thread_func,
@@ -1278,6 +1315,7 @@ static int failure_thread_func(void *data)
 	int cpuid = nova_get_cpuid(sb);
 	unsigned long i;
 	unsigned long max_size = 0;
+	unsigned long start, entries;
 	u64 pi_addr = 0;
 	int ret = 0;
 	int count;
@@ -1350,6 +1388,16 @@ static int failure_thread_func(void *data)
 						false, false, 0);
 	}
 
+	/* Block references are final once every thread is done crawling */
+	nova_crawl_done();
+	wait_event(crawl_wq, atomic_read(&crawl_pending) == 0);
+
+	entries = DIV_ROUND_UP(NOVA_SB(sb)->num_blocks, NOVA_SB(sb)->cpus);
+	start = min(cpuid * entries, NOVA_SB(sb)->num_blocks);
+	nova_dedup_rebuild_entries(sb, start,
+			min(start + entries, NOVA_SB(sb)->num_blocks),
+			block_refs, &ring->dedup_stats);
+
 	finished[cpuid] = 1;
 	wake_up_interruptible(&finish_wq);
 	do_exit(ret);
@@ -1435,6 +1483,7 @@ static int nova_failure_recovery_crawl(struct super_block *sb)
 int nova_failure_recovery(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_dedup_rebuild_stats dedup_stats = { 0 };
 	struct task_ring *ring;
 	struct nova_inode *pi;
 	struct journal_ptr_pair *pair;
@@ -1470,18 +1519,25 @@ int nova_failure_recovery(struct super_block *sb)
 		return ret;
 
 	ret = nova_failure_recovery_crawl(sb);
+	nova_crawl_done();
 
 	wait_to_finish(sbi->cpus);
 
 	for (i = 0; i < sbi->cpus; i++) {
 		ring = &task_rings[i];
 		sbi->s_inodes_used_count += ring->inodes_used_count;
+		dedup_stats.live += ring->dedup_stats.live;
+		dedup_stats.drifted += ring->dedup_stats.drifted;
+		dedup_stats.orphans += ring->dedup_stats.orphans;
 	}
 
 	free_resources(sb);
 
 	nova_dbg("Failure recovery total recovered %lu\n",
 			sbi->s_inodes_used_count - NOVA_NORMAL_INODE_START);
+	nova_dbg("Dedup entries: %lu live, %lu refcounts fixed, %lu orphans freed\n",
+			dedup_stats.live, dedup_stats.drifted,
+			dedup_stats.orphans);
 	return ret;
 }
 
@@ -1532,6 +1588,7 @@ int nova_recovery(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_super_block *super = sbi->nova_sb;
+	struct nova_dedup_rebuild_stats dedup_stats = { 0 };
 	unsigned long initsize = le64_to_cpu(super->s_size);
 	bool value = false;
 	int ret = 0;
@@ -1553,6 +1610,9 @@ int nova_recovery(struct super_block *sb)
 	value = nova_try_normal_recovery(sb);
 	if (value) {
 		nova_dbg("NOVA: Normal shutdown\n");
+		nova_dedup_rebuild_entries(sb, 0, sbi->num_blocks, NULL,
+						&dedup_stats);
+		nova_dbg("Dedup entries: %lu live\n", dedup_stats.live);
 	} else {
 		nova_dbg("NOVA: Failure recovery\n");
 		ret = alloc_bm(sb, initsize);
@@ -17,6 +17,7 @@
 
 #include "nova.h"
 #include "inode.h"
+#include "dedup.h"
 
 static int nova_get_entry_copy(struct super_block *sb, void *entry,
 	u32 *entry_csum, size_t *entry_size, void *entry_copy)
@@ -670,6 +671,71 @@ int nova_update_block_csum(struct super_block *sb,
 	return 0;
 }
 
+/* Compute the crc32c values of all stripes of a whole block
+ *
+ * block:   block buffer in dram
+ * csums:   one little-endian csum per stripe, laid out like the csum slots
+ *
+ * The eight stripes of a 4K block are folded in parallel, as in
+ * nova_update_block_csum_parity(), since each crc32 instruction depends on
+ * the result of the previous one of the same stripe.
+ */
+void nova_block_stripe_csums(struct super_block *sb, const u8 *block,
+	u32 *csums)
+{
+	size_t strp_size = NOVA_STRIPE_SIZE;
+	unsigned int strp, strps = sb->s_blocksize >> NOVA_STRIPE_SHIFT;
+	u64 acc[8] = {NOVA_INIT_CSUM, NOVA_INIT_CSUM, NOVA_INIT_CSUM,
+		      NOVA_INIT_CSUM, NOVA_INIT_CSUM, NOVA_INIT_CSUM,
+		      NOVA_INIT_CSUM, NOVA_INIT_CSUM};
+	unsigned int i;
+
+	if (strps != 8 || !static_cpu_has(X86_FEATURE_XMM4_2)) {
+		for (strp = 0; strp < strps; strp++)
+			csums[strp] = cpu_to_le32(nova_crc32c(NOVA_INIT_CSUM,
+					block + strp * strp_size, strp_size));
+		return;
+	}
+
+	for (i = 0; i < strp_size; i += 8) {
+		nova_crc32c_qword(*((u64 *) (block + i)), acc[0]);
+		nova_crc32c_qword(*((u64 *) (block + i + strp_size)), acc[1]);
+		nova_crc32c_qword(*((u64 *) (block + i + 2 * strp_size)), acc[2]);
+		nova_crc32c_qword(*((u64 *) (block + i + 3 * strp_size)), acc[3]);
+		nova_crc32c_qword(*((u64 *) (block + i + 4 * strp_size)), acc[4]);
+		nova_crc32c_qword(*((u64 *) (block + i + 5 * strp_size)), acc[5]);
+		nova_crc32c_qword(*((u64 *) (block + i + 6 * strp_size)), acc[6]);
+		nova_crc32c_qword(*((u64 *) (block + i + 7 * strp_size)), acc[7]);
+	}
+
+	for (strp = 0; strp < 8; strp++)
+		csums[strp] = cpu_to_le32((u32) acc[strp]);
+}
+
+/* Write stripe csums computed by nova_block_stripe_csums() to both csum
+ * copies of a 4K block.
+ */
+void nova_write_block_csums(struct super_block *sb, unsigned long blocknr,
+	const u32 *csums)
+{
+	size_t len = NOVA_DATA_CSUM_LEN * (sb->s_blocksize >> NOVA_STRIPE_SHIFT);
+	unsigned long strp_nr;
+	void *csum_addr, *csum_addr1;
+	INIT_TIMING(block_csum_time);
+
+	NOVA_START_TIMING(block_csum_t, block_csum_time);
+	strp_nr = nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K)
+			>> NOVA_STRIPE_SHIFT;
+	csum_addr = nova_get_data_csum_addr(sb, strp_nr, 0);
+	csum_addr1 = nova_get_data_csum_addr(sb, strp_nr, 1);
+
+	nova_memunlock_range(sb, csum_addr, len);
+	memcpy_to_pmem_nocache(csum_addr, csums, len);
+	memcpy_to_pmem_nocache(csum_addr1, csums, len);
+	nova_memlock_range(sb, csum_addr, len);
+	NOVA_END_TIMING(block_csum_t, block_csum_time);
+}
+
 int nova_update_pgoff_csum(struct super_block *sb,
 	struct nova_inode_info_header *sih, struct nova_file_write_entry *entry,
 	unsigned long pgoff, int zero)
@@ -698,6 +764,34 @@ int nova_update_pgoff_csum(struct super_block *sb,
 	return 0;
 }
 
+static bool nova_verify_zero_block(struct super_block *sb, size_t offset,
+	size_t bytes)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	size_t strp_size = NOVA_STRIPE_SIZE;
+	unsigned int strp_shift = NOVA_STRIPE_SHIFT;
+	unsigned long strp, strps;
+	u8 *strp_ptr;
+
+	strps = ((offset + bytes - 1) >> strp_shift)
+		- (offset >> strp_shift) + 1;
+	strp_ptr = (u8 *)nova_get_block(sb, nova_get_block_off(sb,
+			sbi->zero_blocknr, NOVA_BLOCK_TYPE_4K)) +
+			((offset >> strp_shift) << strp_shift);
+
+	for (strp = 0; strp < strps; strp++) {
+		if (nova_crc32c(NOVA_INIT_CSUM, strp_ptr, strp_size) !=
+				sbi->zero_csum[0]) {
+			nova_dbg("%s: shared zero block corrupted, stripe %lu\n",
+				 __func__, (offset >> strp_shift) + strp);
+			return false;
+		}
+		strp_ptr += strp_size;
+	}
+
+	return true;
+}
+
 /* Verify checksums of requested data bytes starting from offset of blocknr.
  *
  * Only a whole stripe can be checksum verified.
@@ -725,6 +819,12 @@ bool nova_verify_data_csum(struct super_block *sb,
 	bool match;
 	INIT_TIMING(verify_time);
 
+	/* The shared zero block has no csum slots; check it against the
+	 * precomputed zero stripe csum instead.
+	 */
+	if (nova_dedup_is_zero_block(sb, blocknr))
+		return nova_verify_zero_block(sb, offset, bytes);
+
 	NOVA_START_TIMING(verify_data_csum_t, verify_time);
 
 	/* Only a whole stripe can be checksum verified.
@@ -20,6 +20,7 @@
 #include <linux/version.h>
 #include "nova.h"
 #include "inode.h"
+#include "dedup.h"
 
 
 
@@ -604,7 +605,9 @@ unsigned long nova_check_existing_entry(struct super_block *sb,
 		if (ent_blks > num_blocks)
 			ent_blks = num_blocks;
 
-		if (entryc->epoch_id == epoch_id)
+		/* The shared zero block must never be written in place */
+		if (entryc->epoch_id == epoch_id &&
+		    !nova_dedup_is_zero_block(sb, entryc->block >> PAGE_SHIFT))
 			*inplace = 1;
 
 	} else if (check_next) {
@@ -646,9 +649,52 @@ out:
 }
 
 
+/*
+ * Write one block of an inplace write whose old block is shared with other
+ * files. The new content is built in @kbuf and goes through dedup like a CoW
+ * write. Returns the number of blocks allocated, 0 on a dedup hit.
+ */
+static int nova_inplace_cow_shared(struct super_block *sb, struct inode *inode,
+	loff_t pos, size_t bytes, const char __user *buf, char *kbuf,
+	unsigned long *blocknr)
+{
+	size_t offset = pos & (sb->s_blocksize - 1);
+	u32 csums[NOVA_PAGE_STRIPES];
+	int allocated;
+	int ret;
+
+	if (offset || ((offset + bytes) & (PAGE_SIZE - 1)) != 0) {
+		ret = nova_handle_head_tail_blocks_in_buf(sb, inode, pos,
+							  bytes, kbuf);
+		if (ret)
+			return ret;
+	}
+
+	if (copy_from_user(kbuf + offset, buf, bytes))
+		return -EFAULT;
+
+	if (data_csum > 0)
+		nova_block_stripe_csums(sb, (u8 *)kbuf, csums);
+
+	allocated = nova_dedup_new_write(sb, kbuf,
+			data_csum > 0 ? csums : NULL, blocknr);
+	if (allocated > 0) {
+		if (data_csum > 0)
+			nova_write_block_csums(sb, *blocknr, csums);
+		if (data_parity > 0)
+			nova_update_block_parity(sb, (u8 *)kbuf, *blocknr, 0);
+	}
+
+	return allocated;
+}
+
 /*
  * Do an inplace write.  This function assumes that the lock on the inode is
  * already held.
+ *
+ * Only blocks no other file references are overwritten: an exclusive
+ * deduplicated block drops its dedup entry before it changes, and a shared
+ * block is replaced through the dedup write path.
  */
 ssize_t do_nova_inplace_file_write(struct file *filp,
 	const char __user *buf,	size_t len, loff_t *ppos)
@@ -664,7 +710,7 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 	struct nova_file_write_entry entry_data;
 	struct nova_inode_update update;
 	ssize_t	    written = 0;
-	loff_t pos;
+	loff_t pos, cow_start = -1;
 	size_t count, offset, copied;
 	unsigned long start_blk, num_blocks, ent_blks = 0;
 	unsigned long total_blocks;
@@ -674,7 +720,9 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 	int allocated = 0;
 	int inplace = 0;
 	bool hole_fill = false;
+	bool cow_shared = false;
 	bool update_log = false;
+	char *data_buffer = NULL;
 	void *kmem;
 	u64 blk_off;
 	size_t bytes;
@@ -739,6 +787,7 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 	update.alter_tail = sih->alter_log_tail;
 	while (num_blocks > 0) {
 		hole_fill = false;
+		cow_shared = false;
 		offset = pos & (nova_inode_blk_size(sih) - 1);
 		start_blk = pos >> sb->s_blocksize_bits;
 
@@ -752,8 +801,11 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 			/* We can do inplace write. Find contiguous blocks */
 			blocknr = get_nvmm(sb, sih, entryc, start_blk);
 			blk_off = blocknr << PAGE_SHIFT;
-			allocated = ent_blks;
-			if (data_csum || data_parity)
+			allocated = nova_dedup_claim_blocks(sb, blocknr,
+							    ent_blks);
+			if (allocated == 0)
+				cow_shared = true;
+			else if (data_csum || data_parity)
 				nova_set_write_entry_updating(sb, entry, 1);
 		} else {
 			/* Allocate blocks to fill hole */
@@ -778,35 +830,63 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 		}
 
 		step++;
-		bytes = sb->s_blocksize * allocated - offset;
-		if (bytes > count)
-			bytes = count;
+		if (cow_shared) {
+			if (!data_buffer) {
+				data_buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+				if (!data_buffer) {
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
 
-		kmem = nova_get_block(inode->i_sb, blk_off);
+			bytes = sb->s_blocksize - offset;
+			if (bytes > count)
+				bytes = count;
 
-		if (hole_fill &&
-		    (offset || ((offset + bytes) & (PAGE_SIZE - 1)) != 0)) {
-			ret =  nova_handle_head_tail_blocks(sb, inode,
-							    pos, bytes, kmem);
-			if (ret)
+			ret = nova_inplace_cow_shared(sb, inode, pos, bytes,
+						buf, data_buffer, &blocknr);
+			if (ret < 0)
 				goto out;
 
-		}
+			allocated = 1;
+			hole_fill = true;
+			new_blocks += allocated;
+			copied = bytes;
+			kmem = nova_get_block(sb, blocknr << PAGE_SHIFT);
+			if (cow_start < 0)
+				cow_start = pos;
+			NOVA_STATS_ADD(inplace_cow_shared, 1);
+		} else {
+			bytes = sb->s_blocksize * allocated - offset;
+			if (bytes > count)
+				bytes = count;
 
-		/* Now copy from user buf */
-//		nova_dbg("Write: %p\n", kmem);
-		NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
-		nova_memunlock_range(sb, kmem + offset, bytes);
-		copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
-						buf, bytes);
-		nova_memlock_range(sb, kmem + offset, bytes);
-		NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
-
-		if (data_csum > 0 || data_parity > 0) {
-			ret = nova_protect_file_data(sb, inode, pos, bytes,
-						buf, blocknr, !hole_fill);
-			if (ret)
-				goto out;
+			kmem = nova_get_block(inode->i_sb, blk_off);
+
+			if (hole_fill && (offset ||
+			    ((offset + bytes) & (PAGE_SIZE - 1)) != 0)) {
+				ret =  nova_handle_head_tail_blocks(sb, inode,
+							pos, bytes, kmem);
+				if (ret)
+					goto out;
+
+			}
+
+			/* Now copy from user buf */
+//			nova_dbg("Write: %p\n", kmem);
+			NOVA_START_TIMING(memcpy_w_nvmm_t, memcpy_time);
+			nova_memunlock_range(sb, kmem + offset, bytes);
+			copied = bytes - memcpy_to_pmem_nocache(kmem + offset,
+							buf, bytes);
+			nova_memlock_range(sb, kmem + offset, bytes);
+			NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
+
+			if (data_csum > 0 || data_parity > 0) {
+				ret = nova_protect_file_data(sb, inode, pos,
+						bytes, buf, blocknr, !hole_fill);
+				if (ret)
+					goto out;
+			}
 		}
 
 		if (pos + copied > inode->i_size)
@@ -885,6 +965,11 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 			goto out;
 	}
 
+	/* Mappings of the copied blocks still point to the shared ones */
+	if (cow_start >= 0 && mapping_mapped(mapping))
+		unmap_mapping_range(mapping, cow_start & PAGE_MASK,
+				    pos - (cow_start & PAGE_MASK), 0);
+
 	ret = written;
 	NOVA_STATS_ADD(inplace_write_breaks, step);
 	nova_dbgv("blocks: %lu, %lu\n", inode->i_blocks, sih->i_blocks);
@@ -897,6 +982,7 @@ ssize_t do_nova_inplace_file_write(struct file *filp,
 
 	sih->trans_id++;
 out:
+	kfree(data_buffer);
 	if (ret < 0)
 		nova_cleanup_incomplete_write(sb, sih, blocknr, allocated,
 						begin_tail, update.tail);
@@ -985,6 +1071,9 @@ static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
 	unsigned int data_bits;
 	unsigned long nvmm = 0;
 	unsigned long blocknr = 0;
+	unsigned long from_blocknr;
+	void *from_kmem, *to_kmem;
+	u32 csums[NOVA_PAGE_STRIPES];
 	u64 epoch_id;
 	int num_blocks = 0;
 	int inplace = 0;
@@ -1004,10 +1093,17 @@ static int nova_dax_get_blocks(struct inode *inode, sector_t iblock,
 
 	epoch_id = nova_get_epoch_id(sb);
 
-	if (taking_lock)
+	/*
+	 * The extent tree is only stable under the inode lock: a writer may
+	 * rotate it or free extents. Look up under the shared lock.
+	 */
+	if (taking_lock) {
 		check_next = 0;
+		inode_lock_shared(inode);
+	}
 
 again:
+	from_blocknr = 0;
 	num_blocks = nova_check_existing_entry(sb, inode, max_blocks,
 					iblock, &entry, &entry_copy, check_next,
 					epoch_id, &inplace, locked);
@@ -1019,7 +1115,24 @@ again:
 			nvmm = get_nvmm(sb, sih, entryc, iblock);
 			nova_dbgv("%s: found pgoff %lu, block %lu\n",
 					__func__, iblock, nvmm);
-			goto out;
+			if (create == 0)
+				goto out;
+
+			/*
+			 * A block seen before the inode lock may already be
+			 * freed and reused; claim it only under the lock.
+			 */
+			if (taking_lock && locked == 0)
+				goto lock;
+
+			/* Map the exclusive blocks, copy a shared one first */
+			num_blocks = nova_dedup_claim_blocks(sb, nvmm,
+								num_blocks);
+			if (num_blocks > 0)
+				goto out;
+
+			from_blocknr = nvmm;
+			num_blocks = 1;
 		}
 	}
 
@@ -1028,7 +1141,9 @@ again:
 		goto out1;
 	}
 
+lock:
 	if (taking_lock && locked == 0) {
+		inode_unlock_shared(inode);
 		inode_lock(inode);
 		locked = 1;
 		/* Check again incase someone has done it for us */
@@ -1044,8 +1159,9 @@ again:
 
 	/* Return initialized blocks to the user */
 	allocated = nova_new_data_blocks(sb, sih, &blocknr, iblock,
-				 num_blocks, ALLOC_INIT_ZERO, ANY_CPU,
-				 ALLOC_FROM_HEAD);
+				 num_blocks,
+				 from_blocknr ? ALLOC_NO_INIT : ALLOC_INIT_ZERO,
+				 ANY_CPU, ALLOC_FROM_HEAD);
 	if (allocated <= 0) {
 		nova_dbgv("%s alloc blocks failed %d\n", __func__,
 							allocated);
@@ -1054,6 +1170,20 @@ again:
 	}
 
 	num_blocks = allocated;
+	if (from_blocknr) {
+		from_kmem = nova_get_block(sb, from_blocknr << PAGE_SHIFT);
+		to_kmem = nova_get_block(sb, blocknr << PAGE_SHIFT);
+		nova_memunlock_block(sb, to_kmem);
+		memcpy_to_pmem_nocache(to_kmem, from_kmem, PAGE_SIZE);
+		nova_memlock_block(sb, to_kmem);
+		if (data_csum > 0) {
+			nova_block_stripe_csums(sb, to_kmem, csums);
+			nova_write_block_csums(sb, blocknr, csums);
+		}
+		if (data_parity > 0)
+			nova_update_block_parity(sb, to_kmem, blocknr, 0);
+		NOVA_STATS_ADD(dax_cow_shared, 1);
+	}
 	/* Do not extend file size */
 	nova_init_file_write_entry(sb, sih, &entry_data,
 					epoch_id, iblock, num_blocks,
@@ -1101,6 +1231,8 @@ out:
 out1:
 	if (taking_lock && locked)
 		inode_unlock(inode);
+	else if (taking_lock)
+		inode_unlock_shared(inode);
 
 	NOVA_END_TIMING(dax_get_block_t, get_block_time);
 	return num_blocks;
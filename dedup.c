@@ -19,6 +19,35 @@ inline bool cmp_fp_strong(struct nova_fp_strong *dst, struct nova_fp_strong *src
             && dst->u64s[2] == src->u64s[2] && dst->u64s[3] == src->u64s[3] );
 }
 
+/**
+ * Entries are flushed without a fence. Every page that goes through
+ * nova_dedup_new_write() is published by moving an inode log tail, and the
+ * barrier in nova_update_tail() orders all of its entry flushes at once.
+ * A crash before that leaves refcounts too high, which the refcount recount
+ * of failure recovery settles.
+ */
+static inline void nova_flush_pentry(struct nova_pmm_entry *pentry)
+{
+    nova_flush_buffer(pentry, sizeof(*pentry), false);
+}
+
+static inline void nova_dedup_trace_fill(struct nova_dedup_trace_rec *rec, struct nova_fp_weak *fp_weak,
+    struct nova_fp_strong *fp_strong, entrynr_t entrynr, bool hit)
+{
+    if (likely(!rec))
+        return;
+    rec->entrynr = entrynr;
+    rec->result = hit ? NOVA_TRACE_HIT : NOVA_TRACE_MISS;
+    if (fp_weak) {
+        rec->fp_weak = fp_weak->u32;
+        rec->flags |= NOVA_TRACE_WEAK;
+    }
+    if (fp_strong) {
+        rec->fp_strong = fp_strong->u64s[0];
+        rec->flags |= NOVA_TRACE_STRONG;
+    }
+}
+
 int nova_alloc_block_write(struct super_block *sb,const char *data_buffer, unsigned long *blocknr)
 {
     int allocated = 0;
@@ -65,6 +94,101 @@ struct nova_hentry *nova_alloc_hentry(struct super_block *sb)
 
 
 
+/**
+ * One index shard per online NUMA node. The bucket arrays, their locks and
+ * the shard itself are allocated on that node, so probes of a bucket only
+ * touch the memory of the node owning it.
+ */
+int nova_dedup_init_shards(struct super_block *sb, size_t sz)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_shard *shard;
+    size_t shard_sz;
+    int node, i = 0;
+    size_t j;
+
+    sbi->dedup_nr_shards = num_online_nodes();
+    sbi->node_to_shard = kcalloc(nr_node_ids, sizeof(int), GFP_KERNEL);
+    sbi->dedup_shards = kcalloc(sbi->dedup_nr_shards, sizeof(*sbi->dedup_shards), GFP_KERNEL);
+    if (!sbi->node_to_shard || !sbi->dedup_shards)
+        return -ENOMEM;
+
+    shard_sz = DIV_ROUND_UP(sz, sbi->dedup_nr_shards);
+    for_each_online_node(node) {
+        if (i >= sbi->dedup_nr_shards)
+            break;
+
+        shard = kzalloc_node(sizeof(*shard), GFP_KERNEL, node);
+        if (!shard)
+            return -ENOMEM;
+        sbi->dedup_shards[i] = shard;
+        sbi->node_to_shard[node] = i;
+        shard->node = node;
+
+        for (j = 0; j < HASH_TABLE_LOCK_NUM; ++j) {
+            spin_lock_init(&shard->weak_hash_table_locks[j]);
+            spin_lock_init(&shard->strong_hash_table_locks[j]);
+        }
+        shard->weak_hash_table = vzalloc_node(sizeof(struct hlist_head) * shard_sz, node);
+        shard->strong_hash_table = vzalloc_node(sizeof(struct hlist_head) * shard_sz, node);
+        if (!shard->weak_hash_table || !shard->strong_hash_table)
+            return -ENOMEM;
+
+        for (j = 0; j < shard_sz; ++j) {
+            INIT_HLIST_HEAD(&shard->weak_hash_table[j]);
+            INIT_HLIST_HEAD(&shard->strong_hash_table[j]);
+        }
+        nova_info("dedup shard %d on node %d: %lu buckets\n", i, node, shard_sz);
+        i++;
+    }
+
+    return 0;
+}
+
+static void nova_dedup_free_hlists(struct nova_sb_info *sbi, struct hlist_head *table, size_t shard_sz)
+{
+    struct nova_hentry *hentry;
+    struct hlist_node *tmp;
+    size_t i;
+
+    if (!table)
+        return;
+
+    for (i = 0; i < shard_sz; ++i) {
+        hlist_for_each_entry_safe(hentry, tmp, &table[i], node) {
+            hlist_del(&hentry->node);
+            kmem_cache_free(sbi->nova_hentry_cachep, hentry);
+        }
+    }
+    vfree(table);
+}
+
+void nova_dedup_free_shards(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_shard *shard;
+    size_t shard_sz;
+    int i;
+
+    if (!sbi->dedup_shards)
+        return;
+
+    shard_sz = DIV_ROUND_UP((size_t)1 << sbi->num_entries_bits, sbi->dedup_nr_shards);
+    for (i = 0; i < sbi->dedup_nr_shards; ++i) {
+        shard = sbi->dedup_shards[i];
+        if (!shard)
+            continue;
+        nova_dedup_free_hlists(sbi, shard->weak_hash_table, shard_sz);
+        nova_dedup_free_hlists(sbi, shard->strong_hash_table, shard_sz);
+        kfree(shard);
+    }
+
+    kfree(sbi->dedup_shards);
+    sbi->dedup_shards = NULL;
+    kfree(sbi->node_to_shard);
+    sbi->node_to_shard = NULL;
+}
+
 struct nova_hentry *nova_find_in_weak_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_weak *fp_weak)
 {
     struct nova_hentry *hentry;
@@ -74,7 +198,8 @@ struct nova_hentry *nova_find_in_weak_hlist(struct super_block *sb, struct hlist
     pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
     hlist_for_each_entry(hentry, hlist, node) {
         pentry = pentries + hentry->entrynr;
-        if(pentry->fp_weak.u32 == fp_weak->u32)
+        /* Dead entries wait in a free batch to leave the index */
+        if(pentry->fp_weak.u32 == fp_weak->u32 && pentry->refcount != 0)
             return hentry;
     }
 
@@ -90,15 +215,116 @@ struct nova_hentry *nova_find_in_strong_hlist(struct super_block *sb, struct hli
     pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
     hlist_for_each_entry(hentry, hlist, node) {
         pentry = pentries + hentry->entrynr;
-        if(cmp_fp_strong(&pentry->fp_strong, fp_strong))
+        if(cmp_fp_strong(&pentry->fp_strong, fp_strong) && pentry->refcount != 0)
             return hentry;
     }
 
     return NULL;
 }
 
+/* Put a live entry back into the index the way the write path left it */
+static void nova_dedup_index_entry(struct super_block *sb, entrynr_t entrynr, struct nova_pmm_entry *pentry)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_hentry *hentry;
+    u32 weak_idx;
+    u64 strong_idx;
+
+    /* NON_FIN entries are picked up from the table by calc_non_fin */
+    if (pentry->flag != FP_WEAK_FLAG && pentry->flag != FP_STRONG_FLAG)
+        return;
+
+    /* Only the first entry of a weak fingerprint is indexed by it */
+    weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+    spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+    if (!nova_find_in_weak_hlist(sb, nova_weak_bucket(sbi, weak_idx), &pentry->fp_weak)) {
+        hentry = nova_alloc_hentry(sb);
+        if (hentry) {
+            hentry->entrynr = entrynr;
+            hlist_add_head(&hentry->node, nova_weak_bucket(sbi, weak_idx));
+        }
+    }
+    spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+
+    if (pentry->flag != FP_STRONG_FLAG)
+        return;
+
+    strong_idx = (pentry->fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
+    spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
+    if (!nova_find_in_strong_hlist(sb, nova_strong_bucket(sbi, strong_idx), &pentry->fp_strong)) {
+        hentry = nova_alloc_hentry(sb);
+        if (hentry) {
+            hentry->entrynr = entrynr;
+            hlist_add_head(&hentry->node, nova_strong_bucket(sbi, strong_idx));
+        }
+    }
+    spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
+}
+
+/**
+ * Rebuild the DRAM state of entries [start, end) at mount. With @refs, the
+ * per-block reference counts gathered from the inode logs by failure
+ * recovery, an entry is live iff a write entry still maps its block and its
+ * PM refcount is replaced by the counted one; this also settles refcounts
+ * left in per-CPU deltas by the crash. Without @refs the PM refcount of a
+ * clean unmount is trusted. Live entries leave the free list and go back
+ * into the index and blocknr_to_entry, dead ones are wiped. Ranges of
+ * concurrent callers must not overlap.
+ */
+void nova_dedup_rebuild_entries(struct super_block *sb, entrynr_t start, entrynr_t end,
+    const atomic_t *refs, struct nova_dedup_rebuild_stats *stats)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentries, *pentry;
+    unsigned long blocknr;
+    u64 refcount;
+    entrynr_t idx;
+
+    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+
+    for (idx = start; idx < end; idx++) {
+        pentry = pentries + idx;
+        blocknr = pentry->blocknr;
+
+        if (blocknr == 0 || blocknr >= sbi->num_blocks || pentry->flag == 0 ||
+            nova_dedup_is_zero_block(sb, blocknr))
+            refcount = 0;
+        else if (refs)
+            refcount = atomic_read(&refs[blocknr]);
+        else
+            refcount = pentry->refcount;
+
+        /* Two entries claiming one block: the first one keeps it */
+        if (refcount && cmpxchg(&sbi->blocknr_to_entry[blocknr], -1, (int64_t)idx) != -1)
+            refcount = 0;
+
+        if (refcount == 0) {
+            if (pentry->flag || pentry->refcount || pentry->blocknr || pentry->tag_TXID) {
+                memset_nt(pentry, 0, sizeof(*pentry));
+                stats->orphans++;
+            }
+            continue;
+        }
+
+        if (pentry->refcount != refcount || pentry->tag_TXID) {
+            if (pentry->refcount != refcount)
+                stats->drifted++;
+            pentry->refcount = refcount;
+            pentry->tag_TXID = 0;
+            nova_flush_buffer(pentry, sizeof(*pentry), false);
+        }
+        stats->live++;
+
+        nova_reserve_entry(sb, idx);
+        nova_dedup_index_entry(sb, idx, pentry);
+        if ((idx & 0xfff) == 0)
+            cond_resched();
+    }
+    PERSISTENT_BARRIER();
+}
+
 
-int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned long *blocknr) 
+int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer, const u32 *csums, unsigned long *blocknr, struct nova_dedup_trace_rec *rec) 
 {
     /**
      *  Str_Fin method calculates a single strong fingerprint for data 
@@ -121,6 +347,8 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
     entrynr_t alloc_entry,strong_find_entry;
     char *kmem;
     int allocated = 0;
+    bool flush_entry = true;
+    bool hit = false;
     // void *kmem;
     INIT_TIMING(weak_fp_calc_time);
     INIT_TIMING(strong_fp_calc_time);
@@ -130,7 +358,7 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
     pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
 
     NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
-    nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, data_buffer,&fp_weak);
+    nova_dedup_fp_weak(sb, data_buffer, csums, &fp_weak);
     NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
 
     NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
@@ -138,26 +366,31 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
     NOVA_END_TIMING(strong_fp_calc_t, strong_fp_calc_time);
 
     weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
-	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
+    weak_find_hentry = nova_find_in_weak_hlist(sb, nova_weak_bucket(sbi, weak_idx), &fp_weak);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
     
     strong_idx = (fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-	spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &fp_strong);
+    strong_find_hentry = nova_find_in_strong_hlist(sb, nova_strong_bucket(sbi, strong_idx), &fp_strong);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
 
     if( strong_find_hentry ) {
         NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
         pentry = pentries + strong_find_hentry->entrynr;
-        ++pentry->refcount;
-        pentry->fp_weak = fp_weak;
-        pentry->flag = FP_STRONG_FLAG;
+        flush_entry = nova_entry_refcount_get(sb, strong_find_hentry->entrynr);
+        /* Avoid dirtying a hot entry whose fingerprints are already set */
+        if (pentry->fp_weak.u32 != fp_weak.u32 || pentry->flag != FP_STRONG_FLAG) {
+            pentry->fp_weak = fp_weak;
+            pentry->flag = FP_STRONG_FLAG;
+            flush_entry = true;
+        }
         ++sbi->dup_block;
+        hit = true;
         *blocknr = pentry->blocknr;
-        allocated = 1;
+        allocated = 0;
         strong_find_entry = strong_find_hentry->entrynr;
         NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
     }else {
@@ -169,15 +402,16 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
             if (cmp_fp_strong(&entry_fp_strong, &fp_strong)) {
                 NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
                 pentry->fp_strong = entry_fp_strong;
-                ++pentry->refcount;
+                nova_entry_refcount_get(sb, weak_find_hentry->entrynr);
                 pentry->flag = FP_STRONG_FLAG;
                 ++sbi->dup_block;
+                hit = true;
                 *blocknr = pentry->blocknr;
-                allocated = 1;
+                allocated = 0;
                 NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
                 strong_hentry = nova_alloc_hentry(sb);
                 strong_hentry->entrynr = weak_find_hentry->entrynr;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
+                hlist_add_head(&strong_hentry->node, nova_strong_bucket(sbi, strong_idx));
                 strong_find_entry = weak_find_hentry->entrynr;
             }
             else {
@@ -197,7 +431,7 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
 
                 strong_hentry = nova_alloc_hentry(sb);
                 strong_hentry->entrynr = alloc_entry;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
+                hlist_add_head(&strong_hentry->node, nova_strong_bucket(sbi, strong_idx));
                 sbi->blocknr_to_entry[*blocknr] = alloc_entry;
                 strong_find_entry = alloc_entry;
             }
@@ -219,29 +453,30 @@ int nova_dedup_str_fin(struct super_block *sb, const char* data_buffer,unsigned
 
             strong_hentry = nova_alloc_hentry(sb);
             strong_hentry->entrynr = alloc_entry;
-            hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
+            hlist_add_head(&strong_hentry->node, nova_strong_bucket(sbi, strong_idx));
             sbi->blocknr_to_entry[*blocknr] = alloc_entry;
             strong_find_entry = alloc_entry;
         }
     }
 
     NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
-    nova_flush_buffer(pentry, sizeof(*pentry), true);
+    if(flush_entry) nova_flush_pentry(pentry);
     NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
 
     if(!weak_find_hentry) {
         weak_hentry = nova_alloc_hentry(sb);
         weak_hentry->entrynr = strong_find_entry;
-        hlist_add_head(&weak_hentry->node, &sbi->weak_hash_table[weak_idx]);
+        hlist_add_head(&weak_hentry->node, nova_weak_bucket(sbi, weak_idx));
     }
+    nova_dedup_trace_fill(rec, &fp_weak, &fp_strong, strong_find_entry, hit);
 
 out:
-	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-	spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+	spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
     return allocated;
 }
 
-int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, unsigned long *blocknr) 
+int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, const u32 *csums, unsigned long *blocknr, struct nova_dedup_trace_rec *rec) 
 {
     /**
      * w_s_Fin method calculates a weak fingerprint for a data chunk
@@ -268,13 +503,13 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
     pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
 
     NOVA_START_TIMING(weak_fp_calc_t, weak_fp_calc_time);
-    nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, data_buffer,&fp_weak);
+    nova_dedup_fp_weak(sb, data_buffer, csums, &fp_weak);
     NOVA_END_TIMING(weak_fp_calc_t, weak_fp_calc_time);
 
     weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
-	spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
     NOVA_START_TIMING(hash_table_t, hash_table_time);
-    weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
+    weak_find_hentry = nova_find_in_weak_hlist(sb, nova_weak_bucket(sbi, weak_idx), &fp_weak);
     NOVA_END_TIMING(hash_table_t, hash_table_time);
 
     if(weak_find_hentry) {
@@ -310,9 +545,9 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
             strong_hentry = nova_alloc_hentry(sb);
             strong_hentry->entrynr = weak_find_hentry->entrynr;
             strong_idx = (entry_fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-	        spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
-            hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
-	        spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	        spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
+            hlist_add_head(&strong_hentry->node, nova_strong_bucket(sbi, strong_idx));
+	        spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
         }
 
         NOVA_START_TIMING(strong_fp_calc_t, strong_fp_calc_time);
@@ -322,17 +557,19 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
         if(cmp_fp_strong(&fp_strong, &entry_fp_strong)) {
             *blocknr = weak_entry->blocknr;
             NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
-            ++weak_entry->refcount;
-            flush_entry = true;
+            if(nova_entry_refcount_get(sb, weak_find_hentry->entrynr)) {
+                flush_entry = true;
+            }
             ++sbi->dup_block;
             NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
-            allocated = 1;
+            allocated = 0;
+            nova_dedup_trace_fill(rec, &fp_weak, &fp_strong, weak_find_hentry->entrynr, true);
         } 
         else {
             strong_idx = (fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
-	        spin_lock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	        spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
             NOVA_START_TIMING(hash_table_t, hash_table_time);
-            strong_find_hentry = nova_find_in_strong_hlist(sb, &sbi->strong_hash_table[strong_idx], &fp_strong);
+            strong_find_hentry = nova_find_in_strong_hlist(sb, nova_strong_bucket(sbi, strong_idx), &fp_strong);
             NOVA_END_TIMING(hash_table_t, hash_table_time);
             
             if(strong_find_hentry) {
@@ -340,12 +577,14 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
                 // add the refcount and return
                 NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
                 strong_entry = pentries + strong_find_hentry->entrynr;
-                ++strong_entry->refcount;
-                nova_flush_buffer(strong_entry,sizeof(*strong_entry),true);
+                if(nova_entry_refcount_get(sb, strong_find_hentry->entrynr)) {
+                    nova_flush_pentry(strong_entry);
+                }
                 NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
                 *blocknr = strong_entry->blocknr;
-                allocated = 1;
+                allocated = 0;
                 ++sbi->dup_block;
+                nova_dedup_trace_fill(rec, &fp_weak, &fp_strong, strong_find_hentry->entrynr, true);
             } else {
                 // if the corresponding strong fingerprint is not found
                 // alloc a new entry and write
@@ -353,7 +592,7 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
                 alloc_entry = nova_alloc_entry(sb);
                 allocated = nova_alloc_block_write(sb,data_buffer,blocknr);
                 if(allocated < 0) {
-	                spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	                spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
                     goto out;
                 }
                 
@@ -364,18 +603,19 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
                 pentry->fp_strong = fp_strong;
                 pentry->blocknr = *blocknr;
                 pentry->refcount = 1;
-                nova_flush_buffer(pentry, sizeof(*pentry), true);
+                nova_flush_pentry(pentry);
                 NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
                 strong_hentry = nova_alloc_hentry(sb);
                 strong_hentry->entrynr = alloc_entry;
-                hlist_add_head(&strong_hentry->node, &sbi->strong_hash_table[strong_idx]);
+                hlist_add_head(&strong_hentry->node, nova_strong_bucket(sbi, strong_idx));
                 sbi->blocknr_to_entry[*blocknr] = alloc_entry;
+                nova_dedup_trace_fill(rec, &fp_weak, &fp_strong, alloc_entry, false);
             }
-	        spin_unlock(sbi->strong_hash_table_locks + strong_idx % HASH_TABLE_LOCK_NUM);
+	        spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
         }
 
         NOVA_START_TIMING(upsert_entry_t, upsert_entry_time);
-        if(flush_entry) nova_flush_buffer(weak_entry, sizeof(*weak_entry), true);
+        if(flush_entry) nova_flush_pentry(weak_entry);
         NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
     }
     else {
@@ -398,21 +638,22 @@ int nova_dedup_weak_str_fin(struct super_block *sb, const char* data_buffer, uns
         pentry->fp_weak = fp_weak;
         pentry->blocknr = *blocknr;
         pentry->refcount = 1;
-        nova_flush_buffer(pentry, sizeof(*pentry),true);
+        nova_flush_pentry(pentry);
         NOVA_END_TIMING(upsert_entry_t, upsert_entry_time);
 
         weak_hentry = nova_alloc_hentry(sb);
         weak_hentry->entrynr = alloc_entry;
-        hlist_add_head(&weak_hentry->node, &sbi->weak_hash_table[weak_idx]);
+        hlist_add_head(&weak_hentry->node, nova_weak_bucket(sbi, weak_idx));
         sbi->blocknr_to_entry[*blocknr] = alloc_entry;
+        nova_dedup_trace_fill(rec, &fp_weak, NULL, alloc_entry, false);
     }
 
 out:
-	spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
     return allocated;
 }
 
-int nova_dedup_non_fin(struct super_block *sb, const char* data_buffer, unsigned long* blocknr)
+int nova_dedup_non_fin(struct super_block *sb, const char* data_buffer, unsigned long* blocknr, struct nova_dedup_trace_rec *rec)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
     struct nova_pmm_entry *pentries, *pentry;
@@ -432,31 +673,734 @@ int nova_dedup_non_fin(struct super_block *sb, const char* data_buffer, unsigned
     pentry->blocknr = *blocknr;
     pentry->flag = NON_FIN_FLAG;
     pentry->refcount = 1;
-    nova_flush_buffer(pentry, sizeof(*pentry), true);
+    nova_flush_pentry(pentry);
     sbi->blocknr_to_entry[*blocknr] = alloc_entry;
     NOVA_END_TIMING(upsert_entry_t, time);
+    nova_dedup_trace_fill(rec, NULL, NULL, alloc_entry, false);
 
 out:
     return allocated;
 }
 
+/**
+ * Zero pages are detected before any fingerprint is calculated. Eight words
+ * (one cacheline) are OR-ed per step so the compiler can vectorize the inner
+ * loop, and the first non-zero cacheline ends the scan.
+ */
+static inline bool nova_is_zero_page(const char *data_buffer)
+{
+    const u64 *p = (const u64 *)data_buffer;
+    const u64 *end = p + PAGE_SIZE / sizeof(u64);
+
+    for (; p < end; p += 8) {
+        if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Weak fingerprint of a page. With data_csum every written page gets the
+ * crc32c of each stripe for its csum slots anyway, so the fingerprint is the
+ * crc32c of those stripe csums instead of a separate crc32 over the page.
+ * @csums passes stripe csums the caller already has, NULL to calculate them.
+ * data_csum is fixed by the super block, so all entries of a file system
+ * use the same fingerprint.
+ */
+void nova_dedup_fp_weak(struct super_block *sb, const char *addr, const u32 *csums, struct nova_fp_weak *fp)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    u32 strp_csums[NOVA_PAGE_STRIPES];
+
+    if (!data_csum) {
+        nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, addr, fp);
+        return;
+    }
+
+    if (!csums) {
+        nova_block_stripe_csums(sb, (const u8 *)addr, strp_csums);
+        csums = strp_csums;
+    }
+    fp->u32 = nova_crc32c(NOVA_INIT_CSUM, (const u8 *)csums, sizeof(u32) * NOVA_PAGE_STRIPES);
+}
+
+bool nova_dedup_is_zero_block(struct super_block *sb, unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    return sbi->zero_blocknr && blocknr == sbi->zero_blocknr;
+}
+
+/* Blocks verified between two checks of the scrub bandwidth budget */
+#define NOVA_DEDUP_SCRUB_BATCH  64
+/* Pause between two passes over the entry table, and between free batch drains */
+#define NOVA_DEDUP_SCRUB_IDLE   (10 * HZ)
+
+static void nova_dedup_drain_free_batches(struct super_block *sb);
+
+/**
+ * Check the content of @blocknr against the strong fingerprint @fp. The block
+ * is copied with memcpy_mcsafe first, so a media error counts as a mismatch
+ * instead of a machine check.
+ * Returns 1 on match, 0 on mismatch and <0 if no fingerprint was calculated.
+ */
+static int nova_dedup_scrub_match(struct super_block *sb, unsigned long blocknr,
+    struct nova_fp_strong *fp, void *buf)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_fp_strong calc = {0};
+    void *kmem;
+    int ret;
+
+    kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
+    if (memcpy_mcsafe(buf, kmem, PAGE_SIZE) < 0)
+        return 0;
+    ret = nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, buf, &calc);
+    if (ret < 0)
+        return ret;
+    return cmp_fp_strong(&calc, fp);
+}
+
+static void nova_dedup_unindex(struct super_block *sb, struct hlist_head *hlist, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_hentry *hentry;
+    struct hlist_node *tmp;
+
+    hlist_for_each_entry_safe(hentry, tmp, hlist, node) {
+        if (hentry->entrynr == entrynr) {
+            hlist_del(&hentry->node);
+            kmem_cache_free(sbi->nova_hentry_cachep, hentry);
+        }
+    }
+}
+
+/**
+ * Verify one FP_STRONG entry. A mismatching block is repaired from its
+ * stripe checksums and parity when data_csum is enabled. If its content
+ * still does not match, the entry is poisoned: it leaves the index so new
+ * writes stop deduping against it, while the files that already share the
+ * block keep their references and free it as usual.
+ * Returns true if the entry was verified.
+ */
+static bool nova_dedup_scrub_entry(struct super_block *sb, entrynr_t idx, void *buf)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_inode_info_header sih;
+    struct nova_pmm_entry *pentry;
+    struct nova_fp_strong fp_strong;
+    spinlock_t *fp_lock = sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM;
+    unsigned long blocknr;
+    u32 weak_idx;
+    u64 strong_idx;
+    int match;
+
+    pentry = (struct nova_pmm_entry *)nova_get_block(sb, nova_get_block_off(sb,
+        sbi->metadata_start, NOVA_BLOCK_TYPE_4K)) + idx;
+
+    /* The fp lock keeps the block from being freed while it is hashed */
+    spin_lock(fp_lock);
+    blocknr = pentry->blocknr;
+    if (pentry->flag != FP_STRONG_FLAG || blocknr == 0 || blocknr >= sbi->num_blocks ||
+        sbi->blocknr_to_entry[blocknr] != idx) {
+        spin_unlock(fp_lock);
+        return false;
+    }
+    fp_strong = pentry->fp_strong;
+    match = nova_dedup_scrub_match(sb, blocknr, &fp_strong, buf);
+    spin_unlock(fp_lock);
+
+    if (match < 0)
+        return false;
+    sbi->dedup_scrub_verified++;
+    if (match)
+        return true;
+
+    sbi->dedup_scrub_mismatches++;
+    nova_warn("%s: entry %llu block %lu does not match its fingerprint\n",
+        __func__, idx, blocknr);
+
+    if (data_csum) {
+        /* Deduped blocks are 4K data blocks without an owning inode */
+        memset(&sih, 0, sizeof(sih));
+        sih.i_blk_type = NOVA_BLOCK_TYPE_4K;
+        nova_verify_data_csum(sb, &sih, blocknr, 0, PAGE_SIZE);
+    }
+
+    spin_lock(fp_lock);
+    if (pentry->flag != FP_STRONG_FLAG || pentry->blocknr != blocknr ||
+        !cmp_fp_strong(&pentry->fp_strong, &fp_strong)) {
+        /* Freed or reused meanwhile, the block is no longer ours to judge */
+        spin_unlock(fp_lock);
+        return true;
+    }
+    weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+    strong_idx = (pentry->fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
+    spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+    spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
+
+    if (nova_dedup_scrub_match(sb, blocknr, &fp_strong, buf) > 0) {
+        sbi->dedup_scrub_repaired++;
+        nova_info("%s: block %lu repaired\n", __func__, blocknr);
+    } else {
+        nova_dedup_unindex(sb, nova_weak_bucket(sbi, weak_idx), idx);
+        nova_dedup_unindex(sb, nova_strong_bucket(sbi, strong_idx), idx);
+        nova_rcache_invalidate(sb, blocknr);
+        pentry->flag = FP_POISON_FLAG;
+        nova_flush_buffer(&pentry->flag, sizeof(pentry->flag), true);
+        sbi->dedup_scrub_poisoned++;
+        nova_warn("%s: entry %llu poisoned, block %lu is no longer deduplicated\n",
+            __func__, idx, blocknr);
+    }
+
+    spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
+    spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+    spin_unlock(fp_lock);
+    return true;
+}
+
+/**
+ * The scrubber walks the entry table round by round and verifies at most
+ * dedup_scrub_mbps MB of blocks per second. A budget of 0 parks it. Every
+ * NOVA_DEDUP_SCRUB_IDLE, parked or not, it also drains the per-CPU free
+ * batches so dead entries do not wait for a busy CPU to fill its batch.
+ */
+static int nova_dedup_scrub(void *arg)
+{
+    struct super_block *sb = arg;
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    unsigned int mbps, batch = 0;
+    unsigned long drained = jiffies;
+    u64 start = 0, due, elapsed;
+
+    nova_dbg("Running dedup scrub thread\n");
+
+    while (!kthread_should_stop()) {
+        if (time_after(jiffies, drained + NOVA_DEDUP_SCRUB_IDLE)) {
+            nova_dedup_drain_free_batches(sb);
+            drained = jiffies;
+        }
+
+        mbps = READ_ONCE(sbi->dedup_scrub_mbps);
+        if (mbps == 0) {
+            wait_event_interruptible_timeout(sbi->dedup_scrub_wait,
+                kthread_should_stop() || READ_ONCE(sbi->dedup_scrub_mbps),
+                NOVA_DEDUP_SCRUB_IDLE);
+            batch = 0;
+            continue;
+        }
+
+        if (sbi->dedup_scrub_pos >= sbi->num_entries) {
+            sbi->dedup_scrub_pos = 0;
+            sbi->dedup_scrub_passes++;
+            wait_event_interruptible_timeout(sbi->dedup_scrub_wait,
+                kthread_should_stop(), NOVA_DEDUP_SCRUB_IDLE);
+            batch = 0;
+            continue;
+        }
+
+        if (batch == 0)
+            start = ktime_get_ns();
+        if (nova_dedup_scrub_entry(sb, sbi->dedup_scrub_pos, sbi->dedup_scrub_buf))
+            batch++;
+        sbi->dedup_scrub_pos++;
+
+        if (batch == NOVA_DEDUP_SCRUB_BATCH) {
+            due = div64_u64((u64)NOVA_DEDUP_SCRUB_BATCH * PAGE_SIZE * NSEC_PER_SEC,
+                (u64)mbps << 20);
+            elapsed = ktime_get_ns() - start;
+            if (due > elapsed)
+                wait_event_interruptible_timeout(sbi->dedup_scrub_wait,
+                    kthread_should_stop() || READ_ONCE(sbi->dedup_scrub_mbps) != mbps,
+                    nsecs_to_jiffies(due - elapsed));
+            batch = 0;
+        }
+        if ((sbi->dedup_scrub_pos & 0xfff) == 0)
+            cond_resched();
+    }
+
+    nova_dbg("Exiting dedup scrub thread\n");
+    return 0;
+}
+
+int nova_dedup_scrub_init(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    init_waitqueue_head(&sbi->dedup_scrub_wait);
+    sbi->dedup_scrub_mbps = dedup_scrub_mbps;
+    sbi->dedup_scrub_buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!sbi->dedup_scrub_buf)
+        return -ENOMEM;
+
+    sbi->dedup_scrub_thread = kthread_run(nova_dedup_scrub, sb, "nova_dedup_scrub");
+    if (IS_ERR(sbi->dedup_scrub_thread)) {
+        nova_info("Failed to start NOVA dedup scrub thread.\n");
+        sbi->dedup_scrub_thread = NULL;
+        kfree(sbi->dedup_scrub_buf);
+        sbi->dedup_scrub_buf = NULL;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void nova_dedup_scrub_stop(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    if (sbi->dedup_scrub_thread) {
+        kthread_stop(sbi->dedup_scrub_thread);
+        sbi->dedup_scrub_thread = NULL;
+    }
+    kfree(sbi->dedup_scrub_buf);
+    sbi->dedup_scrub_buf = NULL;
+}
+
+/* Set the scrub budget in MB/s, 0 parks the scrubber */
+void nova_dedup_scrub_set(struct super_block *sb, unsigned int mbps)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    WRITE_ONCE(sbi->dedup_scrub_mbps, mbps);
+    if (sbi->dedup_scrub_thread)
+        wake_up_interruptible(&sbi->dedup_scrub_wait);
+}
+
+/**
+ * Take a dead entry out of the index and give it back to the free list.
+ * The entry keeps its fingerprints after death, so its buckets are known.
+ */
+static void nova_dedup_unindex_dead(struct super_block *sb, entrynr_t idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry;
+    spinlock_t *fp_lock = sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM;
+    u32 weak_idx;
+    u64 strong_idx;
+
+    pentry = (struct nova_pmm_entry *)nova_get_block(sb, nova_get_block_off(sb,
+        sbi->metadata_start, NOVA_BLOCK_TYPE_4K)) + idx;
+
+    spin_lock(fp_lock);
+    weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+    strong_idx = (pentry->fp_strong.u64s[0] & ((1 << sbi->num_entries_bits) - 1));
+    spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+    spin_lock(nova_strong_bucket_lock(sbi, strong_idx));
+    nova_dedup_unindex(sb, nova_weak_bucket(sbi, weak_idx), idx);
+    if (pentry->flag == FP_STRONG_FLAG)
+        nova_dedup_unindex(sb, nova_strong_bucket(sbi, strong_idx), idx);
+    spin_unlock(nova_strong_bucket_lock(sbi, strong_idx));
+    spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+    spin_unlock(fp_lock);
+
+    nova_free_entry(sb, idx);
+}
+
+/* Batch lock must be held */
+static void nova_dedup_flush_free_batch(struct super_block *sb, struct nova_dedup_free_batch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->nr; i++)
+        nova_dedup_unindex_dead(sb, batch->entries[i]);
+    NOVA_STATS_ADD(dedup_free_unindexed, batch->nr);
+    batch->nr = 0;
+}
+
+static void nova_dedup_defer_unindex(struct super_block *sb, entrynr_t idx)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_free_batch *batch;
+
+    batch = get_cpu_ptr(sbi->dedup_free_batch);
+    spin_lock(&batch->lock);
+    batch->entries[batch->nr++] = idx;
+    if (batch->nr == NOVA_DEDUP_FREE_BATCH)
+        nova_dedup_flush_free_batch(sb, batch);
+    spin_unlock(&batch->lock);
+    put_cpu_ptr(sbi->dedup_free_batch);
+}
+
+/* Flush every CPU's free batch */
+static void nova_dedup_drain_free_batches(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_free_batch *batch;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        batch = per_cpu_ptr(sbi->dedup_free_batch, cpu);
+        spin_lock(&batch->lock);
+        if (batch->nr)
+            nova_dedup_flush_free_batch(sb, batch);
+        spin_unlock(&batch->lock);
+    }
+}
+
+/*
+ * The last reference to the entry of @blocknr is gone, detach the block.
+ * Entry and weak bucket locks held. Returns true if the entry has to be
+ * taken out of the index.
+ */
+static bool nova_dedup_detach_block(struct super_block *sb, struct nova_pmm_entry *pentry,
+    unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    pentry->blocknr = 0;
+    nova_flush_buffer(&pentry->blocknr, sizeof(pentry->blocknr), false);
+    sbi->blocknr_to_entry[blocknr] = -1;
+    nova_rcache_invalidate(sb, blocknr);
+    /* NON_FIN_FLAG entry is freed by background */
+    return pentry->flag != NON_FIN_FLAG;
+}
+
+/**
+ * Drop the reference a file holds on a data block. Returns true if the
+ * block has no references left and goes back to the allocator.
+ *
+ * A reference that is not the last is dropped without any lock. The last
+ * one is dropped under the entry lock and the weak bucket lock of the
+ * entry: every dedup lookup that can hit the entry holds that bucket lock,
+ * since a hit means equal content and so an equal weak fingerprint. Puts on
+ * a hot entry take the same locks, as the hot threshold only bounds the
+ * deltas of puts that are serialised against each other. Once the refcount
+ * is zero under that lock lookups skip the entry, so taking it out of the
+ * index is deferred to the per-CPU free batch instead of walking both chains
+ * for every block.
+ */
+bool nova_dedup_put_block(struct super_block *sb, unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry;
+    spinlock_t *fp_lock;
+    int64_t idx;
+    u32 weak_idx;
+    bool last, unindex = false;
+
+    if (nova_dedup_is_zero_block(sb, blocknr))
+        return false;
+
+    idx = sbi->blocknr_to_entry[blocknr];
+    if (idx < 0)
+        return true;
+
+    pentry = (struct nova_pmm_entry *)nova_get_block(sb, nova_get_block_off(sb,
+        sbi->metadata_start, NOVA_BLOCK_TYPE_4K)) + idx;
+    if (pentry->blocknr != blocknr)
+        return true;
+
+    if (nova_entry_refcount_put_shared(sb, idx)) {
+        NOVA_STATS_ADD(dedup_free_shared, 1);
+        /* The last holder may be a snapshot */
+        if (READ_ONCE(pentry->refcount) == 1)
+            nova_snapshot_space_unshare(sb, blocknr);
+        return false;
+    }
+
+    fp_lock = sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM;
+    spin_lock(fp_lock);
+    /* NOTE: pentry->fp_weak could be changed by calc_no_fin thread */
+    weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+    spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+    last = nova_entry_refcount_put(sb, idx);
+    if (last)
+        unindex = nova_dedup_detach_block(sb, pentry, blocknr);
+    spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+    spin_unlock(fp_lock);
+
+    /* Flushing the batch takes entry locks, so queue after unlocking */
+    if (unindex)
+        nova_dedup_defer_unindex(sb, idx);
+    return last;
+}
+
+/**
+ * Prepare up to @num blocks from @blocknr for writing in place. Returns how
+ * many leading blocks are exclusive to the caller, 0 if the first one is
+ * shared and has to be copied on write instead.
+ *
+ * An exclusive block loses its dedup entry: its content is about to change
+ * under the fingerprint. Refcounts are checked under the same locks the last
+ * put takes, so a concurrent dedup hit either lands before and makes the
+ * block shared, or misses the entry. A hot entry is always treated as shared.
+ */
+unsigned long nova_dedup_claim_blocks(struct super_block *sb, unsigned long blocknr,
+    unsigned long num)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentries, *pentry;
+    spinlock_t *fp_lock;
+    unsigned long i;
+    int64_t idx;
+    u32 weak_idx;
+    bool unindex;
+
+    pentries = (struct nova_pmm_entry *)nova_get_block(sb, nova_get_block_off(sb,
+        sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+
+    for (i = 0; i < num; i++, blocknr++) {
+        if (nova_dedup_is_zero_block(sb, blocknr))
+            break;
+
+        idx = sbi->blocknr_to_entry[blocknr];
+        if (idx < 0)
+            continue;
+        pentry = pentries + idx;
+        if (pentry->blocknr != blocknr)
+            continue;
+
+        fp_lock = sbi->non_dedup_fp_locks + idx % NON_DEDUP_FP_LOCK_NUM;
+        spin_lock(fp_lock);
+        weak_idx = (pentry->fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
+        spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+        if (pentry->blocknr != blocknr) {
+            /* Detached while we were waiting */
+            spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+            spin_unlock(fp_lock);
+            continue;
+        }
+        if ((pentry->tag_TXID & NOVA_REFCNT_DEFERRED) || pentry->refcount != 1) {
+            spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+            spin_unlock(fp_lock);
+            break;
+        }
+        nova_entry_refcount_put(sb, idx);
+        unindex = nova_dedup_detach_block(sb, pentry, blocknr);
+        spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
+        spin_unlock(fp_lock);
+
+        if (unindex)
+            nova_dedup_defer_unindex(sb, idx);
+        NOVA_STATS_ADD(dedup_claimed, 1);
+    }
+
+    return i;
+}
+
+/*
+ * References of the entry holding @blocknr, 0 if the block is not
+ * deduplicated. Hot entries keep part of their count in per-CPU deltas, so
+ * this is a hint only.
+ */
+u64 nova_dedup_block_refs(struct super_block *sb, unsigned long blocknr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry;
+    int64_t idx;
+
+    idx = sbi->blocknr_to_entry[blocknr];
+    if (idx < 0)
+        return 0;
+
+    pentry = (struct nova_pmm_entry *)nova_get_block(sb, nova_get_block_off(sb,
+        sbi->metadata_start, NOVA_BLOCK_TYPE_4K)) + idx;
+    if (pentry->blocknr != blocknr)
+        return 0;
+
+    return READ_ONCE(pentry->refcount);
+}
+
+int nova_dedup_free_batch_init(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    int cpu;
+
+    sbi->dedup_free_batch = alloc_percpu(struct nova_dedup_free_batch);
+    if (!sbi->dedup_free_batch)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu_ptr(sbi->dedup_free_batch, cpu)->lock);
+    return 0;
+}
+
+/* Flush every CPU's free batch and release them, at unmount */
+void nova_dedup_free_batch_exit(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+
+    if (!sbi->dedup_free_batch)
+        return;
+
+    nova_dedup_drain_free_batches(sb);
+    PERSISTENT_BARRIER();
+    free_percpu(sbi->dedup_free_batch);
+    sbi->dedup_free_batch = NULL;
+}
+
+DEFINE_STATIC_KEY_FALSE(nova_dedup_trace_key);
+static DEFINE_MUTEX(nova_dedup_trace_mutex);
+
+static void nova_dedup_trace_free_rings(struct nova_sb_info *sbi)
+{
+    int cpu;
+
+    if (!sbi->dedup_trace)
+        return;
+    for_each_possible_cpu(cpu)
+        vfree(per_cpu_ptr(sbi->dedup_trace, cpu)->recs);
+    free_percpu(sbi->dedup_trace);
+    sbi->dedup_trace = NULL;
+}
+
+/**
+ * Set the trace level of this file system. Rings are allocated on first
+ * use and kept after tracing stops, so a capture can be read afterwards.
+ * Starting a new capture empties them.
+ */
+int nova_dedup_trace_set(struct super_block *sb, int level)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_trace_ring *ring;
+    int cpu, ret = 0;
+
+    if (level < 0 || level > 2)
+        return -EINVAL;
+
+    mutex_lock(&nova_dedup_trace_mutex);
+    if (level && !sbi->dedup_trace) {
+        sbi->dedup_trace = alloc_percpu(struct nova_dedup_trace_ring);
+        if (!sbi->dedup_trace) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        for_each_possible_cpu(cpu) {
+            ring = per_cpu_ptr(sbi->dedup_trace, cpu);
+            ring->recs = vzalloc_node(sizeof(struct nova_dedup_trace_rec) * NOVA_DEDUP_TRACE_RECS,
+                                      cpu_to_node(cpu));
+            if (!ring->recs) {
+                nova_dedup_trace_free_rings(sbi);
+                ret = -ENOMEM;
+                goto out;
+            }
+        }
+    } else if (level && !sbi->dedup_trace_level) {
+        for_each_possible_cpu(cpu)
+            per_cpu_ptr(sbi->dedup_trace, cpu)->head = 0;
+    }
+
+    if (level && !sbi->dedup_trace_level)
+        static_branch_inc(&nova_dedup_trace_key);
+    else if (!level && sbi->dedup_trace_level)
+        static_branch_dec(&nova_dedup_trace_key);
+    /* Rings must be visible before writers see the level */
+    smp_store_release(&sbi->dedup_trace_level, level);
+out:
+    mutex_unlock(&nova_dedup_trace_mutex);
+    return ret;
+}
+
+void nova_dedup_trace_exit(struct super_block *sb)
+{
+    nova_dedup_trace_set(sb, 0);
+    mutex_lock(&nova_dedup_trace_mutex);
+    nova_dedup_trace_free_rings(NOVA_SB(sb));
+    mutex_unlock(&nova_dedup_trace_mutex);
+}
+
+/**
+ * Return the first record at or after *pos, where pos is
+ * cpu * NOVA_DEDUP_TRACE_RECS + index, oldest record first.
+ */
+struct nova_dedup_trace_rec *nova_dedup_trace_get(struct super_block *sb, loff_t *pos, int *cpu)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_trace_ring *ring;
+    u64 n, i = *pos % NOVA_DEDUP_TRACE_RECS;
+    int c;
+
+    if (!sbi->dedup_trace)
+        return NULL;
+
+    for (c = *pos / NOVA_DEDUP_TRACE_RECS; c < nr_cpu_ids; c++, i = 0) {
+        if (!cpu_possible(c))
+            continue;
+        ring = per_cpu_ptr(sbi->dedup_trace, c);
+        n = min_t(u64, ring->head, NOVA_DEDUP_TRACE_RECS);
+        if (i < n) {
+            *pos = (loff_t)c * NOVA_DEDUP_TRACE_RECS + i;
+            *cpu = c;
+            return &ring->recs[(ring->head - n + i) & (NOVA_DEDUP_TRACE_RECS - 1)];
+        }
+    }
+    return NULL;
+}
+
+static void nova_dedup_trace_commit(struct super_block *sb, const char *data_buffer,
+    struct nova_dedup_trace_rec *rec, u32 mode, int allocated)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_trace_ring *ring;
+    struct nova_fp_weak fp_weak;
+    struct nova_fp_strong fp_strong = {0};
+
+    rec->latency = ktime_get_ns() - rec->time;
+    rec->mode = mode;
+    if (allocated < 0)
+        rec->result = NOVA_TRACE_ERROR;
+
+    /* Filled in after the latency is taken, so it is not charged to the engine */
+    if (sbi->dedup_trace_level > 1 && rec->result != NOVA_TRACE_ZERO) {
+        if (!(rec->flags & NOVA_TRACE_WEAK)) {
+            nova_dedup_fp_weak(sb, data_buffer, NULL, &fp_weak);
+            rec->fp_weak = fp_weak.u32;
+            rec->flags |= NOVA_TRACE_WEAK | NOVA_TRACE_FILLED;
+        }
+        if (!(rec->flags & NOVA_TRACE_STRONG)) {
+            nova_fp_strong_calc(&sbi->nova_fp_strong_ctx, data_buffer, &fp_strong);
+            rec->fp_strong = fp_strong.u64s[0];
+            rec->flags |= NOVA_TRACE_STRONG | NOVA_TRACE_FILLED;
+        }
+    }
+
+    ring = get_cpu_ptr(sbi->dedup_trace);
+    ring->recs[ring->head & (NOVA_DEDUP_TRACE_RECS - 1)] = *rec;
+    ring->head++;
+    put_cpu_ptr(sbi->dedup_trace);
+}
+
 /**
  * @brief Deduplicate data blocks for NV-Dedup
  * 
  * @param sb NOVA super block
  * @param data_buffer The data block (in kernel space) to be written
+ * @param csums stripe csums of data_buffer if the caller has them, or NULL
  * @param blocknr the output block number allocated for the data block
- * @return int number of blocks allocated
+ * @return int number of blocks allocated and written, 0 if the page shares
+ *         an existing block (zero block included), <0 on error
  */
-int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, unsigned long *blocknr)
+int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, const u32 *csums, unsigned long *blocknr)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_trace_rec rec, *trec = NULL;
     u32 dup_block = 0;
     u32 dup_mode = 0;
     unsigned long randomNum;
     int allocated;
     INIT_TIMING(calc_t);
 
+    /* Patched out unless some file system has tracing on */
+    if (static_branch_unlikely(&nova_dedup_trace_key) && smp_load_acquire(&sbi->dedup_trace_level)) {
+        memset(&rec, 0, sizeof(rec));
+        rec.time = ktime_get_ns();
+        trec = &rec;
+    }
+
+    /**
+     * All-zero pages share the reserved zero block. The block is never
+     * written or freed, so no entry, refcount or hash bucket is touched,
+     * and zero pages do not skew the duplication sampler.
+     */
+    if (sbi->zero_blocknr && nova_is_zero_page(data_buffer)) {
+        *blocknr = sbi->zero_blocknr;
+        NOVA_STATS_ADD(dedup_zero_pages, 1);
+        if (unlikely(trec)) {
+            rec.result = NOVA_TRACE_ZERO;
+            nova_dedup_trace_commit(sb, data_buffer, trec, 0, 0);
+        }
+        return 0;
+    }
+
     ++sbi->cur_block;
     if(sbi->cur_block >= SAMPLE_BLOCK) {
         if(sbi->dedup_mode == NON_FIN) {
@@ -483,22 +1427,26 @@ int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, unsigne
     dup_mode = sbi->dedup_mode;
     if(dup_mode & NON_FIN) {
         NOVA_START_TIMING(non_fin_calc_t, calc_t);
-        allocated = nova_dedup_non_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_non_fin(sb, data_buffer, blocknr, trec);
         NOVA_END_TIMING(non_fin_calc_t, calc_t);
         goto out;
     }else if(dup_mode & WEAK_STR_FIN) {
         NOVA_START_TIMING(ws_fin_calc_t, calc_t);
-        allocated = nova_dedup_weak_str_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_weak_str_fin(sb, data_buffer, csums, blocknr, trec);
         NOVA_END_TIMING(ws_fin_calc_t, calc_t);
         goto out;
     }else if(dup_mode & STR_FIN) {
         NOVA_START_TIMING(str_fin_calc_t, calc_t);
-        allocated = nova_dedup_str_fin(sb, data_buffer, blocknr);
+        allocated = nova_dedup_str_fin(sb, data_buffer, csums, blocknr, trec);
         NOVA_END_TIMING(str_fin_calc_t, calc_t);
         goto out;
     }else {
         return -ESRCH;
     }
 out:
+    if (allocated == 0)
+        nova_snapshot_space_share(sb, *blocknr);
+    if (unlikely(trec))
+        nova_dedup_trace_commit(sb, data_buffer, trec, dup_mode, allocated);
     return allocated;
 }
\ No newline at end of file
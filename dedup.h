@@ -2,14 +2,72 @@
 #define __NOVA_DEDUP_H
 
 #include <linux/types.h>
+#include <linux/jump_label.h>
 #include "entry.h"
 
+/**
+ * Dedup decision trace. Each CPU owns a ring of NOVA_DEDUP_TRACE_RECS
+ * records that is written with preemption off and no lock. Level 1 traces
+ * decisions only; level 2 also fills in fingerprints the chosen mode did
+ * not calculate, so every record can be replayed.
+ */
+#define NOVA_DEDUP_TRACE_RECS   8192
+
+enum nova_dedup_trace_result {
+    NOVA_TRACE_MISS = 0,
+    NOVA_TRACE_HIT,
+    NOVA_TRACE_ZERO,
+    NOVA_TRACE_ERROR,
+};
+
+#define NOVA_TRACE_WEAK         0x1     /* fp_weak valid */
+#define NOVA_TRACE_STRONG       0x2     /* fp_strong valid */
+#define NOVA_TRACE_FILLED       0x4     /* fps calculated by the tracer */
+
+struct nova_dedup_trace_rec {
+    u64 time;                           /* ktime ns at entry */
+    u64 fp_strong;                      /* first word of the strong fp */
+    u64 entrynr;
+    u32 fp_weak;
+    u32 latency;                        /* ns */
+    u8 mode;
+    u8 result;
+    u8 flags;
+};
+
+struct nova_dedup_trace_ring {
+    u64 head;
+    struct nova_dedup_trace_rec *recs;
+};
+
+DECLARE_STATIC_KEY_FALSE(nova_dedup_trace_key);
+
 struct nova_hentry{
     struct hlist_node node;
     entrynr_t entrynr;
 };
 
-extern int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, unsigned long *blocknr);
+/* Entries whose last reference is gone wait here to leave the index */
+#define NOVA_DEDUP_FREE_BATCH 64
+
+struct nova_dedup_free_batch {
+    spinlock_t lock;
+    int nr;
+    entrynr_t entries[NOVA_DEDUP_FREE_BATCH];
+};
+
+/* Outcome of rebuilding a range of the entry table at mount */
+struct nova_dedup_rebuild_stats {
+    unsigned long live;
+    unsigned long drifted;              /* PM refcount corrected */
+    unsigned long orphans;              /* entries no block reference left */
+};
+
+extern int nova_dedup_new_write(struct super_block *sb,const char* data_buffer, const u32 *csums, unsigned long *blocknr);
+
+extern void nova_dedup_fp_weak(struct super_block *sb, const char *addr, const u32 *csums, struct nova_fp_weak *fp);
+
+extern bool nova_dedup_is_zero_block(struct super_block *sb, unsigned long blocknr);
 
 struct nova_hentry *nova_find_in_weak_hlist(struct super_block *sb, struct hlist_head *hlist, struct nova_fp_weak *fp_weak);
 
@@ -17,4 +75,34 @@ struct nova_hentry *nova_find_in_strong_hlist(struct super_block *sb, struct hli
 
 struct nova_hentry *nova_alloc_hentry(struct super_block* sb);
 
+extern int nova_dedup_init_shards(struct super_block *sb, size_t sz);
+
+extern void nova_dedup_free_shards(struct super_block *sb);
+
+extern void nova_dedup_rebuild_entries(struct super_block *sb, entrynr_t start, entrynr_t end,
+    const atomic_t *refs, struct nova_dedup_rebuild_stats *stats);
+
+extern bool nova_dedup_put_block(struct super_block *sb, unsigned long blocknr);
+
+extern unsigned long nova_dedup_claim_blocks(struct super_block *sb, unsigned long blocknr,
+    unsigned long num);
+
+extern u64 nova_dedup_block_refs(struct super_block *sb, unsigned long blocknr);
+
+extern int nova_dedup_free_batch_init(struct super_block *sb);
+
+extern void nova_dedup_free_batch_exit(struct super_block *sb);
+
+extern int nova_dedup_scrub_init(struct super_block *sb);
+
+extern void nova_dedup_scrub_stop(struct super_block *sb);
+
+extern void nova_dedup_scrub_set(struct super_block *sb, unsigned int mbps);
+
+extern int nova_dedup_trace_set(struct super_block *sb, int level);
+
+extern void nova_dedup_trace_exit(struct super_block *sb);
+
+extern struct nova_dedup_trace_rec *nova_dedup_trace_get(struct super_block *sb, loff_t *pos, int *cpu);
+
 #endif
\ No newline at end of file
@@ -12,13 +12,27 @@ entrynr_t nova_alloc_entry(struct super_block *sb)
 {
     entrynr_t entrynr;
     struct nova_sb_info *sbi = NOVA_SB(sb);
-    struct nova_entry_node *alloc_entry;
+    struct nova_entry_node *alloc_entry = NULL;
+    struct nova_dedup_shard *shard;
+    int local, i;
 
-    spin_lock(&sbi->free_list_lock);
-    alloc_entry = list_first_entry(&sbi->meta_free_list,struct nova_entry_node, link);
-    list_del(&alloc_entry->link);
+    /* Prefer entries homed on the local node, then steal from the others */
+    local = sbi->node_to_shard[numa_node_id()];
+    for (i = 0; i < sbi->dedup_nr_shards; i++) {
+        shard = sbi->dedup_shards[(local + i) % sbi->dedup_nr_shards];
+        spin_lock(&shard->free_list_lock);
+        if (!list_empty(&shard->meta_free_list)) {
+            alloc_entry = list_first_entry(&shard->meta_free_list,struct nova_entry_node, link);
+            list_del(&alloc_entry->link);
+        }
+        spin_unlock(&shard->free_list_lock);
+        if (alloc_entry)
+            break;
+    }
+
+    if (i != 0)
+        NOVA_STATS_ADD(dedup_remote_entry_updates, 1);
     entrynr = alloc_entry->entrynr;
-    spin_unlock(&sbi->free_list_lock);
 
     return entrynr;
 }
@@ -31,24 +45,39 @@ int nova_free_entry(struct super_block *sb, entrynr_t entrynr)
 {
     struct nova_sb_info *sbi = NOVA_SB(sb);
     struct nova_entry_node *free_entry;
+    struct nova_dedup_shard *shard = nova_entry_shard(sbi, entrynr);
     
-    spin_lock(&sbi->free_list_lock);
+    spin_lock(&shard->free_list_lock);
     free_entry = &sbi->free_list_buf[entrynr];
-    list_add_tail(&free_entry->link,&sbi->meta_free_list);
-    spin_unlock(&sbi->free_list_lock);
+    list_add_tail(&free_entry->link,&shard->meta_free_list);
+    spin_unlock(&shard->free_list_lock);
 
     return 0;
 }
 
+/*
+ * Take an entry found live at mount off its shard's free list
+ */
+void nova_reserve_entry(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_dedup_shard *shard = nova_entry_shard(sbi, entrynr);
+
+    spin_lock(&shard->free_list_lock);
+    list_del_init(&sbi->free_list_buf[entrynr].link);
+    spin_unlock(&shard->free_list_lock);
+}
+
 /*
 * Author:Hsiao
-* init entry free list
+* init entry free list, split into one contiguous range per dedup shard
 */
 int nova_init_entry_list(struct super_block *sb){
     struct nova_sb_info *sbi = NOVA_SB(sb);
     size_t buf_sz;
     unsigned long i;
     struct nova_entry_node *i_node;
+    struct nova_dedup_shard *shard;
 
     buf_sz = sbi->num_blocks * sizeof(struct nova_entry_node);
     sbi->free_list_buf = vzalloc(buf_sz);
@@ -57,14 +86,20 @@ int nova_init_entry_list(struct super_block *sb){
         return -ENOMEM;
     }
 
-    INIT_LIST_HEAD(&sbi->meta_free_list);
-    spin_lock_init(&sbi->free_list_lock);
-
+    sbi->shard_entries = DIV_ROUND_UP(sbi->num_blocks, sbi->dedup_nr_shards);
+    for(i = 0; i < sbi->dedup_nr_shards; ++i) {
+        shard = sbi->dedup_shards[i];
+        INIT_LIST_HEAD(&shard->meta_free_list);
+        spin_lock_init(&shard->free_list_lock);
+        shard->entry_start = i * sbi->shard_entries;
+        shard->entry_end = min(shard->entry_start + sbi->shard_entries, sbi->num_blocks);
+    }
 
     for(i = 0; i < sbi->num_blocks; ++i) {
         i_node = &sbi->free_list_buf[i];
         i_node->entrynr = i;
-        list_add_tail(&i_node->link,&sbi->meta_free_list);
+        shard = nova_entry_shard(sbi, i);
+        list_add_tail(&i_node->link,&shard->meta_free_list);
     }
     return 0;
 }
@@ -79,6 +114,240 @@ void nova_free_entry_list(struct super_block *sb)
 
     vfree(sbi->free_list_buf);
 }
+/*
+ * Hot entry refcounts.
+ *
+ * Once the PM refcount of an entry reaches sbi->refcount_hot_thresh, gets
+ * and puts are accumulated in a per-CPU delta cache instead of bouncing the
+ * shared 64 B entry between CPUs. A CPU never holds more than
+ * NOVA_REFCNT_DELTA_MAX for one entry, and the threshold is larger than the
+ * sum of all CPUs' deltas plus the put being deferred, so a put taken while
+ * the PM refcount is above it can never be the last reference.
+ *
+ * Every deferred delta is preceded by a durable tag in tag_TXID with the
+ * current epoch, whichever path defers it, so an entry can only hold deltas
+ * while tagged. The tag is cleared once all deltas are folded back; an entry
+ * still tagged after a crash has a stale PM refcount and must be reconciled.
+ */
+static inline struct nova_pmm_entry *nova_get_pentry(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentries;
+
+    pentries = nova_get_block(sb, nova_get_block_off(sb, sbi->metadata_start, NOVA_BLOCK_TYPE_4K));
+    return pentries + entrynr;
+}
+
+/* Slot lock must be held. Entry refcounts may be folded concurrently by
+ * other CPUs evicting their slots, hence the atomic update. */
+static void nova_fold_refcount_delta(struct super_block *sb, struct nova_refcount_delta *slot)
+{
+    struct nova_pmm_entry *pentry = nova_get_pentry(sb, slot->entrynr);
+
+    atomic64_add(slot->delta, (atomic64_t *)&pentry->refcount);
+    nova_flush_buffer(&pentry->refcount, sizeof(pentry->refcount), false);
+    slot->delta = 0;
+    NOVA_STATS_ADD(dedup_refcount_folds, 1);
+}
+
+/* Bucket locks of the entry must be held, they serialise tag updates */
+static void nova_defer_refcount(struct super_block *sb, entrynr_t entrynr, int64_t delta)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry = nova_get_pentry(sb, entrynr);
+    struct nova_refcount_cache *cache;
+    struct nova_refcount_delta *slot;
+
+    if (!(pentry->tag_TXID & NOVA_REFCNT_DEFERRED)) {
+        pentry->tag_TXID = NOVA_REFCNT_DEFERRED | nova_get_epoch_id(sb);
+        nova_flush_buffer(&pentry->tag_TXID, sizeof(pentry->tag_TXID), true);
+        NOVA_STATS_ADD(dedup_entry_fences, 1);
+    }
+
+    cache = get_cpu_ptr(sbi->refcount_deltas);
+    slot = &cache->slots[entrynr % NOVA_REFCNT_DELTA_SLOTS];
+    spin_lock(&cache->lock);
+    if (slot->delta != 0 && slot->entrynr != entrynr)
+        nova_fold_refcount_delta(sb, slot);
+    slot->entrynr = entrynr;
+    slot->delta += delta;
+    if (slot->delta > NOVA_REFCNT_DELTA_MAX || slot->delta < -NOVA_REFCNT_DELTA_MAX)
+        nova_fold_refcount_delta(sb, slot);
+    spin_unlock(&cache->lock);
+    put_cpu_ptr(sbi->refcount_deltas);
+    NOVA_STATS_ADD(dedup_refcount_deferred, 1);
+}
+
+/* Fold every CPU's delta for @entrynr so the PM refcount is exact again */
+static void nova_fold_entry_deltas(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_refcount_cache *cache;
+    struct nova_refcount_delta *slot;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        cache = per_cpu_ptr(sbi->refcount_deltas, cpu);
+        slot = &cache->slots[entrynr % NOVA_REFCNT_DELTA_SLOTS];
+        spin_lock(&cache->lock);
+        if (slot->delta != 0 && slot->entrynr == entrynr)
+            nova_fold_refcount_delta(sb, slot);
+        spin_unlock(&cache->lock);
+    }
+}
+
+static inline bool nova_entry_is_hot(struct nova_sb_info *sbi, struct nova_pmm_entry *pentry)
+{
+    return sbi->refcount_deltas &&
+           (int64_t)pentry->refcount >= sbi->refcount_hot_thresh;
+}
+
+/*
+ * Take a reference on @entrynr. The caller holds the bucket lock of the
+ * entry. Returns true if the PM entry was modified and must be flushed.
+ */
+bool nova_entry_refcount_get(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry = nova_get_pentry(sb, entrynr);
+
+    if (nova_entry_shard(sbi, entrynr)->node != numa_node_id())
+        NOVA_STATS_ADD(dedup_remote_entry_updates, 1);
+
+    if (nova_entry_is_hot(sbi, pentry)) {
+        nova_defer_refcount(sb, entrynr, 1);
+        return false;
+    }
+
+    atomic64_inc((atomic64_t *)&pentry->refcount);
+    return true;
+}
+
+/*
+ * Drop a reference on @entrynr. The caller holds the bucket locks of the
+ * entry. Returns true if this was the last reference.
+ */
+bool nova_entry_refcount_put(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry = nova_get_pentry(sb, entrynr);
+    bool deferred = pentry->tag_TXID & NOVA_REFCNT_DEFERRED;
+    int64_t refcount;
+
+    if (nova_entry_is_hot(sbi, pentry)) {
+        nova_defer_refcount(sb, entrynr, -1);
+        return false;
+    }
+
+    if (deferred) {
+        nova_fold_entry_deltas(sb, entrynr);
+        if (nova_entry_is_hot(sbi, pentry)) {
+            nova_defer_refcount(sb, entrynr, -1);
+            return false;
+        }
+    }
+
+    refcount = atomic64_dec_return((atomic64_t *)&pentry->refcount);
+    nova_flush_buffer(&pentry->refcount, sizeof(pentry->refcount), false);
+
+    if (deferred) {
+        /* PM refcount is exact again, drop the tag after it is durable */
+        PERSISTENT_BARRIER();
+        pentry->tag_TXID = 0;
+        nova_flush_buffer(&pentry->tag_TXID, sizeof(pentry->tag_TXID), true);
+    }
+
+    return refcount == 0;
+}
+
+/*
+ * Drop a reference on @entrynr without any lock, as long as it is not the
+ * last one. Returns false if it may be the last one, or if the entry is hot;
+ * the caller then drops it with nova_entry_refcount_put() under the locks.
+ */
+bool nova_entry_refcount_put_shared(struct super_block *sb, entrynr_t entrynr)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_pmm_entry *pentry = nova_get_pentry(sb, entrynr);
+
+    /*
+     * Unlocked deferred puts could together hide the last reference while
+     * another CPU folds, and deltas must be folded before the PM refcount
+     * is touched again.
+     */
+    if (nova_entry_is_hot(sbi, pentry) ||
+        (pentry->tag_TXID & NOVA_REFCNT_DEFERRED))
+        return false;
+
+    if (!atomic64_add_unless((atomic64_t *)&pentry->refcount, -1, 1))
+        return false;
+    nova_flush_buffer(&pentry->refcount, sizeof(pentry->refcount), false);
+    return true;
+}
+
+int nova_entry_refcount_init(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_refcount_cache *cache;
+    int cpu;
+
+    sbi->refcount_deltas = alloc_percpu(struct nova_refcount_cache);
+    if (!sbi->refcount_deltas)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        cache = per_cpu_ptr(sbi->refcount_deltas, cpu);
+        spin_lock_init(&cache->lock);
+    }
+    /*
+     * Every CPU may hold -NOVA_REFCNT_DELTA_MAX and the deferred put itself
+     * is one more, so keep one reference beyond that.
+     */
+    sbi->refcount_hot_thresh = NOVA_REFCNT_DELTA_MAX * num_possible_cpus() + 2;
+    return 0;
+}
+
+/*
+ * Fold all outstanding deltas into PM and clear the deferred tags, so that
+ * a clean unmount leaves exact refcounts behind.
+ */
+void nova_entry_refcount_exit(struct super_block *sb)
+{
+    struct nova_sb_info *sbi = NOVA_SB(sb);
+    struct nova_refcount_cache *cache;
+    struct nova_pmm_entry *pentry;
+    unsigned long idx;
+    int cpu, i;
+
+    if (!sbi->refcount_deltas)
+        return;
+
+    if (sbi->virt_addr) {
+        for_each_possible_cpu(cpu) {
+            cache = per_cpu_ptr(sbi->refcount_deltas, cpu);
+            spin_lock(&cache->lock);
+            for (i = 0; i < NOVA_REFCNT_DELTA_SLOTS; i++) {
+                if (cache->slots[i].delta != 0)
+                    nova_fold_refcount_delta(sb, &cache->slots[i]);
+            }
+            spin_unlock(&cache->lock);
+        }
+        PERSISTENT_BARRIER();
+
+        for (idx = 0; idx < sbi->num_entries; ++idx) {
+            pentry = nova_get_pentry(sb, idx);
+            if (pentry->tag_TXID & NOVA_REFCNT_DEFERRED) {
+                pentry->tag_TXID = 0;
+                nova_flush_buffer(&pentry->tag_TXID, sizeof(pentry->tag_TXID), false);
+            }
+        }
+        PERSISTENT_BARRIER();
+    }
+
+    free_percpu(sbi->refcount_deltas);
+    sbi->refcount_deltas = NULL;
+}
+
 /**
  * @author
  * 
@@ -143,10 +412,10 @@ static int nova_calc_non_fin(struct super_block *sb)
                sbi->blocknr_to_entry[pentry->blocknr] == idx) {
                 blocknr = pentry->blocknr;
                 kmem = nova_get_block(sb, nova_get_block_off(sb, blocknr, NOVA_BLOCK_TYPE_4K));
-                nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, kmem, &fp_weak);
+                nova_dedup_fp_weak(sb, kmem, NULL, &fp_weak);
                 weak_idx = (fp_weak.u32 & ((1 << sbi->num_entries_bits) - 1));
-	            spin_lock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
-                weak_find_hentry = nova_find_in_weak_hlist(sb, &sbi->weak_hash_table[weak_idx], &fp_weak);
+	            spin_lock(nova_weak_bucket_lock(sbi, weak_idx));
+                weak_find_hentry = nova_find_in_weak_hlist(sb, nova_weak_bucket(sbi, weak_idx), &fp_weak);
                 if (weak_find_hentry) {
                     /* non dedup this block now, or we must free the block, if this block is 
                        referenced by file already, things get complex. */
@@ -178,9 +447,9 @@ static int nova_calc_non_fin(struct super_block *sb)
                     nova_flush_buffer(pentry, sizeof(*pentry), true);
                     hentry = nova_alloc_hentry(sb);
                     hentry->entrynr = idx;
-                    hlist_add_head(&hentry->node, &sbi->weak_hash_table[weak_idx]);
+                    hlist_add_head(&hentry->node, nova_weak_bucket(sbi, weak_idx));
                 }
-	            spin_unlock(sbi->weak_hash_table_locks + weak_idx % HASH_TABLE_LOCK_NUM);
+	            spin_unlock(nova_weak_bucket_lock(sbi, weak_idx));
                 // sbi->weak_hash_table[weak_idx] = idx;
             }
         }
@@ -8,6 +8,8 @@ typedef uint64_t entrynr_t;
 #define NON_FIN_FLAG 0xFF
 #define FP_WEAK_FLAG 0xFE
 #define FP_STRONG_FLAG 0xEF
+/* Block failed scrubbing: still referenced, never deduped against again */
+#define FP_POISON_FLAG 0xDD
 
 struct nova_pmm_entry {
     uint64_t tag_TXID;
@@ -22,6 +24,40 @@ struct nova_pmm_entry {
 
 _Static_assert(sizeof(struct nova_pmm_entry) == 64, "Metadata Entry not 64B!");
 
+/* tag_TXID bit: refcount of this entry is partly held in per-CPU deltas */
+#define NOVA_REFCNT_DEFERRED    (1ULL << 63)
+#define NOVA_REFCNT_DELTA_SLOTS 64
+/* Max |delta| a CPU may hold for one entry before folding it into PM */
+#define NOVA_REFCNT_DELTA_MAX   16
+
+/*
+ * Behaviours of the kernel dedup engine on top of the lookup and refcount
+ * rules of the paper. replay/udedup.h states for each one whether the
+ * userspace model implements it, and stops building when a bit is added here
+ * without updating it.
+ */
+#define NOVA_DEDUP_FEAT_ZERO_BLOCK      (1U << 0)   /* all-zero pages share one block */
+#define NOVA_DEDUP_FEAT_CSUM_WEAK_FP    (1U << 1)   /* block csums double as weak fp */
+#define NOVA_DEDUP_FEAT_HOT_REFCOUNT    (1U << 2)   /* per-CPU deltas for hot entries */
+#define NOVA_DEDUP_FEAT_BATCHED_FLUSH   (1U << 3)   /* entries fenced with the log tail */
+#define NOVA_DEDUP_FEAT_NUMA_SHARDS     (1U << 4)   /* entry table and index per node */
+#define NOVA_DEDUP_FEAT_BATCHED_UNINDEX (1U << 5)   /* unlocked puts, batched unindex */
+#define NOVA_DEDUP_FEATURES \
+    (NOVA_DEDUP_FEAT_ZERO_BLOCK | NOVA_DEDUP_FEAT_CSUM_WEAK_FP | \
+     NOVA_DEDUP_FEAT_HOT_REFCOUNT | NOVA_DEDUP_FEAT_BATCHED_FLUSH | \
+     NOVA_DEDUP_FEAT_NUMA_SHARDS | NOVA_DEDUP_FEAT_BATCHED_UNINDEX)
+
+#ifdef __KERNEL__
+struct nova_refcount_delta {
+    entrynr_t entrynr;
+    int64_t delta;
+};
+
+struct nova_refcount_cache {
+    spinlock_t lock;
+    struct nova_refcount_delta slots[NOVA_REFCNT_DELTA_SLOTS];
+};
+
 struct nova_entry_node
 {
     struct list_head link;
@@ -32,9 +68,16 @@ extern entrynr_t nova_alloc_entry(struct super_block *sb);
 extern int nova_init_entry_list(struct super_block *sb);
 extern int nova_free_entry(struct super_block *sb,entrynr_t entry);
 extern void nova_free_entry_list(struct super_block *sb) ;
+extern void nova_reserve_entry(struct super_block *sb, entrynr_t entrynr);
+extern int nova_entry_refcount_init(struct super_block *sb);
+extern void nova_entry_refcount_exit(struct super_block *sb);
+extern bool nova_entry_refcount_get(struct super_block *sb, entrynr_t entrynr);
+extern bool nova_entry_refcount_put(struct super_block *sb, entrynr_t entrynr);
+extern bool nova_entry_refcount_put_shared(struct super_block *sb, entrynr_t entrynr);
 // entrynr_t nova_alloc_free_entry(struct super_block *sb);
 
 extern int nova_calc_non_fin_thread_init(struct super_block *sb);
 extern int nova_calc_non_fin_stop(struct super_block *sb);
 extern void wakeup_calc_non_fin(struct super_block *sb);
+#endif /* __KERNEL__ */
 #endif // __NOVA_ENTRY_H
\ No newline at end of file
@@ -21,6 +21,7 @@
 #include <linux/uio.h>
 #include <linux/uaccess.h>
 #include <linux/falloc.h>
+#include <linux/prefetch.h>
 #include <asm/mman.h>
 #include "nova.h"
 #include "inode.h"
@@ -455,20 +456,131 @@ out_unlock:
 	return ret;
 }
 
+/* Segments resolved per read window, and bytes prefetched per segment */
+#define NOVA_READ_SEGS		16
+#define NOVA_READ_PREFETCH	512
+
+/* File pages [index, index + num) in contiguous blocks from nvmm, 0: hole */
+struct nova_read_seg {
+	unsigned long index;
+	unsigned long nvmm;
+	unsigned long num;
+};
+
+/*
+ * Resolve pages [index, last] of a read into at most @max segments in one
+ * walk of the extent tree. Neighbouring extents whose blocks are physically
+ * contiguous share a segment, even if they belong to different write
+ * entries. Returns the number of segments; they cover a prefix of the
+ * range.
+ */
+static int nova_map_read_window(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long index,
+	unsigned long last, struct nova_read_seg *segs, int max)
+{
+	struct nova_file_write_entry *entryc, entry_copy;
+	struct nova_file_extent *ext;
+	struct nova_read_seg *prev;
+	struct rb_node *next;
+	unsigned long end, nvmm;
+	int nr = 0;
+
+	ext = nova_find_file_extent(sih, index);
+	while (index <= last) {
+		if (!ext || ext->pgoff > index) {
+			end = ext ? min(ext->pgoff - 1, last) : last;
+			nvmm = 0;
+		} else {
+			if (metadata_csum == 0) {
+				entryc = ext->entry;
+			} else {
+				entryc = &entry_copy;
+				if (!nova_verify_entry_csum(sb, ext->entry,
+							    entryc))
+					return -EIO;
+			}
+
+			end = min(ext->pgoff + ext->num_pages - 1, last);
+			nvmm = get_nvmm(sb, sih, entryc, index);
+		}
+
+		prev = nr ? &segs[nr - 1] : NULL;
+		if (prev && ((nvmm == 0 && prev->nvmm == 0) ||
+			     (nvmm && prev->nvmm &&
+			      prev->nvmm + prev->num == nvmm))) {
+			prev->num += end - index + 1;
+		} else {
+			if (nr == max)
+				break;
+			segs[nr].index = index;
+			segs[nr].nvmm = nvmm;
+			segs[nr].num = end - index + 1;
+			nr++;
+		}
+
+		if (nvmm) {
+			next = rb_next(&ext->node);
+			ext = next ? container_of(next, struct nova_file_extent,
+						  node) : NULL;
+		}
+		index = end + 1;
+	}
+
+	return nr;
+}
+
+/*
+ * Copy @nr bytes at @offset of the data segment at @nvmm page by page through
+ * the read cache. Pages the cache does not take are verified and read from PM.
+ */
+static int nova_read_cached_seg(struct super_block *sb,
+	struct nova_inode_info_header *sih, char __user *buf,
+	unsigned long nvmm, unsigned long offset, unsigned long nr)
+{
+	struct nova_rcache_block *blk;
+	unsigned long bytes, left;
+	void *dax_mem;
+
+	while (nr) {
+		bytes = min_t(unsigned long, nr, PAGE_SIZE - offset);
+		blk = nova_rcache_get(sb, sih, nvmm);
+		if (blk) {
+			left = __copy_to_user(buf, blk->data + offset, bytes);
+			nova_rcache_put(blk);
+		} else {
+			if (data_csum > 0 &&
+			    !nova_verify_data_csum(sb, sih, nvmm, offset, bytes))
+				return -EIO;
+			dax_mem = nova_get_block(sb, nvmm << PAGE_SHIFT);
+			left = __copy_to_user(buf, dax_mem + offset, bytes);
+		}
+		if (left)
+			return -EFAULT;
+
+		buf += bytes;
+		nr -= bytes;
+		nvmm++;
+		offset = 0;
+	}
+
+	return 0;
+}
+
 static ssize_t
 do_dax_mapping_read(struct file *filp, char __user *buf,
 	size_t len, loff_t *ppos)
 {
 	struct inode *inode = filp->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct nova_inode_info *si = NOVA_I(inode);
 	struct nova_inode_info_header *sih = &si->header;
-	struct nova_file_write_entry *entry;
-	struct nova_file_write_entry *entryc, entry_copy;
-	pgoff_t index, end_index;
+	struct nova_read_seg segs[NOVA_READ_SEGS];
+	pgoff_t index, last_index;
 	unsigned long offset;
 	loff_t isize, pos;
 	size_t copied = 0, error = 0;
+	int i, nr_segs;
 	INIT_TIMING(memcpy_time);
 
 	pos = *ppos;
@@ -493,95 +605,96 @@ do_dax_mapping_read(struct file *filp, char __user *buf,
 	if (len <= 0)
 		goto out;
 
-	entryc = (metadata_csum == 0) ? entry : &entry_copy;
-
-	end_index = (isize - 1) >> PAGE_SHIFT;
+	/*
+	 * Resolve a window of page mappings at once, then copy it segment
+	 * by segment while the head of the next segment is prefetched.
+	 */
+	last_index = (pos + len - 1) >> PAGE_SHIFT;
 	do {
-		unsigned long nr, left;
-		unsigned long nvmm;
-		void *dax_mem = NULL;
-		int zero = 0;
-
-		/* nr is the maximum number of bytes to copy from this page */
-		if (index >= end_index) {
-			if (index > end_index)
-				goto out;
-			nr = ((isize - 1) & ~PAGE_MASK) + 1;
-			if (nr <= offset)
-				goto out;
-		}
-
-		entry = nova_get_write_entry(sb, sih, index);
-		if (unlikely(entry == NULL)) {
-			nova_dbgv("Required extent not found: pgoff %lu, inode size %lld\n",
-				index, isize);
-			nr = PAGE_SIZE;
-			zero = 1;
-			goto memcpy;
-		}
-
-		if (metadata_csum == 0)
-			entryc = entry;
-		else if (!nova_verify_entry_csum(sb, entry, entryc))
-			return -EIO;
-
-		/* Find contiguous blocks */
-		if (index < entryc->pgoff ||
-			index - entryc->pgoff >= entryc->num_pages) {
-			nova_err(sb, "%s ERROR: %lu, entry pgoff %llu, num %u, blocknr %llu\n",
-				__func__, index, entry->pgoff,
-				entry->num_pages, entry->block >> PAGE_SHIFT);
-			return -EINVAL;
-		}
-		if (entryc->reassigned == 0) {
-			nr = (entryc->num_pages - (index - entryc->pgoff))
-				* PAGE_SIZE;
-		} else {
-			nr = PAGE_SIZE;
+		nr_segs = nova_map_read_window(sb, sih, index, last_index,
+						segs, NOVA_READ_SEGS);
+		if (nr_segs < 0) {
+			error = nr_segs;
+			goto out;
 		}
 
-		nvmm = get_nvmm(sb, sih, entryc, index);
-		dax_mem = nova_get_block(sb, (nvmm << PAGE_SHIFT));
-
-memcpy:
-		nr = nr - offset;
-		if (nr > len - copied)
-			nr = len - copied;
+		for (i = 0; i < nr_segs; i++) {
+			unsigned long nr, left;
+			void *dax_mem = NULL;
+			bool cached = false;
+			int ret;
+
+			if (i + 1 < nr_segs && segs[i + 1].nvmm)
+				prefetch_range(nova_get_block(sb,
+					segs[i + 1].nvmm << PAGE_SHIFT),
+					NOVA_READ_PREFETCH);
+
+			nr = segs[i].num * PAGE_SIZE - offset;
+			if (nr > len - copied)
+				nr = len - copied;
+
+			if (segs[i].nvmm == 0) {
+				nova_dbgv("Required extent not found: pgoff %lu, inode size %lld\n",
+					index, isize);
+			} else {
+				dax_mem = nova_get_block(sb,
+						(segs[i].nvmm << PAGE_SHIFT));
+				/* Mapped pages may change under us */
+				cached = sbi->read_cache &&
+					!nova_find_pgoff_in_vma(inode, index);
+			}
 
-		if ((!zero) && (data_csum > 0)) {
-			if (nova_find_pgoff_in_vma(inode, index))
-				goto skip_verify;
+			if (cached) {
+				NOVA_START_TIMING(memcpy_r_nvmm_t, memcpy_time);
+				ret = nova_read_cached_seg(sb, sih, buf + copied,
+						segs[i].nvmm, offset, nr);
+				NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+				if (ret == -EIO)
+					nova_err(sb, "%s: nova data checksum and recovery fail! inode %lu, offset %lu, %lu pages, pgoff %lu\n",
+						 __func__, inode->i_ino, offset,
+						 segs[i].num, index);
+				if (ret) {
+					error = ret;
+					goto out;
+				}
+				goto next;
+			}
 
-			if (!nova_verify_data_csum(sb, sih, nvmm, offset, nr)) {
-				nova_err(sb, "%s: nova data checksum and recovery fail! inode %lu, offset %lu, entry pgoff %lu, %u pages, pgoff %lu\n",
+			if (dax_mem && data_csum > 0 &&
+			    !nova_find_pgoff_in_vma(inode, index) &&
+			    !nova_verify_data_csum(sb, sih, segs[i].nvmm,
+						   offset, nr)) {
+				nova_err(sb, "%s: nova data checksum and recovery fail! inode %lu, offset %lu, %lu pages, pgoff %lu\n",
 					 __func__, inode->i_ino, offset,
-					 entry->pgoff, entry->num_pages, index);
+					 segs[i].num, index);
 				error = -EIO;
 				goto out;
 			}
-		}
-skip_verify:
-		NOVA_START_TIMING(memcpy_r_nvmm_t, memcpy_time);
 
-		if (!zero)
-			left = __copy_to_user(buf + copied,
-						dax_mem + offset, nr);
-		else
-			left = __clear_user(buf + copied, nr);
+			NOVA_START_TIMING(memcpy_r_nvmm_t, memcpy_time);
 
-		NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+			if (dax_mem)
+				left = __copy_to_user(buf + copied,
+							dax_mem + offset, nr);
+			else
+				left = __clear_user(buf + copied, nr);
 
-		if (left) {
-			nova_dbg("%s ERROR!: bytes %lu, left %lu\n",
-				__func__, nr, left);
-			error = -EFAULT;
-			goto out;
-		}
+			NOVA_END_TIMING(memcpy_r_nvmm_t, memcpy_time);
+
+			if (left) {
+				nova_dbg("%s ERROR!: bytes %lu, left %lu\n",
+					__func__, nr, left);
+				error = -EFAULT;
+				goto out;
+			}
 
-		copied += (nr - left);
-		offset += (nr - left);
-		index += offset >> PAGE_SHIFT;
-		offset &= ~PAGE_MASK;
+next:
+			copied += nr;
+			offset += nr;
+			index += offset >> PAGE_SHIFT;
+			offset &= ~PAGE_MASK;
+		}
+		NOVA_STATS_ADD(read_segs, nr_segs);
 	} while (copied < len);
 
 out:
@@ -622,6 +735,31 @@ struct write_env {
 	unsigned long start_blocknr;
 };
 
+/* Write entries a COW write collects before it appends them */
+#define NOVA_WRITE_ENTRY_BATCH	\
+	(PAGE_SIZE / sizeof(struct nova_file_write_entry))
+
+/*
+ * Drop the references an aborted COW write holds on pages that never reached
+ * the log: the runs waiting in @batch and the open run in @env. Entries that
+ * were appended are dropped by nova_cleanup_incomplete_write().
+ */
+static void nova_drop_pending_write(struct super_block *sb,
+	struct nova_inode_info_header *sih, struct nova_file_write_entry *batch,
+	int nr_batch, struct write_env *env)
+{
+	int i;
+
+	for (i = 0; i < nr_batch; i++)
+		nova_free_data_blocks(sb, sih,
+				le64_to_cpu(batch[i].block) >> PAGE_SHIFT,
+				le32_to_cpu(batch[i].num_pages));
+
+	if (env->num_pages)
+		nova_free_data_blocks(sb, sih, env->start_blocknr,
+				      env->num_pages);
+}
+
 /*
  * Perform a COW write.   Must hold the inode lock before calling.
  */
@@ -634,7 +772,7 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	struct nova_inode_info_header *sih = &si->header;
 	struct super_block *sb = inode->i_sb;
 	struct nova_inode *pi, inode_copy;
-	struct nova_file_write_entry entry_data;
+	struct nova_file_write_entry *batch = NULL;
 	struct nova_inode_update update;
 	ssize_t	    written = 0;
 	loff_t pos;
@@ -644,6 +782,7 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	unsigned long blocknr = 0;
 	unsigned int data_bits;
 	int allocated = 0;
+	int nr_batch = 0;
 	// void *kmem;
 	u64 file_size;
 	size_t bytes;
@@ -652,11 +791,13 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	unsigned long step = 0;
 	ssize_t ret;
 	u64 begin_tail = 0;
+	u64 logged_tail = 0;
 	int try_inplace = 0;
 	u64 epoch_id;
 	u32 time;
 	char* data_buffer;
-	struct write_env env;
+	u32 csums[NOVA_PAGE_STRIPES];
+	struct write_env env = { 0 };
 
 	data_buffer = (char *)kmalloc(PAGE_SIZE, GFP_KERNEL);
 
@@ -670,6 +811,13 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 		ret = -EFAULT;
 		goto out;
 	}
+
+	/* Runs broken up by dedup hits are appended in batches */
+	batch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!batch) {
+		ret = -ENOMEM;
+		goto out;
+	}
 	pos = *ppos;
 
 	if (filp->f_flags & O_APPEND)
@@ -693,9 +841,6 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 	total_blocks = num_blocks;
 	start_blk = pos >> sb->s_blocksize_bits;
 
-	env.pos = 0;
-	env.num_pages = 0;
-	env.blocknr = 0;
     
 	if (nova_check_overlap_vmas(sb, sih, start_blk, num_blocks)) {
 		nova_dbgv("COW write overlaps with vma: inode %lu, pgoff %lu, %lu blocks\n",
@@ -764,7 +909,12 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 			goto out;
 		}
 
-		allocated = nova_dedup_new_write(sb, data_buffer, &blocknr);
+		/* One crc32c pass serves the weak fingerprint and the csums */
+		if (data_csum > 0)
+			nova_block_stripe_csums(sb, (u8 *)data_buffer, csums);
+
+		allocated = nova_dedup_new_write(sb, data_buffer,
+				data_csum > 0 ? csums : NULL, &blocknr);
 		copied = bytes;
 		if (allocated < 0) {
 			nova_dbg("%s alloc blocks failed %d\n", __func__,
@@ -781,11 +931,22 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 		// nova_memlock_range(sb, kmem + offset, bytes);
 		// NOVA_END_TIMING(memcpy_w_nvmm_t, memcpy_time);
 
-		if (data_csum > 0 || data_parity > 0) {
-			ret = nova_protect_file_data(sb, inode, pos, bytes,
-							buf, blocknr, false);
-			if (ret)
-				goto out;
+		/*
+		 * A shared block (the zero block included) already carries
+		 * valid csum and parity. A fresh block is protected from
+		 * data_buffer, which holds the whole page with its head and
+		 * tail, so the user data is not copied and the old head and
+		 * tail are not read again. Its stripe csums are the ones the
+		 * weak fingerprint was derived from.
+		 */
+		if (allocated == 0) {
+			NOVA_STATS_ADD(protect_dedup_skip, 1);
+		} else {
+			if (data_csum > 0)
+				nova_write_block_csums(sb, blocknr, csums);
+			if (data_parity > 0)
+				nova_update_block_parity(sb, (u8 *)data_buffer,
+							 blocknr, 0);
 		}
 
 		if (pos + copied > inode->i_size)
@@ -793,35 +954,38 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 		else
 			file_size = cpu_to_le64(inode->i_size);
 
-		if (env.pos == 0) {
+		if (env.num_pages == 0) {
 			env.pos = pos;
 			env.num_pages = 1;
 			env.blocknr = blocknr;
 			env.start_blocknr = blocknr;
-		} else if (blocknr == env.blocknr + 1) {
+		} else if (blocknr == env.blocknr + 1 &&
+			   !nova_dedup_is_zero_block(sb, env.blocknr)) {
 			env.blocknr += 1;
 			env.num_pages += 1;
 		} else {
 			start_blk = env.pos >> sb->s_blocksize_bits;
-			nova_init_file_write_entry(sb, sih, &entry_data, epoch_id,
-						start_blk, env.num_pages, env.start_blocknr, time,
-						file_size);
-
-			ret = nova_append_file_write_entry(sb, pi, inode,
-						&entry_data, &update);
-			if (ret) {
-				nova_dbg("%s: append inode entry failed\n", __func__);
-				ret = -ENOSPC;
-				goto out;
-			}
-
-			if (begin_tail == 0)
-				begin_tail = update.curr_entry;
+			nova_init_file_write_entry(sb, sih, &batch[nr_batch++],
+						epoch_id, start_blk, env.num_pages,
+						env.start_blocknr, time, file_size);
 
 			env.pos = pos;
 			env.num_pages = 1;
 			env.blocknr = blocknr;
 			env.start_blocknr = blocknr;
+
+			if (nr_batch == NOVA_WRITE_ENTRY_BATCH) {
+				ret = nova_append_file_write_entries(sb, pi,
+						inode, batch, nr_batch, &update,
+						&begin_tail);
+				if (ret) {
+					nova_dbg("%s: append inode entry failed\n",
+							__func__);
+					goto out;
+				}
+				nr_batch = 0;
+				logged_tail = update.tail;
+			}
 		}
 
 		nova_dbgv("Write: %p, %lu\n", data_buffer, copied);
@@ -831,7 +995,7 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 			pos += copied;
 			buf += copied;
 			count -= copied;
-			num_blocks -= allocated;
+			num_blocks -= 1;
 		}
 		if (unlikely(copied != bytes)) {
 			nova_dbg("%s ERROR!: %p, bytes %lu, copied %lu\n",
@@ -843,22 +1007,22 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 			break;
 	}
 
-	if (env.pos) {
+	if (env.num_pages) {
 		start_blk = env.pos >> sb->s_blocksize_bits;
-		nova_init_file_write_entry(sb, sih, &entry_data, epoch_id,
-					start_blk, env.num_pages, env.start_blocknr, time,
-					file_size);
+		nova_init_file_write_entry(sb, sih, &batch[nr_batch++],
+					epoch_id, start_blk, env.num_pages,
+					env.start_blocknr, time, file_size);
+		env.num_pages = 0;
+	}
 
-		ret = nova_append_file_write_entry(sb, pi, inode,
-					&entry_data, &update);
+	if (nr_batch) {
+		ret = nova_append_file_write_entries(sb, pi, inode, batch,
+					nr_batch, &update, &begin_tail);
 		if (ret) {
 			nova_dbg("%s: append inode entry failed\n", __func__);
-			ret = -ENOSPC;
 			goto out;
 		}
-
-		if (begin_tail == 0)
-			begin_tail = update.curr_entry;
+		nr_batch = 0;
 	}
 
 	data_bits = blk_type_to_shift[sih->i_blk_type];
@@ -887,11 +1051,19 @@ static ssize_t do_nova_cow_file_write(struct file *filp,
 
 	sih->trans_id++;
 out:
+	/*
+	 * Every page the write got from nova_dedup_new_write() is in the
+	 * log, in batch or in env. A failed append may have logged part of
+	 * its batch, so the log is only walked up to the last complete one.
+	 */
+	if (ret < 0) {
+		nova_drop_pending_write(sb, sih, batch, nr_batch, &env);
+		nova_cleanup_incomplete_write(sb, sih, 0, 0, begin_tail,
+					      logged_tail);
+	}
+	kfree(batch);
 	if(data_buffer)
 		kfree(data_buffer);
-	if (ret < 0)
-		nova_cleanup_incomplete_write(sb, sih, blocknr, allocated,
-						begin_tail, update.tail);
 
 	NOVA_END_TIMING(do_cow_write_t, cow_write_time);
 	NOVA_STATS_ADD(cow_write_bytes, written);
@@ -1,17 +1,18 @@
 #ifndef FINGERPRINT_H_
 #define FINGERPRINT_H_
 
+/* The fingerprint layout is shared with the userspace replay library */
+#ifdef __KERNEL__
 #include <linux/types.h>
 #include <crypto/hash.h>
 #include <crypto/skcipher.h>
 #include "stats.h"
+#else
+#include <stdint.h>
+#endif
 
 #define NOVA_FP_STRONG_CTX_BUF_SIZE 256
 
-struct nova_fp_hash_ctx {
-	struct crypto_shash *alg;
-};
-
 
 struct nova_fp_strong {
 	union {
@@ -28,6 +29,11 @@ struct nova_fp_weak {
 _Static_assert(sizeof(struct nova_fp_strong) == 32, "Strong Fingerprint not 32B!");
 _Static_assert(sizeof(struct nova_fp_weak) == 4, "Weak Fingerprint not 32B!");
 
+#ifdef __KERNEL__
+struct nova_fp_hash_ctx {
+	struct crypto_shash *alg;
+};
+
 static inline int nova_fp_strong_ctx_init(struct nova_fp_hash_ctx *ctx) {
 	struct crypto_shash *alg = crypto_alloc_shash("md5", 0, 0);
 	if (IS_ERR(alg))
@@ -87,5 +93,6 @@ static inline int nova_fp_weak_calc(struct nova_fp_hash_ctx *fp_ctx, const void
 
 	return ret;
 }
+#endif /* __KERNEL__ */
 
 #endif // FINGERPRINT_H_
\ No newline at end of file
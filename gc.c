@@ -15,6 +15,7 @@
  * warranty of any kind, whether express or implied.
  */
 
+#include <linux/kthread.h>
 #include "nova.h"
 #include "inode.h"
 
@@ -158,24 +159,19 @@ static int nova_gc_assign_file_entry(struct super_block *sb,
 	struct nova_file_write_entry *old_entry,
 	struct nova_file_write_entry *new_entry)
 {
-	struct nova_file_write_entry *temp;
-	void **pentry;
-	unsigned long start_pgoff = old_entry->pgoff;
-	unsigned int num = old_entry->num_pages;
-	unsigned long curr_pgoff;
-	int i;
+	struct nova_file_extent *ext;
+	struct rb_node *next;
+	unsigned long end_pgoff = old_entry->pgoff + old_entry->num_pages;
 	int ret = 0;
 
-	for (i = 0; i < num; i++) {
-		curr_pgoff = start_pgoff + i;
+	ext = nova_find_file_extent(sih, old_entry->pgoff);
+	while (ext && ext->pgoff < end_pgoff) {
+		if (ext->entry == old_entry)
+			ext->entry = new_entry;
 
-		pentry = radix_tree_lookup_slot(&sih->tree, curr_pgoff);
-		if (pentry) {
-			temp = radix_tree_deref_slot(pentry);
-			if (temp == old_entry)
-				radix_tree_replace_slot(&sih->tree, pentry,
-							new_entry);
-		}
+		next = rb_next(&ext->node);
+		ext = next ? container_of(next, struct nova_file_extent, node)
+			   : NULL;
 	}
 
 	return ret;
@@ -555,6 +551,40 @@ out:
 	return blocks;
 }
 
+/*
+ * Link newly allocated pages behind the tail page of the log (and of the
+ * alternate log).
+ */
+void nova_link_log_pages(struct super_block *sb,
+	struct nova_inode_info_header *sih, u64 curr_tail, u64 new_block,
+	u64 alter_new_block)
+{
+	struct nova_inode_log_page *curr_page;
+	struct nova_inode_log_page *alter_curr_page;
+	u64 curr, alter_curr;
+
+	curr = BLOCK_OFF(curr_tail);
+	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr);
+
+	nova_memunlock_block(sb, curr_page);
+	nova_set_next_page_address(sb, curr_page, new_block, 1);
+	nova_memlock_block(sb, curr_page);
+
+	if (metadata_csum) {
+		alter_curr = BLOCK_OFF(sih->alter_log_tail);
+
+		while (next_log_page(sb, alter_curr) > 0)
+			alter_curr = next_log_page(sb, alter_curr);
+
+		alter_curr_page = (struct nova_inode_log_page *)
+			nova_get_block(sb, alter_curr);
+		nova_memunlock_block(sb, alter_curr_page);
+		nova_set_next_page_address(sb, alter_curr_page,
+					   alter_new_block, 1);
+		nova_memlock_block(sb, alter_curr_page);
+	}
+}
+
 /*
  * Scan pages in the log and remove those with no valid log entries.
  */
@@ -584,6 +614,7 @@ int nova_inode_log_fast_gc(struct super_block *sb,
 	alter_curr = sih->alter_log_head;
 	sih->valid_entries = 0;
 	sih->num_entries = 0;
+	sih->gc_deferred_pages = 0;
 
 	num_logs = 1;
 	if (metadata_csum)
@@ -654,30 +685,9 @@ int nova_inode_log_fast_gc(struct super_block *sb,
 	nova_dbgv("checked pages %lu, freed %d\n", checked_pages, freed_pages);
 	checked_pages -= freed_pages;
 
-	// TODO:  I think this belongs in nova_extend_inode_log.
-	if (num_pages > 0) {
-		curr = BLOCK_OFF(curr_tail);
-		curr_page = (struct nova_inode_log_page *)
-						  nova_get_block(sb, curr);
-
-		nova_memunlock_block(sb, curr_page);
-		nova_set_next_page_address(sb, curr_page, new_block, 1);
-		nova_memlock_block(sb, curr_page);
-
-		if (metadata_csum) {
-			alter_curr = BLOCK_OFF(sih->alter_log_tail);
-
-			while (next_log_page(sb, alter_curr) > 0)
-				alter_curr = next_log_page(sb, alter_curr);
-
-			alter_curr_page = (struct nova_inode_log_page *)
-				nova_get_block(sb, alter_curr);
-			nova_memunlock_block(sb, curr_page);
-			nova_set_next_page_address(sb, alter_curr_page,
-						   alter_new_block, 1);
-			nova_memlock_block(sb, curr_page);
-		}
-	}
+	if (num_pages > 0)
+		nova_link_log_pages(sb, sih, curr_tail, new_block,
+					alter_new_block);
 
 	curr = sih->log_head;
 	alter_curr = sih->alter_log_head;
@@ -737,3 +747,255 @@ int nova_inode_log_fast_gc(struct super_block *sb,
 
 	return 0;
 }
+
+/*
+ * Background log GC
+ *
+ * Extending a log runs fast GC over the whole log, and thorough GC when
+ * most of it is dead, in the task that happens to append. With
+ * log_gc_defer_pages set, the extension only links the new pages and queues
+ * the inode on the GC daemon of the current CPU. The daemon compacts the
+ * queued log with the lowest share of valid entries first, under the inode
+ * lock like a writer would. An inode that grew its log by more than
+ * log_gc_defer_pages since its last GC, or that finds the queue full, is
+ * collected inline as before.
+ */
+
+/* Inodes a CPU queue holds before writers fall back to inline GC */
+#define NOVA_LOG_GC_QUEUE_MAX	4096
+
+struct nova_log_gc_queue {
+	spinlock_t lock;		/* Protects inodes and nr */
+	struct list_head inodes;	/* sih->gc_list */
+	unsigned long nr;
+	wait_queue_head_t wait;
+	struct task_struct *thread;
+	struct super_block *sb;
+};
+
+/* Only inodes embedded in a live VFS inode can be pinned by the daemon */
+static bool nova_log_gc_vfs_inode(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_inode_info *si;
+
+	if (sih->ino != NOVA_ROOT_INO && sih->ino < NOVA_NORMAL_INODE_START)
+		return false;
+
+	/* nova_delete_dead_inode() works on a zeroed stack copy */
+	si = container_of(sih, struct nova_inode_info, header);
+	return si->vfs_inode.i_sb == sb;
+}
+
+/*
+ * Called by nova_extend_inode_log() with the inode locked. Returns 0 if the
+ * caller may skip GC and only link the @pages new log pages.
+ */
+int nova_log_gc_defer(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pages)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_gc_queue *q;
+	int ret = 0;
+
+	if (!sbi->log_gc_queues || !nova_log_gc_vfs_inode(sb, sih))
+		return -EINVAL;
+
+	if (sih->gc_deferred_pages + pages > log_gc_defer_pages) {
+		NOVA_STATS_ADD(log_gc_inline, 1);
+		return -ENOSPC;
+	}
+
+	q = &sbi->log_gc_queues[sih->gc_cpu];
+	spin_lock(&q->lock);
+	if (!list_empty(&sih->gc_list))
+		goto out;
+
+	spin_unlock(&q->lock);
+	sih->gc_cpu = nova_get_cpuid(sb);
+	q = &sbi->log_gc_queues[sih->gc_cpu];
+	spin_lock(&q->lock);
+	if (q->nr >= NOVA_LOG_GC_QUEUE_MAX) {
+		NOVA_STATS_ADD(log_gc_inline, 1);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	list_add_tail(&sih->gc_list, &q->inodes);
+	q->nr++;
+	wake_up_interruptible(&q->wait);
+out:
+	spin_unlock(&q->lock);
+	if (ret == 0) {
+		sih->gc_deferred_pages += pages;
+		NOVA_STATS_ADD(log_gc_deferred, 1);
+	}
+	return ret;
+}
+
+/* The inode is being evicted */
+void nova_log_gc_dequeue(struct super_block *sb,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_gc_queue *q;
+
+	if (!sbi->log_gc_queues || !nova_log_gc_vfs_inode(sb, sih))
+		return;
+
+	q = &sbi->log_gc_queues[sih->gc_cpu];
+	spin_lock(&q->lock);
+	if (!list_empty(&sih->gc_list)) {
+		list_del_init(&sih->gc_list);
+		q->nr--;
+	}
+	spin_unlock(&q->lock);
+}
+
+/* Valid entries per 1024 scanned ones. Logs never scanned go first. */
+static unsigned long nova_log_gc_valid_ratio(struct nova_inode_info_header *sih)
+{
+	if (sih->num_entries == 0)
+		return 0;
+
+	return (sih->valid_entries << 10) / sih->num_entries;
+}
+
+/* Take the queued inode with the most dead log space, pinned */
+static struct inode *nova_log_gc_pick(struct nova_log_gc_queue *q)
+{
+	struct nova_inode_info_header *sih, *victim;
+	struct nova_inode_info *si;
+	struct inode *inode = NULL;
+	unsigned long ratio, min_ratio;
+
+	spin_lock(&q->lock);
+	while (!inode && q->nr) {
+		victim = NULL;
+		min_ratio = ULONG_MAX;
+		list_for_each_entry(sih, &q->inodes, gc_list) {
+			ratio = nova_log_gc_valid_ratio(sih);
+			if (ratio < min_ratio) {
+				min_ratio = ratio;
+				victim = sih;
+			}
+		}
+
+		list_del_init(&victim->gc_list);
+		q->nr--;
+
+		/* Fails once eviction has started */
+		si = container_of(victim, struct nova_inode_info, header);
+		inode = igrab(&si->vfs_inode);
+	}
+	spin_unlock(&q->lock);
+
+	return inode;
+}
+
+static void nova_log_gc_inode(struct super_block *sb, struct inode *inode)
+{
+	struct nova_inode_info_header *sih = NOVA_IH(inode);
+	struct nova_inode *pi;
+
+	inode_lock(inode);
+	pi = nova_get_inode(sb, inode);
+	if (pi && sih->log_head) {
+		nova_inode_log_fast_gc(sb, pi, sih, 0, 0, 0, 0, 0);
+		NOVA_STATS_ADD(log_gc_background, 1);
+	}
+	inode_unlock(inode);
+}
+
+static int nova_log_gc(void *arg)
+{
+	struct nova_log_gc_queue *q = arg;
+	struct super_block *sb = q->sb;
+	struct inode *inode;
+
+	for (;;) {
+		wait_event_interruptible(q->wait,
+			READ_ONCE(q->nr) || kthread_should_stop());
+
+		if (kthread_should_stop())
+			break;
+
+		inode = nova_log_gc_pick(q);
+		if (!inode)
+			continue;
+
+		nova_log_gc_inode(sb, inode);
+		iput(inode);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+int nova_log_gc_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_gc_queue *q;
+	int cpu;
+
+	if (log_gc_defer_pages == 0 || sbi->mount_snapshot)
+		return 0;
+
+	sbi->log_gc_queues = kcalloc(sbi->cpus,
+				sizeof(struct nova_log_gc_queue), GFP_KERNEL);
+	if (!sbi->log_gc_queues)
+		return -ENOMEM;
+
+	for (cpu = 0; cpu < sbi->cpus; cpu++) {
+		q = &sbi->log_gc_queues[cpu];
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->inodes);
+		init_waitqueue_head(&q->wait);
+		q->sb = sb;
+	}
+
+	for (cpu = 0; cpu < sbi->cpus; cpu++) {
+		q = &sbi->log_gc_queues[cpu];
+		q->thread = kthread_create_on_node(nova_log_gc, q,
+					cpu_to_node(cpu), "nova_log_gc/%d", cpu);
+		if (IS_ERR(q->thread)) {
+			q->thread = NULL;
+			nova_log_gc_stop(sb);
+			return -ENOMEM;
+		}
+		if (cpu_online(cpu))
+			kthread_bind(q->thread, cpu);
+		wake_up_process(q->thread);
+	}
+
+	return 0;
+}
+
+/*
+ * Called before the VFS evicts the inodes at unmount, since a daemon may
+ * hold one. Queued logs are simply left uncompacted.
+ */
+void nova_log_gc_stop(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_log_gc_queue *q;
+	struct nova_inode_info_header *sih, *tmp;
+	int cpu;
+
+	if (!sbi->log_gc_queues)
+		return;
+
+	for (cpu = 0; cpu < sbi->cpus; cpu++) {
+		q = &sbi->log_gc_queues[cpu];
+		if (q->thread)
+			kthread_stop(q->thread);
+		spin_lock(&q->lock);
+		list_for_each_entry_safe(sih, tmp, &q->inodes, gc_list)
+			list_del_init(&sih->gc_list);
+		q->nr = 0;
+		spin_unlock(&q->lock);
+	}
+
+	kfree(sbi->log_gc_queues);
+	sbi->log_gc_queues = NULL;
+}
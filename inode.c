@@ -281,61 +281,24 @@ int nova_delete_file_tree(struct super_block *sb,
 	u64 epoch_id)
 {
 	struct nova_file_write_entry *entry;
-	struct nova_file_write_entry *entryc, entry_copy;
-	struct nova_file_write_entry *old_entry = NULL;
-	unsigned long pgoff = start_blocknr;
-	unsigned long old_pgoff = 0;
-	unsigned int num_free = 0;
+	unsigned long pgoff;
+	unsigned int num_free;
 	int freed = 0;
-	void *ret;
 	INIT_TIMING(delete_time);
 
 	NOVA_START_TIMING(delete_file_tree_t, delete_time);
 
-	entryc = (metadata_csum == 0) ? entry : &entry_copy;
-
-	/* Handle EOF blocks */
-	do {
-		entry = radix_tree_lookup(&sih->tree, pgoff);
-		if (entry) {
-			ret = radix_tree_delete(&sih->tree, pgoff);
-			BUG_ON(!ret || ret != entry);
-			if (entry != old_entry) {
-				if (old_entry && delete_nvmm) {
-					nova_free_old_entry(sb, sih,
-							old_entry, old_pgoff,
-							num_free, delete_dead,
-							epoch_id);
-					freed += num_free;
-				}
-
-				old_entry = entry;
-				old_pgoff = pgoff;
-				num_free = 1;
-			} else {
-				num_free++;
-			}
-			pgoff++;
-		} else {
-			/* We are finding a hole. Jump to the next entry. */
-			entry = nova_find_next_entry(sb, sih, pgoff);
-			if (!entry)
-				break;
-
-			if (metadata_csum == 0)
-				entryc = entry;
-			else if (!nova_verify_entry_csum(sb, entry, entryc))
-				break;
-
-			pgoff++;
-			pgoff = pgoff > entryc->pgoff ? pgoff : entryc->pgoff;
-		}
-	} while (1);
-
-	if (old_entry && delete_nvmm) {
-		nova_free_old_entry(sb, sih, old_entry, old_pgoff,
+	/*
+	 * Handle EOF blocks. Unmapping up to the end never splits an
+	 * extent, so this cannot fail.
+	 */
+	while ((entry = nova_unmap_file_extent(sb, sih, start_blocknr,
+				ULONG_MAX, &pgoff, &num_free)) != NULL) {
+		if (delete_nvmm) {
+			nova_free_old_entry(sb, sih, entry, pgoff,
 					num_free, delete_dead, epoch_id);
-		freed += num_free;
+			freed += num_free;
+		}
 	}
 
 	nova_dbgv("Inode %lu: delete file tree from pgoff %lu to %lu, %d blocks freed\n",
@@ -345,6 +308,35 @@ int nova_delete_file_tree(struct super_block *sb,
 	return freed;
 }
 
+/*
+ * Free the whole file tree of a dead inode @batch pages at a time, yielding
+ * in between, so a huge file does not hold the CPU for its whole size. Each
+ * range starts at the lowest mapped page, so no extent is ever split and
+ * unmapping cannot fail.
+ */
+static int nova_delete_file_tree_batched(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long batch)
+{
+	struct nova_file_write_entry *entry;
+	struct nova_file_extent *ext;
+	unsigned long start, pgoff;
+	unsigned int num_free;
+	int freed = 0;
+
+	while ((ext = nova_find_file_extent(sih, 0)) != NULL) {
+		start = ext->pgoff;
+		while ((entry = nova_unmap_file_extent(sb, sih, start,
+				start + batch, &pgoff, &num_free)) != NULL) {
+			nova_free_old_entry(sb, sih, entry, pgoff,
+					num_free, true, 0);
+			freed += num_free;
+		}
+		cond_resched();
+	}
+
+	return freed;
+}
+
 static int nova_free_dram_resource(struct super_block *sb,
 	struct nova_inode_info_header *sih)
 {
@@ -438,39 +430,26 @@ static int nova_lookup_hole_in_range(struct super_block *sb,
 	unsigned long first_blocknr, unsigned long last_blocknr,
 	int *data_found, int *hole_found, int hole)
 {
-	struct nova_file_write_entry *entry;
-	struct nova_file_write_entry *entryc, entry_copy;
+	struct nova_file_extent *ext;
 	unsigned long blocks = 0;
 	unsigned long pgoff, old_pgoff;
 
-	entryc = (metadata_csum == 0) ? entry : &entry_copy;
-
 	pgoff = first_blocknr;
 	while (pgoff <= last_blocknr) {
 		old_pgoff = pgoff;
-		entry = radix_tree_lookup(&sih->tree, pgoff);
-		if (entry) {
+		ext = nova_find_file_extent(sih, pgoff);
+		if (ext && ext->pgoff <= pgoff) {
 			*data_found = 1;
 			if (!hole)
 				goto done;
-			pgoff++;
+			/* Skip the rest of the extent */
+			pgoff = ext->pgoff + ext->num_pages;
 		} else {
 			*hole_found = 1;
-			entry = nova_find_next_entry(sb, sih, pgoff);
-			pgoff++;
-			if (entry) {
-				if (metadata_csum == 0)
-					entryc = entry;
-				else if (!nova_verify_entry_csum(sb, entry,
-								entryc))
-					goto done;
-
-				pgoff = pgoff > entryc->pgoff ?
-					pgoff : entryc->pgoff;
-				if (pgoff > last_blocknr)
-					pgoff = last_blocknr + 1;
-			}
+			pgoff = ext ? ext->pgoff : last_blocknr + 1;
 		}
+		if (pgoff > last_blocknr)
+			pgoff = last_blocknr + 1;
 
 		if (!*hole_found || !hole)
 			blocks += pgoff - old_pgoff;
@@ -650,7 +629,6 @@ static int nova_alloc_unused_inode(struct super_block *sb, int cpuid,
 	}
 
 	*ino = new_ino * sbi->cpus + cpuid;
-	sbi->s_inodes_used_count++;
 	inode_map->allocated++;
 
 	nova_dbg_verbose("Alloc ino %lu\n", *ino);
@@ -730,7 +708,6 @@ err:
 	return ret;
 
 block_found:
-	sbi->s_inodes_used_count--;
 	inode_map->freed++;
 	mutex_unlock(&inode_map->inode_table_mutex);
 	return ret;
@@ -841,8 +818,10 @@ unsigned long nova_get_last_blocknr(struct super_block *sb,
 	return last_blocknr;
 }
 
+/* With a non-zero @batch, file blocks are freed in chunks of that many pages */
 static int nova_free_inode_resource(struct super_block *sb,
-	struct nova_inode *pi, struct nova_inode_info_header *sih)
+	struct nova_inode *pi, struct nova_inode_info_header *sih,
+	unsigned long batch)
 {
 	unsigned long last_blocknr;
 	int ret = 0;
@@ -870,7 +849,10 @@ static int nova_free_inode_resource(struct super_block *sb,
 	case S_IFREG:
 		last_blocknr = nova_get_last_blocknr(sb, sih);
 		nova_dbgv("%s: file ino %lu\n", __func__, sih->ino);
-		freed = nova_delete_file_tree(sb, sih, 0,
+		if (batch)
+			freed = nova_delete_file_tree_batched(sb, sih, batch);
+		else
+			freed = nova_delete_file_tree(sb, sih, 0,
 					last_blocknr, true, true, 0);
 		break;
 	case S_IFDIR:
@@ -917,6 +899,8 @@ void nova_evict_inode(struct inode *inode)
 		goto out;
 	}
 
+	nova_log_gc_dequeue(sb, sih);
+
 	// pi can be NULL if the file has already been deleted, but a handle
 	// remains.
 	if (pi && pi->nova_ino != inode->i_ino) {
@@ -943,8 +927,12 @@ void nova_evict_inode(struct inode *inode)
 		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
 			goto out;
 
+		/* Large files are freed by the reclaim thread */
+		if (pi && nova_reclaim_defer_inode(sb, pi, sih) == 0)
+			goto out;
+
 		if (pi) {
-			ret = nova_free_inode_resource(sb, pi, sih);
+			ret = nova_free_inode_resource(sb, pi, sih, 0);
 			if (ret)
 				goto out;
 		}
@@ -969,8 +957,12 @@ out:
 	NOVA_END_TIMING(evict_inode_t, evict_time);
 }
 
-/* First rebuild the inode tree, then free the blocks */
-int nova_delete_dead_inode(struct super_block *sb, u64 ino)
+/*
+ * First rebuild the inode tree, then free the blocks, @batch pages at a time
+ * if non-zero.
+ */
+int nova_delete_dead_inode(struct super_block *sb, u64 ino,
+	unsigned long batch)
 {
 	struct nova_inode_info si;
 	struct nova_inode_info_header *sih;
@@ -1004,49 +996,102 @@ int nova_delete_dead_inode(struct super_block *sb, u64 ino)
 	nova_dbgv("Delete dead inode %lu, log head 0x%llx, tail 0x%llx\n",
 			sih->ino, sih->log_head, sih->log_tail);
 
-	return nova_free_inode_resource(sb, pi, sih);
+	return nova_free_inode_resource(sb, pi, sih, batch);
+}
+
+/* Inode table mutex of the map held */
+static int nova_new_inode_from_map(struct super_block *sb, int map_id,
+	unsigned long *free_ino, u64 *pi_addr)
+{
+	int ret;
+
+	ret = nova_alloc_unused_inode(sb, map_id, free_ino);
+	if (ret) {
+		nova_dbg("%s: alloc inode number failed %d\n", __func__, ret);
+		return ret;
+	}
+
+	ret = nova_get_inode_address(sb, *free_ino, 0, pi_addr, 1, 1);
+	if (ret)
+		nova_dbg("%s: get inode address failed %d\n", __func__, ret);
+
+	return ret;
 }
 
-/* Returns 0 on failure */
+/*
+ * Returns 0 on failure. The inode number comes from the map of the current
+ * CPU. If that map is busy, an idle map of another CPU is used instead, and
+ * a map that has run out of numbers is skipped. Only if every map is busy
+ * does the caller wait, starting with its own.
+ */
 u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
 	unsigned long free_ino = 0;
-	int map_id;
+	int local, map_id = 0;
+	int i;
 	u64 ino = 0;
-	int ret;
+	int ret = -ENOSPC;
 	INIT_TIMING(new_inode_time);
 
 	NOVA_START_TIMING(new_nova_inode_t, new_inode_time);
-	map_id = sbi->map_id;
-	sbi->map_id = (sbi->map_id + 1) % sbi->cpus;
+	local = nova_get_cpuid(sb);
 
-	inode_map = &sbi->inode_maps[map_id];
+	for (i = 0; i < sbi->cpus; i++) {
+		map_id = (local + i) % sbi->cpus;
+		inode_map = &sbi->inode_maps[map_id];
+		if (!mutex_trylock(&inode_map->inode_table_mutex))
+			continue;
 
-	mutex_lock(&inode_map->inode_table_mutex);
-	ret = nova_alloc_unused_inode(sb, map_id, &free_ino);
-	if (ret) {
-		nova_dbg("%s: alloc inode number failed %d\n", __func__, ret);
+		ret = nova_new_inode_from_map(sb, map_id, &free_ino, pi_addr);
 		mutex_unlock(&inode_map->inode_table_mutex);
-		return 0;
+		if (ret == 0)
+			goto out;
 	}
 
-	ret = nova_get_inode_address(sb, free_ino, 0, pi_addr, 1, 1);
-	if (ret) {
-		nova_dbg("%s: get inode address failed %d\n", __func__, ret);
+	for (i = 0; i < sbi->cpus; i++) {
+		map_id = (local + i) % sbi->cpus;
+		inode_map = &sbi->inode_maps[map_id];
+		mutex_lock(&inode_map->inode_table_mutex);
+		ret = nova_new_inode_from_map(sb, map_id, &free_ino, pi_addr);
 		mutex_unlock(&inode_map->inode_table_mutex);
-		return 0;
+		if (ret == 0)
+			goto out;
 	}
 
-	mutex_unlock(&inode_map->inode_table_mutex);
+	NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
+	return 0;
 
+out:
+	if (map_id != local)
+		NOVA_STATS_ADD(inode_map_steals, 1);
 	ino = free_ino;
 
 	NOVA_END_TIMING(new_nova_inode_t, new_inode_time);
 	return ino;
 }
 
+/*
+ * The maps count their own allocations, so creating and deleting files does
+ * not bounce a shared counter between CPUs.
+ */
+unsigned long nova_inodes_used(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct inode_map *inode_map;
+	unsigned long used = sbi->s_inodes_used_count;
+	int i;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		inode_map = &sbi->inode_maps[i];
+		used += READ_ONCE(inode_map->allocated) -
+			READ_ONCE(inode_map->freed);
+	}
+
+	return used;
+}
+
 struct inode *nova_new_vfs_inode(enum nova_new_inode_type type,
 	struct inode *dir, u64 pi_addr, u64 ino, umode_t mode,
 	size_t size, dev_t rdev, const struct qstr *qstr, u64 epoch_id)
@@ -74,8 +74,8 @@ struct inode_table {
  * NOVA-specific inode state kept in DRAM
  */
 struct nova_inode_info_header {
-	/* Map from file offsets to write log entries. */
-	struct radix_tree_root tree;
+	/* Extents of file pages to write log entries */
+	struct rb_root tree;
 	struct rb_root rb_tree;		/* RB tree for directory */
 	struct rb_root vma_tree;	/* Write vmas */
 	struct list_head list;		/* SB list of mmap sih */
@@ -99,6 +99,9 @@ struct nova_inode_info_header {
 	u64 alter_log_head;		/* Alternate log head pointer */
 	u64 alter_log_tail;		/* Alternate log tail pointer */
 	u8  i_blk_type;
+	struct list_head gc_list;	/* Queued for background log GC */
+	int gc_cpu;			/* Its GC queue */
+	unsigned long gc_deferred_pages;	/* Log pages added since GC */
 };
 
 /* For rebuild purpose, temporarily store pi infomation */
@@ -385,6 +388,7 @@ int nova_delete_file_tree(struct super_block *sb,
 	unsigned long last_blocknr, bool delete_nvmm,
 	bool delete_dead, u64 trasn_id);
 u64 nova_new_nova_inode(struct super_block *sb, u64 *pi_addr);
+unsigned long nova_inodes_used(struct super_block *sb);
 extern struct inode *nova_new_vfs_inode(enum nova_new_inode_type,
 	struct inode *dir, u64 pi_addr, u64 ino, umode_t mode,
 	size_t size, dev_t rdev, const struct qstr *qstr, u64 epoch_id);
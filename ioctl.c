@@ -156,6 +156,18 @@ setversion_out:
 		nova_print_free_lists(sb);
 		return 0;
 	}
+	case NOVA_GET_SNAPSHOT_SPACE: {
+		struct nova_snapshot_space space;
+
+		if (copy_from_user(&space, (void __user *)arg, sizeof(space)))
+			return -EFAULT;
+		ret = nova_snapshot_space_query(sb, &space);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)arg, &space, sizeof(space)))
+			return -EFAULT;
+		return 0;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -177,6 +189,8 @@ long nova_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case FS_IOC32_SETVERSION:
 		cmd = FS_IOC_SETVERSION;
 		break;
+	case NOVA_GET_SNAPSHOT_SPACE:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
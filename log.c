@@ -19,6 +19,7 @@
 #include "journal.h"
 #include "inode.h"
 #include "log.h"
+#include "dedup.h"
 
 static int nova_execute_invalidate_reassign_logentry(struct super_block *sb,
 	void *entry, enum nova_entry_type type, int reassign,
@@ -173,19 +174,110 @@ out:
 	return num_free;
 }
 
+/*
+ * The DRAM file tree is an rb-tree of extents. Extents never overlap, and
+ * page p of an extent lives at get_nvmm(sb, sih, ext->entry, p), so a
+ * lookup costs O(log extents) however many pages the extents cover.
+ */
+
+/* Return the extent that maps @pgoff, or the first extent after it */
+struct nova_file_extent *nova_find_file_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff)
+{
+	struct rb_node *temp = sih->tree.rb_node;
+	struct nova_file_extent *curr, *next = NULL;
+
+	while (temp) {
+		curr = container_of(temp, struct nova_file_extent, node);
+		if (pgoff < curr->pgoff) {
+			next = curr;
+			temp = temp->rb_left;
+		} else if (pgoff >= curr->pgoff + curr->num_pages) {
+			temp = temp->rb_right;
+		} else {
+			return curr;
+		}
+	}
+
+	return next;
+}
+
+static void nova_insert_file_extent(struct nova_inode_info_header *sih,
+	struct nova_file_extent *new_ext)
+{
+	struct rb_node **temp = &sih->tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct nova_file_extent *curr;
+
+	while (*temp) {
+		curr = container_of(*temp, struct nova_file_extent, node);
+		parent = *temp;
+		if (new_ext->pgoff < curr->pgoff)
+			temp = &((*temp)->rb_left);
+		else
+			temp = &((*temp)->rb_right);
+	}
+
+	rb_link_node(&new_ext->node, parent, temp);
+	rb_insert_color(&new_ext->node, &sih->tree);
+}
+
+/*
+ * Unmap the first mapped run of pages in [start, end). Returns the write
+ * entry of the run and stores the run in @pgoff and @num, or NULL if the
+ * range is a hole. Cutting the middle out of an extent allocates the tail
+ * extent and may return ERR_PTR(-ENOMEM).
+ */
+struct nova_file_write_entry *nova_unmap_file_extent(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long start,
+	unsigned long end, unsigned long *pgoff, unsigned int *num)
+{
+	struct nova_file_extent *ext, *tail;
+	struct nova_file_write_entry *entry;
+	unsigned long ext_end, cut_start, cut_end;
+
+	ext = nova_find_file_extent(sih, start);
+	if (!ext || ext->pgoff >= end)
+		return NULL;
+
+	entry = ext->entry;
+	ext_end = ext->pgoff + ext->num_pages;
+	cut_start = max(ext->pgoff, start);
+	cut_end = min(ext_end, end);
+
+	if (cut_start > ext->pgoff && cut_end < ext_end) {
+		tail = nova_alloc_file_extent(sb);
+		if (!tail)
+			return ERR_PTR(-ENOMEM);
+		tail->entry = entry;
+		tail->pgoff = cut_end;
+		tail->num_pages = ext_end - cut_end;
+		ext->num_pages = cut_start - ext->pgoff;
+		nova_insert_file_extent(sih, tail);
+	} else if (cut_start > ext->pgoff) {
+		ext->num_pages = cut_start - ext->pgoff;
+	} else if (cut_end < ext_end) {
+		/* Nothing else maps [ext->pgoff, cut_end), order holds */
+		ext->pgoff = cut_end;
+		ext->num_pages = ext_end - cut_end;
+	} else {
+		rb_erase(&ext->node, &sih->tree);
+		nova_free_file_extent(ext);
+	}
+
+	*pgoff = cut_start;
+	*num = cut_end - cut_start;
+	return entry;
+}
+
 struct nova_file_write_entry *nova_find_next_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih, pgoff_t pgoff)
 {
-	struct nova_file_write_entry *entry = NULL;
-	struct nova_file_write_entry *entries[1];
-	int nr_entries;
+	struct nova_file_extent *ext;
 
-	nr_entries = radix_tree_gang_lookup(&sih->tree,
-					(void **)entries, pgoff, 1);
-	if (nr_entries == 1)
-		entry = entries[0];
+	ext = nova_find_file_extent(sih, pgoff);
 
-	return entry;
+	return ext ? ext->entry : NULL;
 }
 
 /*
@@ -213,6 +305,10 @@ void nova_clear_last_page_tail(struct super_block *sb,
 	if (nvmm == 0)
 		return;
 
+	/* The shared zero block already has a zero tail */
+	if (nova_dedup_is_zero_block(sb, nvmm >> PAGE_SHIFT))
+		return;
+
 	nvmm_addr = (char *)nova_get_block(sb, nvmm);
 	nova_memunlock_range(sb, nvmm_addr + offset, length);
 	memcpy_to_pmem_nocache(nvmm_addr + offset, sbi->zeroed_page, length);
@@ -798,57 +894,43 @@ int nova_assign_write_entry(struct super_block *sb,
 	bool free)
 {
 	struct nova_file_write_entry *old_entry;
-	struct nova_file_write_entry *start_old_entry = NULL;
-	void **pentry;
+	struct nova_file_extent *ext;
 	unsigned long start_pgoff = entryc->pgoff;
-	unsigned long start_old_pgoff = 0;
-	unsigned int num = entryc->num_pages;
-	unsigned int num_free = 0;
-	unsigned long curr_pgoff;
-	int i;
+	unsigned long end_pgoff = start_pgoff + entryc->num_pages;
+	unsigned long old_pgoff;
+	unsigned int num_free;
 	int ret = 0;
 	INIT_TIMING(assign_time);
 
 	NOVA_START_TIMING(assign_t, assign_time);
-	for (i = 0; i < num; i++) {
-		curr_pgoff = start_pgoff + i;
-
-		pentry = radix_tree_lookup_slot(&sih->tree, curr_pgoff);
-		if (pentry) {
-			old_entry = radix_tree_deref_slot(pentry);
-			if (old_entry != start_old_entry) {
-				if (start_old_entry && free)
-					nova_free_old_entry(sb, sih,
-							start_old_entry,
-							start_old_pgoff,
-							num_free, false,
-							entryc->epoch_id);
-				nova_invalidate_write_entry(sb,
-						start_old_entry, 1, 0);
-
-				start_old_entry = old_entry;
-				start_old_pgoff = curr_pgoff;
-				num_free = 1;
-			} else {
-				num_free++;
-			}
-
-			radix_tree_replace_slot(&sih->tree, pentry, entry);
-		} else {
-			ret = radix_tree_insert(&sih->tree, curr_pgoff, entry);
-			if (ret) {
-				nova_dbg("%s: ERROR %d\n", __func__, ret);
-				goto out;
-			}
+	/* Unmap the old extents run by run, then map the range at once */
+	while ((old_entry = nova_unmap_file_extent(sb, sih, start_pgoff,
+				end_pgoff, &old_pgoff, &num_free)) != NULL) {
+		if (IS_ERR(old_entry)) {
+			ret = PTR_ERR(old_entry);
+			nova_dbg("%s: ERROR %d\n", __func__, ret);
+			goto out;
 		}
+
+		if (free)
+			nova_free_old_entry(sb, sih, old_entry, old_pgoff,
+					num_free, false, entryc->epoch_id);
+		nova_invalidate_write_entry(sb, old_entry, 1, 0);
 	}
 
-	if (start_old_entry && free)
-		nova_free_old_entry(sb, sih, start_old_entry,
-					start_old_pgoff, num_free, false,
-					entryc->epoch_id);
+	if (start_pgoff == end_pgoff)
+		goto out;
 
-	nova_invalidate_write_entry(sb, start_old_entry, 1, 0);
+	ext = nova_alloc_file_extent(sb);
+	if (!ext) {
+		ret = -ENOMEM;
+		nova_dbg("%s: ERROR %d\n", __func__, ret);
+		goto out;
+	}
+	ext->entry = entry;
+	ext->pgoff = start_pgoff;
+	ext->num_pages = entryc->num_pages;
+	nova_insert_file_extent(sih, ext);
 
 out:
 	NOVA_END_TIMING(assign_t, assign_time);
@@ -911,6 +993,90 @@ int nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	return ret;
 }
 
+/*
+ * Append @nr write entries of one write. The entries that fit in the current
+ * log page are copied and flushed together, so a write whose dedup hits are
+ * scattered over the device pays one fence and at most one log extension per
+ * log page instead of per entry. The log ends up exactly as if the entries
+ * were appended one by one. Stores the first entry in @begin_tail if unset.
+ */
+int nova_append_file_write_entries(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode,
+	struct nova_file_write_entry *data, int nr,
+	struct nova_inode_update *update, u64 *begin_tail)
+{
+	struct nova_inode_info *si = NOVA_I(inode);
+	struct nova_inode_info_header *sih = &si->header;
+	size_t size = sizeof(struct nova_file_write_entry);
+	struct nova_file_write_entry *entry;
+	void *alter_entry;
+	u64 curr_p, alter_curr_p;
+	int extended = 0;
+	int i, n;
+	INIT_TIMING(append_time);
+
+	NOVA_START_TIMING(append_file_entry_t, append_time);
+
+	for (i = 0; i < nr; i++)
+		nova_update_entry_csum(&data[i]);
+
+	while (nr > 0) {
+		curr_p = nova_get_append_head(sb, pi, sih, update->tail, size,
+						MAIN_LOG, 0, &extended);
+		if (curr_p == 0)
+			goto fail;
+		n = min_t(int, nr, (LOG_BLOCK_TAIL - ENTRY_LOC(curr_p)) / size);
+
+		if (metadata_csum) {
+			alter_curr_p = nova_get_append_head(sb, pi, sih,
+					update->alter_tail, size, ALTER_LOG,
+					0, &extended);
+			if (alter_curr_p == 0)
+				goto fail;
+			n = min_t(int, n,
+				(LOG_BLOCK_TAIL - ENTRY_LOC(alter_curr_p)) / size);
+		}
+
+		entry = nova_get_block(sb, curr_p);
+		nova_memunlock_range(sb, entry, n * size);
+		nova_add_page_num_entries(sb, curr_p, n);
+		memcpy(entry, data, n * size);
+		nova_flush_buffer(entry, n * size, 1);
+		nova_memlock_range(sb, entry, n * size);
+		update->curr_entry = curr_p + (n - 1) * size;
+		update->tail = curr_p + n * size;
+		if (*begin_tail == 0)
+			*begin_tail = curr_p;
+
+		if (metadata_csum) {
+			alter_entry = nova_get_block(sb, alter_curr_p);
+			nova_memunlock_range(sb, alter_entry, n * size);
+			memcpy(alter_entry, data, n * size);
+			nova_flush_buffer(alter_entry, n * size, 1);
+			nova_memlock_range(sb, alter_entry, n * size);
+			update->alter_entry = alter_curr_p + (n - 1) * size;
+			update->alter_tail = alter_curr_p + n * size;
+		}
+
+		for (i = 0; i < n; i++)
+			nova_assign_write_entry(sb, sih, entry + i, entry + i,
+						true);
+
+		NOVA_STATS_ADD(write_entry_batches, 1);
+		NOVA_STATS_ADD(write_entries_batched, n);
+		data += n;
+		nr -= n;
+	}
+
+	NOVA_END_TIMING(append_file_entry_t, append_time);
+	return 0;
+
+fail:
+	nova_err(sb, "%s failed\n", __func__);
+	NOVA_END_TIMING(append_file_entry_t, append_time);
+	return -ENOSPC;
+}
+
 int nova_append_mmap_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_mmap_entry *data,
 	struct nova_inode_update *update, struct vma_item *item)
@@ -1254,8 +1420,15 @@ static u64 nova_extend_inode_log(struct super_block *sb, struct nova_inode *pi,
 	}
 
 
-	nova_inode_log_fast_gc(sb, pi, sih, curr_p,
+	if (nova_log_gc_defer(sb, sih, allocated) == 0) {
+		/* The GC daemon compacts the log later */
+		nova_link_log_pages(sb, sih, curr_p, new_block,
+					alter_new_block);
+		sih->log_pages += allocated * (metadata_csum ? 2 : 1);
+	} else {
+		nova_inode_log_fast_gc(sb, pi, sih, curr_p,
 			       new_block, alter_new_block, allocated, 0);
+	}
 
 //	nova_dbg("After append log pages:\n");
 //	nova_print_inode_log_page(sb, inode);
@@ -281,6 +281,11 @@ int nova_free_inode_log(struct super_block *sb, struct nova_inode *pi,
 	struct nova_inode_info_header *sih);
 int nova_update_alter_pages(struct super_block *sb, struct nova_inode *pi,
 	u64 curr, u64 alter_curr);
+struct nova_file_extent *nova_find_file_extent(
+	struct nova_inode_info_header *sih, unsigned long pgoff);
+struct nova_file_write_entry *nova_unmap_file_extent(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long start,
+	unsigned long end, unsigned long *pgoff, unsigned int *num);
 struct nova_file_write_entry *nova_find_next_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih, pgoff_t pgoff);
 int nova_allocate_inode_log_pages(struct super_block *sb,
@@ -310,6 +315,10 @@ int nova_append_mmap_entry(struct super_block *sb, struct nova_inode *pi,
 int nova_append_file_write_entry(struct super_block *sb, struct nova_inode *pi,
 	struct inode *inode, struct nova_file_write_entry *data,
 	struct nova_inode_update *update);
+int nova_append_file_write_entries(struct super_block *sb,
+	struct nova_inode *pi, struct inode *inode,
+	struct nova_file_write_entry *data, int nr,
+	struct nova_inode_update *update, u64 *begin_tail);
 int nova_append_snapshot_info_entry(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info *si,
 	struct snapshot_info *info, struct nova_snapshot_info_entry *data,
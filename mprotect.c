@@ -24,6 +24,7 @@
 #include <linux/io.h>
 #include "nova.h"
 #include "inode.h"
+#include "dedup.h"
 
 static inline void wprotect_disable(void)
 {
@@ -126,7 +127,7 @@ static int nova_update_dax_mapping(struct super_block *sb,
 			nova_dbgv("%s: pgoff %lu, entry 0x%lx, new 0x%lx\n",
 						__func__, curr_pgoff,
 						value, new_value);
-			radix_tree_replace_slot(&sih->tree, pentry,
+			radix_tree_replace_slot(&mapping->i_pages, pentry,
 						(void *)new_value);
 			radix_tree_tag_set(&mapping->i_pages, curr_pgoff,
 						PAGECACHE_TAG_DIRTY);
@@ -161,7 +162,12 @@ static int nova_update_entry_pfn(struct super_block *sb,
 	nova_dbgv("%s: addr 0x%lx, size 0x%lx\n", __func__,
 			addr, size);
 
-	newflags = vma->vm_flags | VM_WRITE;
+	/*
+	 * The blocks may be shared with other files after dedup, so map them
+	 * read-only. The first store faults into nova_dax_get_blocks, which
+	 * claims an exclusive block or copies a shared one.
+	 */
+	newflags = vma->vm_flags & ~VM_WRITE;
 	new_prot = vm_get_page_prot(newflags);
 
 	ret = remap_pfn_range(vma, addr, pfn, size, new_prot);
@@ -281,6 +287,30 @@ static int nova_get_dax_cow_range(struct super_block *sb,
 	return 0;
 }
 
+static int nova_mmap_append_run(struct super_block *sb, struct nova_inode *pi,
+	struct inode *inode, struct nova_inode_update *update, u64 epoch_id,
+	unsigned long pgoff, unsigned long num_pages, unsigned long blocknr,
+	u32 time, u64 *begin_tail)
+{
+	struct nova_inode_info_header *sih = NOVA_IH(inode);
+	struct nova_file_write_entry entry_data;
+	int ret;
+
+	nova_init_file_write_entry(sb, sih, &entry_data, epoch_id, pgoff,
+				num_pages, blocknr, time,
+				cpu_to_le64(inode->i_size));
+
+	ret = nova_append_file_write_entry(sb, pi, inode, &entry_data, update);
+	if (ret) {
+		nova_dbg("%s: append inode entry failed\n", __func__);
+		return -ENOSPC;
+	}
+
+	if (*begin_tail == 0)
+		*begin_tail = update->curr_entry;
+	return 0;
+}
+
 int nova_mmap_to_new_blocks(struct vm_area_struct *vma,
 	unsigned long address)
 {
@@ -293,25 +323,21 @@ int nova_mmap_to_new_blocks(struct vm_area_struct *vma,
 	struct nova_inode *pi;
 	struct nova_file_write_entry *entry;
 	struct nova_file_write_entry *entryc, entry_copy;
-	struct nova_file_write_entry entry_data;
 	struct nova_inode_update update;
 	unsigned long start_blk, end_blk;
-	unsigned long entry_pgoff;
 	unsigned long from_blocknr = 0;
 	unsigned long blocknr = 0;
 	unsigned long avail_blocks;
-	unsigned long copy_blocks;
+	unsigned long run_pgoff = 0, run_start = 0, run_blocks = 0;
+	unsigned long i;
 	int num_blocks = 0;
-	u64 from_blockoff, to_blockoff;
-	size_t copied;
+	u64 from_blockoff;
 	int allocated = 0;
 	void *from_kmem;
-	void *to_kmem;
-	size_t bytes;
+	u32 csums[NOVA_PAGE_STRIPES];
 	INIT_TIMING(memcpy_time);
 	u64 begin_tail = 0;
 	u64 epoch_id;
-	u64 entry_size;
 	u32 time;
 	INIT_TIMING(mmap_cow_time);
 	int ret = 0;
@@ -382,7 +408,6 @@ int nova_mmap_to_new_blocks(struct vm_area_struct *vma,
 		from_blocknr = get_nvmm(sb, sih, entryc, start_blk);
 		from_blockoff = nova_get_block_off(sb, from_blocknr,
 						pi->i_blk_type);
-		from_kmem = nova_get_block(sb, from_blockoff);
 
 		if (entryc->reassigned == 0)
 			avail_blocks = entryc->num_pages -
@@ -393,63 +418,74 @@ int nova_mmap_to_new_blocks(struct vm_area_struct *vma,
 		if (avail_blocks > end_blk - start_blk)
 			avail_blocks = end_blk - start_blk;
 
-		allocated = nova_new_data_blocks(sb, sih, &blocknr, start_blk,
-					 avail_blocks, ALLOC_NO_INIT, ANY_CPU,
-					 ALLOC_FROM_HEAD);
-
-		nova_dbgv("%s: alloc %d blocks @ %lu\n", __func__,
-						allocated, blocknr);
-
-		if (allocated <= 0) {
-			nova_dbg("%s alloc blocks failed!, %d\n",
+		/* Dedup the copy block by block, shared blocks are not copied */
+		NOVA_START_TIMING(memcpy_w_wb_t, memcpy_time);
+		for (i = 0; i < avail_blocks; i++) {
+			from_kmem = nova_get_block(sb,
+					from_blockoff + (i << PAGE_SHIFT));
+			allocated = nova_dedup_new_write(sb, from_kmem, NULL,
+							 &blocknr);
+			if (allocated < 0) {
+				NOVA_END_TIMING(memcpy_w_wb_t, memcpy_time);
+				nova_dbg("%s alloc blocks failed!, %d\n",
 						__func__, allocated);
-			ret = allocated;
-			goto out;
+				ret = allocated;
+				goto out;
+			}
+
+			if (allocated > 0) {
+				if (data_csum > 0) {
+					nova_block_stripe_csums(sb, from_kmem,
+								csums);
+					nova_write_block_csums(sb, blocknr,
+								csums);
+				}
+				if (data_parity > 0)
+					nova_update_block_parity(sb, from_kmem,
+								 blocknr, 0);
+			}
+
+			/*
+			 * A run needs both the blocks and the file pages to be
+			 * contiguous; a jumped hole breaks it.
+			 */
+			if (run_blocks && blocknr == run_start + run_blocks &&
+			    start_blk + i == run_pgoff + run_blocks &&
+			    !nova_dedup_is_zero_block(sb, run_start)) {
+				run_blocks++;
+				continue;
+			}
+
+			if (run_blocks) {
+				ret = nova_mmap_append_run(sb, pi, inode,
+						&update, epoch_id, run_pgoff,
+						run_blocks, run_start, time,
+						&begin_tail);
+				if (ret) {
+					/* Not in any run yet */
+					nova_free_data_blocks(sb, sih,
+							      blocknr, 1);
+					NOVA_END_TIMING(memcpy_w_wb_t,
+							memcpy_time);
+					goto out;
+				}
+			}
+			run_pgoff = start_blk + i;
+			run_start = blocknr;
+			run_blocks = 1;
 		}
-
-		to_blockoff = nova_get_block_off(sb, blocknr,
-						pi->i_blk_type);
-		to_kmem = nova_get_block(sb, to_blockoff);
-		entry_pgoff = start_blk;
-
-		copy_blocks = allocated;
-
-		bytes = sb->s_blocksize * copy_blocks;
-
-		/* Now copy from user buf */
-		NOVA_START_TIMING(memcpy_w_wb_t, memcpy_time);
-		nova_memunlock_range(sb, to_kmem, bytes);
-		copied = bytes - memcpy_to_pmem_nocache(to_kmem, from_kmem,
-							bytes);
-		nova_memlock_range(sb, to_kmem, bytes);
 		NOVA_END_TIMING(memcpy_w_wb_t, memcpy_time);
 
-		if (copied == bytes) {
-			start_blk += copy_blocks;
-		} else {
-			nova_dbg("%s ERROR!: bytes %lu, copied %lu\n",
-				__func__, bytes, copied);
-			ret = -EFAULT;
-			goto out;
-		}
-
-		entry_size = cpu_to_le64(inode->i_size);
-
-		nova_init_file_write_entry(sb, sih, &entry_data,
-					epoch_id, entry_pgoff, copy_blocks,
-					blocknr, time, entry_size);
+		start_blk += avail_blocks;
+	}
 
-		ret = nova_append_file_write_entry(sb, pi, inode,
-					&entry_data, &update);
-		if (ret) {
-			nova_dbg("%s: append inode entry failed\n",
-					__func__);
-			ret = -ENOSPC;
+	if (run_blocks) {
+		ret = nova_mmap_append_run(sb, pi, inode, &update, epoch_id,
+				run_pgoff, run_blocks, run_start, time,
+				&begin_tail);
+		if (ret)
 			goto out;
-		}
-
-		if (begin_tail == 0)
-			begin_tail = update.curr_entry;
+		run_blocks = 0;
 	}
 
 	if (begin_tail == 0)
@@ -474,9 +510,13 @@ int nova_mmap_to_new_blocks(struct vm_area_struct *vma,
 	sih->trans_id++;
 
 out:
-	if (ret < 0)
-		nova_cleanup_incomplete_write(sb, sih, blocknr, allocated,
+	if (ret < 0) {
+		/* Drop the blocks of the run that never reached the log */
+		if (run_blocks)
+			nova_free_data_blocks(sb, sih, run_start, run_blocks);
+		nova_cleanup_incomplete_write(sb, sih, 0, 0,
 						begin_tail, update.tail);
+	}
 
 	inode_unlock(inode);
 	NOVA_END_TIMING(mmap_cow_t, mmap_cow_time);
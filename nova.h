@@ -139,6 +139,14 @@ extern unsigned int nova_dbgmask;
 #define	NOVA_PRINT_LOG_BLOCKNODE	0xBCD00014
 #define	NOVA_PRINT_LOG_PAGES		0xBCD00015
 #define	NOVA_PRINT_FREE_LISTS		0xBCD00018
+#define	NOVA_GET_SNAPSHOT_SPACE		0xBCD00019
+
+/* Argument of NOVA_GET_SNAPSHOT_SPACE, in 4K blocks */
+struct nova_snapshot_space {
+	__u64	epoch_id;		/* In: first epoch ID to look at */
+	__u64	held_blocks;		/* Blocks the snapshot keeps alive */
+	__u64	exclusive_blocks;	/* Of those, not referenced elsewhere */
+};
 
 
 #define	READDIR_END			(ULONG_MAX)
@@ -154,6 +162,9 @@ extern int wprotect;
 extern int data_csum;
 extern int data_parity;
 extern int dram_struct_csum;
+extern unsigned int dedup_scrub_mbps;
+extern unsigned int read_cache_min_refs;
+extern unsigned int log_gc_defer_pages;
 
 extern unsigned int blk_type_to_shift[NOVA_BLOCK_TYPE_MAX];
 extern unsigned int blk_type_to_size[NOVA_BLOCK_TYPE_MAX];
@@ -379,6 +390,65 @@ static inline void nova_print_curr_epoch_id(struct super_block *sb)
 	nova_dbg("Current epoch id: %llu\n", ret);
 }
 
+/* ======================= Dedup index shards ========================= */
+
+static inline struct nova_dedup_shard *
+nova_bucket_shard(struct nova_sb_info *sbi, u64 idx)
+{
+	return sbi->dedup_shards[idx % sbi->dedup_nr_shards];
+}
+
+static inline struct nova_dedup_shard *
+nova_local_shard(struct nova_sb_info *sbi)
+{
+	return sbi->dedup_shards[sbi->node_to_shard[numa_node_id()]];
+}
+
+static inline struct nova_dedup_shard *
+nova_entry_shard(struct nova_sb_info *sbi, u64 entrynr)
+{
+	return sbi->dedup_shards[entrynr / sbi->shard_entries];
+}
+
+/* Bucket accessors also account probes that cross a socket */
+static inline struct hlist_head *
+nova_weak_bucket(struct nova_sb_info *sbi, u64 idx)
+{
+	struct nova_dedup_shard *shard = nova_bucket_shard(sbi, idx);
+
+	if (shard->node != numa_node_id())
+		NOVA_STATS_ADD(dedup_remote_probes, 1);
+	return &shard->weak_hash_table[idx / sbi->dedup_nr_shards];
+}
+
+static inline struct hlist_head *
+nova_strong_bucket(struct nova_sb_info *sbi, u64 idx)
+{
+	struct nova_dedup_shard *shard = nova_bucket_shard(sbi, idx);
+
+	if (shard->node != numa_node_id())
+		NOVA_STATS_ADD(dedup_remote_probes, 1);
+	return &shard->strong_hash_table[idx / sbi->dedup_nr_shards];
+}
+
+static inline spinlock_t *
+nova_weak_bucket_lock(struct nova_sb_info *sbi, u64 idx)
+{
+	struct nova_dedup_shard *shard = nova_bucket_shard(sbi, idx);
+
+	return &shard->weak_hash_table_locks[(idx / sbi->dedup_nr_shards) %
+						HASH_TABLE_LOCK_NUM];
+}
+
+static inline spinlock_t *
+nova_strong_bucket_lock(struct nova_sb_info *sbi, u64 idx)
+{
+	struct nova_dedup_shard *shard = nova_bucket_shard(sbi, idx);
+
+	return &shard->strong_hash_table_locks[(idx / sbi->dedup_nr_shards) %
+						HASH_TABLE_LOCK_NUM];
+}
+
 #include "inode.h"
 static inline int nova_get_head_tail(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih)
@@ -433,6 +503,15 @@ struct vma_item {
 	unsigned long mmap_entry;
 };
 
+/* Pages [pgoff, pgoff + num_pages) of a file map to a write entry */
+struct nova_file_extent {
+	/* Reuse header of nova_range_node struct */
+	struct rb_node node;
+	struct nova_file_write_entry *entry;
+	unsigned long pgoff;
+	unsigned long num_pages;
+};
+
 static inline u32 nova_calculate_range_node_csum(struct nova_range_node *node)
 {
 	u32 crc;
@@ -493,9 +572,9 @@ struct inode_map {
 	struct rb_root		inode_inuse_tree;
 	unsigned long		num_range_node_inode;
 	struct nova_range_node *first_inode_range;
-	int			allocated;
-	int			freed;
-};
+	unsigned long		allocated;	/* Since mount */
+	unsigned long		freed;
+} ____cacheline_aligned_in_smp;
 
 
 
@@ -547,11 +626,13 @@ static inline struct nova_file_write_entry *
 nova_get_write_entry(struct super_block *sb,
 	struct nova_inode_info_header *sih, unsigned long blocknr)
 {
-	struct nova_file_write_entry *entry;
+	struct nova_file_extent *ext;
 
-	entry = radix_tree_lookup(&sih->tree, blocknr);
+	ext = nova_find_file_extent(sih, blocknr);
+	if (ext && ext->pgoff <= blocknr)
+		return ext->entry;
 
-	return entry;
+	return NULL;
 }
 
 
@@ -749,19 +830,25 @@ static inline void nova_set_page_invalid_entries(struct super_block *sb,
 				sizeof(struct nova_inode_page_tail), 0);
 }
 
-static inline void nova_inc_page_num_entries(struct super_block *sb,
-	u64 curr)
+static inline void nova_add_page_num_entries(struct super_block *sb,
+	u64 curr, unsigned int num)
 {
 	struct nova_inode_log_page *curr_page;
 
 	curr = BLOCK_OFF(curr);
 	curr_page = (struct nova_inode_log_page *)nova_get_block(sb, curr);
 
-	curr_page->page_tail.num_entries++;
+	curr_page->page_tail.num_entries += num;
 	nova_flush_buffer(&curr_page->page_tail,
 				sizeof(struct nova_inode_page_tail), 0);
 }
 
+static inline void nova_inc_page_num_entries(struct super_block *sb,
+	u64 curr)
+{
+	nova_add_page_num_entries(sb, curr, 1);
+}
+
 u64 nova_print_log_entry(struct super_block *sb, u64 curr);
 
 static inline void nova_inc_page_invalid_entries(struct super_block *sb,
@@ -958,6 +1045,10 @@ void nova_update_entry_csum(void *entry);
 int nova_update_block_csum(struct super_block *sb,
 	struct nova_inode_info_header *sih, u8 *block, unsigned long blocknr,
 	size_t offset, size_t bytes, int zero);
+void nova_block_stripe_csums(struct super_block *sb, const u8 *block,
+	u32 *csums);
+void nova_write_block_csums(struct super_block *sb, unsigned long blocknr,
+	const u32 *csums);
 int nova_update_alter_entry(struct super_block *sb, void *entry);
 int nova_check_inode_integrity(struct super_block *sb, u64 ino, u64 pi_addr,
 	u64 alter_pi_addr, struct nova_inode *pic, int check_replica);
@@ -1054,6 +1145,15 @@ int nova_inode_log_fast_gc(struct super_block *sb,
 	struct nova_inode *pi, struct nova_inode_info_header *sih,
 	u64 curr_tail, u64 new_block, u64 alter_new_block, int num_pages,
 	int force_thorough);
+void nova_link_log_pages(struct super_block *sb,
+	struct nova_inode_info_header *sih, u64 curr_tail, u64 new_block,
+	u64 alter_new_block);
+int nova_log_gc_defer(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long pages);
+void nova_log_gc_dequeue(struct super_block *sb,
+	struct nova_inode_info_header *sih);
+int nova_log_gc_init(struct super_block *sb);
+void nova_log_gc_stop(struct super_block *sb);
 
 /* ioctl.c */
 extern long nova_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
@@ -1082,6 +1182,8 @@ extern const struct inode_operations nova_special_inode_operations;
 extern struct dentry *nova_get_parent(struct dentry *child);
 
 /* parity.c */
+int nova_update_block_parity(struct super_block *sb, u8 *block,
+	unsigned long blocknr, int zero);
 int nova_update_pgoff_parity(struct super_block *sb,
 	struct nova_inode_info_header *sih, struct nova_file_write_entry *entry,
 	unsigned long pgoff, int zero);
@@ -1111,10 +1213,40 @@ int nova_rebuild_inode(struct super_block *sb, struct nova_inode_info *si,
 	u64 ino, u64 pi_addr, int rebuild_dir);
 int nova_restore_snapshot_table(struct super_block *sb, int just_init);
 
+/* rcache.c */
+struct nova_rcache_block {
+	struct hlist_node node;
+	struct list_head clock;
+	unsigned long blocknr;
+	atomic_t refs;
+	int referenced;		/* CLOCK bit, set on hit */
+	void *data;
+};
+
+struct nova_rcache_block *nova_rcache_get(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long blocknr);
+void nova_rcache_put(struct nova_rcache_block *blk);
+void nova_rcache_invalidate(struct super_block *sb, unsigned long blocknr);
+int nova_rcache_init(struct super_block *sb);
+void nova_rcache_exit(struct super_block *sb);
+
+/* reclaim.c */
+int nova_reclaim_defer_inode(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih);
+int nova_reclaim_init(struct super_block *sb);
+void nova_reclaim_stop(struct super_block *sb);
+
 /* snapshot.c */
 int nova_encounter_mount_snapshot(struct super_block *sb, void *addr,
 	u8 type);
 int nova_save_snapshots(struct super_block *sb);
+void nova_snapshot_cleaner_stop(struct super_block *sb);
+void nova_snapshot_space_share(struct super_block *sb, unsigned long blocknr);
+void nova_snapshot_space_unshare(struct super_block *sb,
+	unsigned long blocknr);
+int nova_snapshot_space_query(struct super_block *sb,
+	struct nova_snapshot_space *space);
+void nova_snapshot_space_init(struct super_block *sb);
 int nova_destroy_snapshot_infos(struct super_block *sb);
 int nova_restore_snapshot_entry(struct super_block *sb,
 	struct nova_snapshot_info_entry *entry, u64 curr_p, int just_init);
@@ -1126,7 +1258,8 @@ int nova_append_inode_to_snapshot(struct super_block *sb,
 	struct nova_inode *pi);
 int nova_print_snapshots(struct super_block *sb, struct seq_file *seq);
 int nova_print_snapshot_lists(struct super_block *sb, struct seq_file *seq);
-int nova_delete_dead_inode(struct super_block *sb, u64 ino);
+int nova_delete_dead_inode(struct super_block *sb, u64 ino,
+	unsigned long batch);
 int nova_create_snapshot(struct super_block *sb);
 int nova_delete_snapshot(struct super_block *sb, u64 epoch_id);
 int nova_snapshot_init(struct super_block *sb);
@@ -1156,6 +1289,7 @@ void nova_print_free_lists(struct super_block *sb);
 
 /* perf.c */
 int nova_test_perf(struct super_block *sb, unsigned int func_id,
-	unsigned int poolmb, size_t size, unsigned int disks);
+	unsigned int poolmb, size_t size, unsigned int disks,
+	unsigned int dup, unsigned int threads, unsigned int load);
 
 #endif /* __NOVA_H */
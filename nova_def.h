@@ -156,5 +156,6 @@ static inline void nova_flush_buffer(void *buf, uint32_t len, bool fence)
 #define POISON_MASK		(~(POISON_RADIUS - 1))
 #define NOVA_STRIPE_SHIFT	(9) /* size should be no less than PR_SIZE */
 #define NOVA_STRIPE_SIZE	(1 << NOVA_STRIPE_SHIFT)
+#define NOVA_PAGE_STRIPES	(PAGE_SIZE >> NOVA_STRIPE_SHIFT)
 
 #endif /* _LINUX_NOVA_DEF_H */
@@ -72,7 +72,7 @@ static int nova_update_block_parity(struct super_block *sb,
 	size_t offset, size_t bytes, int zero)
 
  */
-static int nova_update_block_parity(struct super_block *sb, u8 *block,
+int nova_update_block_parity(struct super_block *sb, u8 *block,
 	unsigned long blocknr, int zero)
 {
 	size_t strp_size = NOVA_STRIPE_SIZE;
@@ -277,6 +277,128 @@ static const raid5_call_t raid5_calls[] = {
 //	{ "xor_blocks", xor_blocks_call },
 };
 
+/* dedup functions, each call works on one 4 KiB page */
+static int nova_fp_weak_call(struct nova_dedup_perf *perf, int i)
+{
+	struct nova_sb_info *sbi = NOVA_SB(perf->sb);
+	struct nova_fp_weak fp;
+
+	return nova_fp_weak_calc(&sbi->nova_fp_weak_ctx,
+				 perf->pages + i * PAGE_SIZE, &fp);
+}
+
+static int nova_fp_strong_call(struct nova_dedup_perf *perf, int i)
+{
+	struct nova_sb_info *sbi = NOVA_SB(perf->sb);
+	struct nova_fp_strong fp;
+
+	return nova_fp_strong_calc(&sbi->nova_fp_strong_ctx,
+				   perf->pages + i * PAGE_SIZE, &fp);
+}
+
+static int shash_call(struct nova_dedup_perf *perf, int i)
+{
+	/* descriptor on stack, unlike nova_fp_*_calc which kmalloc it */
+	SHASH_DESC_ON_STACK(desc, perf->alg);
+	u8 digest[HASH_MAX_DIGESTSIZE];
+
+	desc->tfm = perf->alg;
+	return crypto_shash_digest(desc, perf->pages + i * PAGE_SIZE,
+				   PAGE_SIZE, digest);
+}
+
+/* same walk as nova_find_in_weak_hlist, with the entry table in DRAM */
+static struct nova_hentry *perf_find_in_weak_hlist(
+	struct nova_dedup_perf *perf, struct hlist_head *hlist, u32 fp)
+{
+	struct nova_hentry *hentry;
+
+	hlist_for_each_entry(hentry, hlist, node) {
+		if (perf->entry_fps[hentry->entrynr] == fp)
+			return hentry;
+	}
+
+	return NULL;
+}
+
+static int index_probe_call(struct nova_dedup_perf *perf, int i)
+{
+	u32 fp = perf->fps[i];
+	unsigned long idx = fp & perf->bucket_mask;
+	spinlock_t *lock = &perf->locks[idx % HASH_TABLE_LOCK_NUM];
+	struct nova_hentry *hentry;
+
+	spin_lock(lock);
+	hentry = perf_find_in_weak_hlist(perf, &perf->buckets[idx], fp);
+	spin_unlock(lock);
+
+	return hentry != NULL;
+}
+
+static int index_insert_call(struct nova_dedup_perf *perf, int i)
+{
+	u32 fp = perf->fps[i];
+	unsigned long idx = fp & perf->bucket_mask;
+	spinlock_t *lock = &perf->locks[idx % HASH_TABLE_LOCK_NUM];
+	struct nova_hentry *hentry;
+	int hit = 1;
+
+	/* probe, then insert on a miss, as a non-duplicate write does */
+	spin_lock(lock);
+	hentry = perf_find_in_weak_hlist(perf, &perf->buckets[idx], fp);
+	if (hentry == NULL) {
+		hentry = &perf->hentries[perf->nr_preload + i];
+		hlist_add_head(&hentry->node, &perf->buckets[idx]);
+		hit = 0;
+	}
+	spin_unlock(lock);
+
+	return hit;
+}
+
+static int entry_alloc_free_call(struct nova_dedup_perf *perf, int i)
+{
+	entrynr_t entrynr = nova_alloc_entry(perf->sb);
+
+	return nova_free_entry(perf->sb, entrynr);
+}
+
+/*
+ * Drop one reference of a hot entry the way nova_dedup_put_block does, with
+ * perf->locks[0] standing in for the bucket locks. Returns 1 on the last one.
+ */
+static int entry_hot_put_call(struct nova_dedup_perf *perf, int i)
+{
+	bool last;
+
+	if (nova_entry_refcount_put_shared(perf->sb, perf->entrynr))
+		return 0;
+
+	spin_lock(&perf->locks[0]);
+	last = nova_entry_refcount_put(perf->sb, perf->entrynr);
+	spin_unlock(&perf->locks[0]);
+
+	return last;
+}
+
+static const dedup_call_t dedup_calls[] = {
+	/* order should match enum dedup_call_id */
+	{ "nova_fp_weak_calc",   NULL,        nova_fp_weak_call },
+	{ "nova_fp_strong_calc", NULL,        nova_fp_strong_call },
+	{ "shash crc32c",        "crc32c",    shash_call },
+	{ "shash crc32",         "crc32",     shash_call },
+	{ "shash crct10dif",     "crct10dif", shash_call },
+	{ "shash md5",           "md5",       shash_call },
+	{ "shash sha1",          "sha1",      shash_call },
+	{ "shash sha256",        "sha256",    shash_call },
+	{ "shash sha512",        "sha512",    shash_call },
+	{ "shash xxhash64",      "xxhash64",  shash_call },
+	{ "index probe",         NULL,        index_probe_call },
+	{ "index insert",        NULL,        index_insert_call },
+	{ "entry alloc/free",    NULL,        entry_alloc_free_call },
+	{ "hot entry put",       NULL,        entry_hot_put_call }
+};
+
 /* memory pools for perf testing */
 static void *nova_alloc_vmem_pool(size_t poolsize)
 {
@@ -537,8 +659,285 @@ out:
 	return err;
 }
 
+/* fill the pool with pages, dup percent of them copy an earlier page */
+static void nova_dedup_perf_fill(struct nova_dedup_perf *perf,
+	unsigned int dup)
+{
+	struct nova_sb_info *sbi = NOVA_SB(perf->sb);
+	struct nova_fp_weak fp;
+	char *page;
+	int i;
+
+	for (i = 0; i < perf->reps; i++) {
+		page = perf->pages + i * PAGE_SIZE;
+		/* spread the duplicates evenly over the pool */
+		perf->dup[i] = i > 0 && (i * dup / 100) != ((i - 1) * dup / 100);
+		if (perf->dup[i])
+			memcpy(page, perf->pages + prandom_u32_max(i) * PAGE_SIZE,
+								PAGE_SIZE);
+		else
+			prandom_bytes(page, PAGE_SIZE);
+
+		nova_fp_weak_calc(&sbi->nova_fp_weak_ctx, page, &fp);
+		perf->fps[i] = fp.u32;
+	}
+}
+
+/*
+ * Build the private index: one bucket per page and load percent of the
+ * buckets' worth of random entries. For probes the duplicate pages are
+ * indexed as well, so they hit while unique pages miss.
+ */
+static int nova_dedup_perf_index(struct nova_dedup_perf *perf,
+	unsigned int load, bool probe)
+{
+	unsigned long nbuckets, nr, idx, i;
+
+	nbuckets = roundup_pow_of_two(max(perf->reps, HASH_TABLE_LOCK_NUM));
+	perf->bucket_mask = nbuckets - 1;
+	perf->nr_preload = nbuckets * load / 100;
+	nr = perf->nr_preload + perf->reps;
+
+	perf->buckets = vzalloc(nbuckets * sizeof(struct hlist_head));
+	perf->hentries = vzalloc(nr * sizeof(struct nova_hentry));
+	perf->entry_fps = vmalloc(nr * sizeof(u32));
+	if (!perf->buckets || !perf->hentries || !perf->entry_fps)
+		return -ENOMEM;
+
+	for (i = 0; i < HASH_TABLE_LOCK_NUM; i++)
+		spin_lock_init(&perf->locks[i]);
+
+	for (i = 0; i < nr; i++) {
+		perf->hentries[i].entrynr = i;
+		if (i < perf->nr_preload)
+			perf->entry_fps[i] = prandom_u32();
+		else
+			perf->entry_fps[i] = perf->fps[i - perf->nr_preload];
+
+		if (i < perf->nr_preload ||
+		    (probe && perf->dup[i - perf->nr_preload])) {
+			idx = perf->entry_fps[i] & perf->bucket_mask;
+			hlist_add_head(&perf->hentries[i].node,
+						&perf->buckets[idx]);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Give a private entry one reference per page, written straight to PM as a
+ * remount leaves it: exact and untagged, and hot if the pool is large enough.
+ * The threads then drop all of them from distinct CPUs.
+ */
+static void nova_dedup_perf_hot_entry(struct nova_dedup_perf *perf)
+{
+	struct nova_sb_info *sbi = NOVA_SB(perf->sb);
+
+	if (perf->reps < sbi->refcount_hot_thresh)
+		nova_dbg("hot entry put: %d pages stay below threshold %lld\n",
+			 perf->reps, (long long)sbi->refcount_hot_thresh);
+
+	spin_lock_init(&perf->locks[0]);
+	perf->entrynr = nova_alloc_entry(perf->sb);
+	perf->pentry = (struct nova_pmm_entry *)nova_get_block(perf->sb,
+		nova_get_block_off(perf->sb, sbi->metadata_start,
+				   NOVA_BLOCK_TYPE_4K)) + perf->entrynr;
+
+	memset_nt(perf->pentry, 0, sizeof(*perf->pentry));
+	perf->pentry->refcount = perf->reps;
+	nova_flush_buffer(perf->pentry, sizeof(*perf->pentry), true);
+}
+
+/* Every reference must be gone, and exactly one put must have said so */
+static int nova_dedup_perf_hot_check(struct nova_dedup_perf *perf,
+	unsigned long lasts)
+{
+	struct nova_pmm_entry *pentry = perf->pentry;
+
+	if (lasts != 1 || pentry->refcount != 0 || pentry->tag_TXID != 0) {
+		nova_err(perf->sb, "%s: %lu last puts, refcount %llu, tag %llx\n",
+			 __func__, lasts, pentry->refcount, pentry->tag_TXID);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int nova_dedup_perf_thread(void *data)
+{
+	struct nova_dedup_perf_worker *worker = data;
+	struct nova_dedup_perf *perf = worker->perf;
+	u64 start;
+	int i, ret;
+
+	start = ktime_get_ns();
+	for (i = worker->first; i < worker->last; i++) {
+		ret = perf->fn->call(perf, i);
+		if (ret < 0) {
+			worker->err = ret;
+			break;
+		}
+		worker->hits += ret;
+	}
+	worker->nsec = ktime_get_ns() - start;
+
+	if (atomic_dec_and_test(&perf->running))
+		complete(&perf->done);
+	return 0;
+}
+
+/*
+ * Dedup calls split the pool across threads bound to distinct CPUs.
+ * Latency is the per-thread time of one call; throughput counts all
+ * threads against the wall clock.
+ */
+static int nova_test_dedup_perf(struct super_block *sb, unsigned int func_id,
+	unsigned int call_id, size_t poolsize, unsigned int dup,
+	unsigned int threads, unsigned int load)
+{
+	struct nova_dedup_perf *perf;
+	struct nova_dedup_perf_worker *workers;
+	const char *fname = dedup_calls[call_id].name;
+	unsigned long nsec = 0, hits = 0, wall, lat, thru;
+	u64 start;
+	int cpu, t, err = 0;
+
+	perf = kzalloc(sizeof(struct nova_dedup_perf), GFP_KERNEL);
+	workers = kcalloc(threads, sizeof(struct nova_dedup_perf_worker),
+								GFP_KERNEL);
+	if (perf == NULL || workers == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	perf->sb = sb;
+	perf->fn = &dedup_calls[call_id];
+	perf->reps = poolsize / PAGE_SIZE;
+	perf->pages = nova_alloc_vmem_pool(poolsize);
+	perf->fps = vmalloc(perf->reps * sizeof(u32));
+	perf->dup = vmalloc(perf->reps);
+	if (!perf->pages || !perf->fps || !perf->dup) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (perf->fn->alg) {
+		perf->alg = crypto_alloc_shash(perf->fn->alg, 0, 0);
+		if (IS_ERR(perf->alg)) {
+			perf->alg = NULL;
+			nova_dbg("%s not available, skip testing\n", fname);
+			goto out;
+		}
+		if (crypto_shash_digestsize(perf->alg) > HASH_MAX_DIGESTSIZE) {
+			nova_dbg("%s digest too large, skip testing\n", fname);
+			goto out;
+		}
+	}
+
+	nova_dedup_perf_fill(perf, dup);
+	if (call_id == index_probe_id || call_id == index_insert_id) {
+		err = nova_dedup_perf_index(perf, load,
+					    call_id == index_probe_id);
+		if (err)
+			goto out;
+	} else if (call_id == entry_hot_put_id) {
+		nova_dedup_perf_hot_entry(perf);
+	}
+
+	get_online_cpus();
+	atomic_set(&perf->running, threads);
+	init_completion(&perf->done);
+	cpu = cpumask_first(cpu_online_mask);
+	for (t = 0; t < threads; t++) {
+		workers[t].perf = perf;
+		workers[t].cpu = cpu;
+		workers[t].first = perf->reps * t / threads;
+		workers[t].last = perf->reps * (t + 1) / threads;
+		workers[t].task = kthread_create(nova_dedup_perf_thread,
+					&workers[t], "nova_perf%d", t);
+		if (IS_ERR(workers[t].task)) {
+			err = PTR_ERR(workers[t].task);
+			while (--t >= 0)
+				kthread_stop(workers[t].task);
+			put_online_cpus();
+			goto out;
+		}
+		kthread_bind(workers[t].task, cpu);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	start = ktime_get_ns();
+	for (t = 0; t < threads; t++)
+		wake_up_process(workers[t].task);
+	wait_for_completion(&perf->done);
+	wall = ktime_get_ns() - start;
+	put_online_cpus();
+
+	for (t = 0; t < threads; t++) {
+		nsec += workers[t].nsec;
+		hits += workers[t].hits;
+		if (workers[t].err)
+			err = workers[t].err;
+	}
+
+	if (call_id == entry_hot_put_id && !err)
+		err = nova_dedup_perf_hot_check(perf, hits);
+
+	lat  = (err) ? 0 : nsec / perf->reps;
+	thru = (err) ? 0 : mb_per_sec((u64)perf->reps * PAGE_SIZE, wall);
+
+	if (call_id == index_probe_id || call_id == index_insert_id)
+		nova_info("%4u %25s %4u %8lu %8lu  hit %lu%%\n", func_id, fname,
+			workers[0].cpu, lat, thru, hits * 100 / perf->reps);
+	else
+		nova_info("%4u %25s %4u %8lu %8lu\n", func_id, fname,
+			workers[0].cpu, lat, thru);
+
+out:
+	if (perf != NULL) {
+		if (perf->pentry) {
+			memset_nt(perf->pentry, 0, sizeof(*perf->pentry));
+			nova_flush_buffer(perf->pentry,
+					  sizeof(*perf->pentry), true);
+			nova_free_entry(sb, perf->entrynr);
+		}
+		if (perf->alg)
+			crypto_free_shash(perf->alg);
+		vfree(perf->entry_fps);
+		vfree(perf->hentries);
+		vfree(perf->buckets);
+		vfree(perf->dup);
+		vfree(perf->fps);
+		nova_free_vmem_pool(perf->pages);
+		kfree(perf);
+	}
+	kfree(workers);
+
+	if (err)
+		nova_dbg("%s: performance test aborted\n", __func__);
+	return err;
+}
+
+static int nova_test_call_perf(struct super_block *sb, unsigned int func_id,
+	size_t poolsize, size_t size, unsigned int disks,
+	unsigned int dup, unsigned int threads, unsigned int load)
+{
+	/* dedup calls sleep on their threads, so keep them off get_cpu() */
+	if (func_id > NUM_BASE_PERF_CALLS)
+		return nova_test_dedup_perf(sb, func_id,
+				func_id - NUM_BASE_PERF_CALLS - 1,
+				poolsize, dup, threads, load);
+
+	return nova_test_func_perf(sb, func_id, poolsize, size, disks);
+}
+
 int nova_test_perf(struct super_block *sb, unsigned int func_id,
-	unsigned int poolmb, size_t size, unsigned int disks)
+	unsigned int poolmb, size_t size, unsigned int disks,
+	unsigned int dup, unsigned int threads, unsigned int load)
 {
 	int id, ret = 0;
 	size_t poolsize = poolmb * 1024 * 1024;
@@ -568,23 +967,41 @@ int nova_test_perf(struct super_block *sb, unsigned int func_id,
 		ret = -EFAULT;
 		goto out;
 	}
+	if (dup > 100) {
+		nova_dbg("%s: invalid duplication ratio %u%%!\n", __func__, dup);
+		ret = -EFAULT;
+		goto out;
+	}
+	if (threads < 1 || num_online_cpus() < threads) {
+		nova_dbg("%s: invalid thread count %u!\n", __func__, threads);
+		ret = -EFAULT;
+		goto out;
+	}
+	if (load > 800) { /* limit average bucket chain length */
+		nova_dbg("%s: invalid load factor %u%%!\n", __func__, load);
+		ret = -EFAULT;
+		goto out;
+	}
 
 	nova_info("test function performance\n");
 	nova_info("pool size %u MB, work size %zu, disks %u\n",
 					poolmb, size, disks);
+	nova_info("dedup %u%%, threads %u, index load %u%%\n",
+					dup, threads, load);
 
 	nova_info("%4s %25s %4s %8s %8s\n", "id", "name", "cpu", "ns", "MB/s");
 	nova_info("-------------------------------------------------------\n");
 	if (func_id == 0) {
 		/* individual function id starting from 1 */
 		for (id = 1; id <= NUM_PERF_CALLS; id++) {
-			ret = nova_test_func_perf(sb, id, poolsize,
-							size, disks);
+			ret = nova_test_call_perf(sb, id, poolsize,
+					size, disks, dup, threads, load);
 			if (ret < 0)
 				goto out;
 		}
 	} else {
-		ret = nova_test_func_perf(sb, func_id, poolsize, size, disks);
+		ret = nova_test_call_perf(sb, func_id, poolsize, size, disks,
+						dup, threads, load);
 	}
 	nova_info("-------------------------------------------------------\n");
 
@@ -21,7 +21,10 @@
 #include <linux/zutil.h>
 #include <linux/libnvdimm.h>
 #include <linux/raid/xor.h>
+#include <linux/random.h>
+#include <linux/completion.h>
 #include "nova.h"
+#include "dedup.h"
 
 #define	reset_perf_timer()	__this_cpu_write(Timingstats_percpu[perf_t], 0)
 #define	read_perf_timer()	__this_cpu_read(Timingstats_percpu[perf_t])
@@ -64,16 +67,37 @@ enum raid5_call_id {
 	NUM_RAID5_CALLS
 };
 
-#define	NUM_PERF_CALLS	\
+enum dedup_call_id {
+	nova_fp_weak_id = 0,
+	nova_fp_strong_id,
+	shash_crc32c_id,
+	shash_crc32_id,
+	shash_crct10dif_id,
+	shash_md5_id,
+	shash_sha1_id,
+	shash_sha256_id,
+	shash_sha512_id,
+	shash_xxhash64_id,
+	index_probe_id,
+	index_insert_id,
+	entry_alloc_free_id,
+	entry_hot_put_id,
+	NUM_DEDUP_CALLS
+};
+
+#define	NUM_BASE_PERF_CALLS	\
 	 (NUM_MEMCPY_CALLS + NUM_FROM_PMEM_CALLS + NUM_TO_PMEM_CALLS + \
 	  NUM_CHECKSUM_CALLS + NUM_RAID5_CALLS)
 
+#define	NUM_PERF_CALLS	(NUM_BASE_PERF_CALLS + NUM_DEDUP_CALLS)
+
 enum call_group_id {
 	memcpy_gid = 0,
 	from_pmem_gid,
 	to_pmem_gid,
 	checksum_gid,
-	raid5_gid
+	raid5_gid,
+	dedup_gid
 };
 
 typedef struct {
@@ -94,3 +118,50 @@ typedef struct {
 	u64 (*call)(char **, char *,                        /* data, parity */
 			size_t, int);          /* per-disk-size, data disks */
 } raid5_call_t;
+
+struct nova_dedup_perf;
+
+typedef struct {
+	const char *name;                              /* name of this call */
+	const char *alg;             /* crypto shash backend, NULL if none */
+	int (*call)(struct nova_dedup_perf *, int);       /* test, page nr */
+} dedup_call_t;
+
+/*
+ * State shared by the worker threads of one dedup call. Pages are 4 KiB
+ * and a configurable share of them duplicates an earlier page. The index
+ * calls run against a private weak-fp table laid out like a dedup shard,
+ * so they never touch the live index of the mounted file system.
+ */
+struct nova_dedup_perf {
+	struct super_block *sb;
+	const dedup_call_t *fn;
+	struct crypto_shash *alg;
+	char *pages;
+	u32 *fps;			/* weak fp of each page */
+	u8 *dup;			/* page duplicates an earlier one */
+	int reps;
+
+	struct hlist_head *buckets;
+	unsigned long bucket_mask;
+	spinlock_t locks[HASH_TABLE_LOCK_NUM];
+	struct nova_hentry *hentries;	/* preloaded entries, then pages */
+	u32 *entry_fps;			/* stands in for pentry->fp_weak */
+	unsigned long nr_preload;
+
+	entrynr_t entrynr;		/* private entry of the hot put test */
+	struct nova_pmm_entry *pentry;
+
+	atomic_t running;
+	struct completion done;
+};
+
+struct nova_dedup_perf_worker {
+	struct nova_dedup_perf *perf;
+	struct task_struct *task;
+	int cpu;
+	int first, last;		/* page range of this thread */
+	u64 nsec;
+	unsigned long hits;
+	int err;
+};
@@ -0,0 +1,232 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * DRAM read cache for shared dedup blocks
+ *
+ * Blocks shared by many files, such as common library pages of container
+ * images, are read from PM over and over. With the read_cache=<MB> mount
+ * option, reads keep a DRAM copy of blocks whose dedup entry has more than
+ * read_cache_min_refs references. A copy stays valid until its block is
+ * freed or rewritten: the dedup free path and the scrubber drop it, and so
+ * must anything that writes a shared block in place. Eviction is CLOCK over
+ * the insertion order.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include "nova.h"
+#include "dedup.h"
+
+struct nova_read_cache {
+	spinlock_t lock;		/* Protects all below */
+	struct hlist_head *buckets;
+	unsigned int bits;
+	struct list_head clock;		/* Oldest first */
+	unsigned long nr;
+	unsigned long capacity;
+};
+
+static struct hlist_head *nova_rcache_bucket(struct nova_read_cache *rc,
+	unsigned long blocknr)
+{
+	return &rc->buckets[hash_long(blocknr, rc->bits)];
+}
+
+static struct nova_rcache_block *nova_rcache_find(struct nova_read_cache *rc,
+	unsigned long blocknr)
+{
+	struct nova_rcache_block *blk;
+
+	hlist_for_each_entry(blk, nova_rcache_bucket(rc, blocknr), node) {
+		if (blk->blocknr == blocknr)
+			return blk;
+	}
+
+	return NULL;
+}
+
+void nova_rcache_put(struct nova_rcache_block *blk)
+{
+	if (atomic_dec_and_test(&blk->refs)) {
+		free_page((unsigned long)blk->data);
+		kfree(blk);
+	}
+}
+
+/* Lock held. Drops the reference of the table. */
+static void nova_rcache_unlink(struct nova_read_cache *rc,
+	struct nova_rcache_block *blk)
+{
+	hlist_del(&blk->node);
+	list_del(&blk->clock);
+	rc->nr--;
+	nova_rcache_put(blk);
+}
+
+/* Lock held */
+static void nova_rcache_evict(struct nova_read_cache *rc)
+{
+	struct nova_rcache_block *blk;
+
+	while (rc->nr > rc->capacity) {
+		blk = list_first_entry(&rc->clock, struct nova_rcache_block,
+					clock);
+		if (blk->referenced) {
+			blk->referenced = 0;
+			list_move_tail(&blk->clock, &rc->clock);
+			continue;
+		}
+		nova_rcache_unlink(rc, blk);
+		NOVA_STATS_ADD(read_cache_evictions, 1);
+	}
+}
+
+static struct nova_rcache_block *nova_rcache_fill(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long blocknr)
+{
+	struct nova_read_cache *rc = NOVA_SB(sb)->read_cache;
+	struct nova_rcache_block *blk, *old;
+	void *addr;
+
+	blk = kmalloc(sizeof(*blk), GFP_NOFS);
+	if (!blk)
+		return NULL;
+
+	blk->data = (void *)__get_free_page(GFP_NOFS);
+	if (!blk->data)
+		goto out_free;
+
+	/* Verify once here, hits skip the csum check */
+	addr = nova_get_block(sb, blocknr << PAGE_SHIFT);
+	if (memcpy_mcsafe(blk->data, addr, PAGE_SIZE))
+		goto out_page;
+	if (data_csum > 0 &&
+	    !nova_verify_data_csum(sb, sih, blocknr, 0, PAGE_SIZE))
+		goto out_page;
+
+	blk->blocknr = blocknr;
+	blk->referenced = 0;
+	atomic_set(&blk->refs, 2);	/* Table and caller */
+
+	spin_lock(&rc->lock);
+	old = nova_rcache_find(rc, blocknr);
+	if (old) {
+		/* Lost a race with another reader */
+		atomic_inc(&old->refs);
+		spin_unlock(&rc->lock);
+		free_page((unsigned long)blk->data);
+		kfree(blk);
+		return old;
+	}
+	hlist_add_head(&blk->node, nova_rcache_bucket(rc, blocknr));
+	list_add_tail(&blk->clock, &rc->clock);
+	rc->nr++;
+	nova_rcache_evict(rc);
+	spin_unlock(&rc->lock);
+
+	NOVA_STATS_ADD(read_cache_fills, 1);
+	return blk;
+
+out_page:
+	free_page((unsigned long)blk->data);
+out_free:
+	kfree(blk);
+	return NULL;
+}
+
+/*
+ * Return the cached copy of @blocknr with a reference held, filling it if
+ * the block is shared widely enough. NULL means read the block from PM.
+ */
+struct nova_rcache_block *nova_rcache_get(struct super_block *sb,
+	struct nova_inode_info_header *sih, unsigned long blocknr)
+{
+	struct nova_read_cache *rc = NOVA_SB(sb)->read_cache;
+	struct nova_rcache_block *blk;
+
+	spin_lock(&rc->lock);
+	blk = nova_rcache_find(rc, blocknr);
+	if (blk) {
+		blk->referenced = 1;
+		atomic_inc(&blk->refs);
+	}
+	spin_unlock(&rc->lock);
+
+	if (blk) {
+		NOVA_STATS_ADD(read_cache_hits, 1);
+		return blk;
+	}
+
+	NOVA_STATS_ADD(read_cache_misses, 1);
+	if (nova_dedup_block_refs(sb, blocknr) <= read_cache_min_refs)
+		return NULL;
+
+	return nova_rcache_fill(sb, sih, blocknr);
+}
+
+/* @blocknr is freed or its content is no longer trusted */
+void nova_rcache_invalidate(struct super_block *sb, unsigned long blocknr)
+{
+	struct nova_read_cache *rc = NOVA_SB(sb)->read_cache;
+	struct nova_rcache_block *blk;
+
+	if (!rc)
+		return;
+
+	spin_lock(&rc->lock);
+	blk = nova_rcache_find(rc, blocknr);
+	if (blk) {
+		nova_rcache_unlink(rc, blk);
+		NOVA_STATS_ADD(read_cache_invalidations, 1);
+	}
+	spin_unlock(&rc->lock);
+}
+
+int nova_rcache_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_read_cache *rc;
+	unsigned long i;
+
+	if (sbi->read_cache_mb == 0)
+		return 0;
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	if (!rc)
+		return -ENOMEM;
+
+	rc->capacity = sbi->read_cache_mb << (20 - PAGE_SHIFT);
+	rc->bits = ilog2(roundup_pow_of_two(rc->capacity));
+	rc->buckets = vmalloc(sizeof(struct hlist_head) << rc->bits);
+	if (!rc->buckets) {
+		kfree(rc);
+		return -ENOMEM;
+	}
+	for (i = 0; i < (1UL << rc->bits); i++)
+		INIT_HLIST_HEAD(&rc->buckets[i]);
+	spin_lock_init(&rc->lock);
+	INIT_LIST_HEAD(&rc->clock);
+
+	sbi->read_cache = rc;
+	nova_info("Read cache of %lu MB for blocks with more than %u references\n",
+			sbi->read_cache_mb, read_cache_min_refs);
+	return 0;
+}
+
+void nova_rcache_exit(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_read_cache *rc = sbi->read_cache;
+	struct nova_rcache_block *blk, *tmp;
+
+	if (!rc)
+		return;
+
+	list_for_each_entry_safe(blk, tmp, &rc->clock, clock)
+		nova_rcache_put(blk);
+	vfree(rc->buckets);
+	kfree(rc);
+	sbi->read_cache = NULL;
+}
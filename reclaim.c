@@ -0,0 +1,210 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Deferred reclaim of deleted files
+ *
+ * Freeing a large deduplicated file drops a dedup reference for every block,
+ * which can stall the task that drops the last link for a long time. Such
+ * inodes are queued in a slot table in PM at eviction instead, and a
+ * background thread frees them from their logs like the snapshot cleaner
+ * frees dead inodes. Queued slots survive unmount. After a crash, failure
+ * recovery has already reclaimed the queued inodes, so their slots are
+ * dropped at mount.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/kthread.h>
+#include "nova.h"
+#include "inode.h"
+
+/* Smaller files are freed at eviction */
+#define NOVA_RECLAIM_MIN_BLOCKS		256
+/* Pages of a file the thread frees before it yields */
+#define NOVA_RECLAIM_BATCH_BLOCKS	16384
+
+/*
+ * Queue the evicted inode for the reclaim thread. Returns 0 if it was
+ * queued, otherwise the caller frees the inode itself.
+ */
+int nova_reclaim_defer_inode(struct super_block *sb, struct nova_inode *pi,
+	struct nova_inode_info_header *sih)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_reclaim_slot *slot;
+	unsigned long i;
+
+	if (!sbi->reclaim_thread || !S_ISREG(sih->i_mode) ||
+	    sih->i_blocks < NOVA_RECLAIM_MIN_BLOCKS || pi->valid)
+		return -EINVAL;
+
+	spin_lock(&sbi->reclaim_lock);
+	for (i = 0; i < sbi->reclaim_nr_slots; i++) {
+		slot = &sbi->reclaim_slots[i];
+		if (slot->ino == 0)
+			break;
+	}
+
+	if (i == sbi->reclaim_nr_slots) {
+		spin_unlock(&sbi->reclaim_lock);
+		NOVA_STATS_ADD(reclaim_queue_full, 1);
+		return -ENOSPC;
+	}
+
+	slot->blocks = cpu_to_le64(sih->i_blocks);
+	slot->ino = cpu_to_le64(sih->ino);
+	nova_flush_buffer(slot, sizeof(*slot), true);
+	sbi->reclaim_inodes++;
+	sbi->reclaim_blocks += sih->i_blocks;
+	spin_unlock(&sbi->reclaim_lock);
+
+	NOVA_STATS_ADD(reclaim_deferred, 1);
+	wake_up_interruptible(&sbi->reclaim_wait);
+	return 0;
+}
+
+static void nova_reclaim_slot_done(struct super_block *sb,
+	struct nova_reclaim_slot *slot)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	spin_lock(&sbi->reclaim_lock);
+	sbi->reclaim_inodes--;
+	sbi->reclaim_blocks -= le64_to_cpu(slot->blocks);
+	slot->ino = 0;
+	nova_flush_buffer(&slot->ino, sizeof(slot->ino), true);
+	spin_unlock(&sbi->reclaim_lock);
+}
+
+/* One pass over the queue; yields after every batch of freed pages */
+static void nova_reclaim_pass(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_reclaim_slot *slot;
+	unsigned long i;
+	u64 ino;
+	int ret;
+
+	for (i = 0; i < sbi->reclaim_nr_slots; i++) {
+		if (kthread_should_stop())
+			return;
+
+		slot = &sbi->reclaim_slots[i];
+		spin_lock(&sbi->reclaim_lock);
+		ino = le64_to_cpu(slot->ino);
+		spin_unlock(&sbi->reclaim_lock);
+		if (ino == 0)
+			continue;
+
+		ret = nova_delete_dead_inode(sb, ino,
+					NOVA_RECLAIM_BATCH_BLOCKS);
+		if (ret)
+			nova_dbg("%s: free inode %llu failed %d\n",
+					__func__, ino, ret);
+		nova_reclaim_slot_done(sb, slot);
+		NOVA_STATS_ADD(reclaim_freed, 1);
+		cond_resched();
+	}
+}
+
+static int nova_reclaim(void *arg)
+{
+	struct super_block *sb = arg;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	nova_dbg("Running reclaim thread\n");
+	for (;;) {
+		wait_event_interruptible(sbi->reclaim_wait,
+			READ_ONCE(sbi->reclaim_inodes) || kthread_should_stop());
+
+		if (kthread_should_stop())
+			break;
+
+		nova_reclaim_pass(sb);
+	}
+
+	return 0;
+}
+
+/* A slot is live while its inode is unlinked but not yet freed */
+static bool nova_reclaim_slot_live(struct super_block *sb, u64 ino)
+{
+	struct nova_inode *pi;
+	u64 pi_addr = 0;
+
+	if (ino < NOVA_NORMAL_INODE_START)
+		return false;
+
+	if (nova_get_inode_address(sb, ino, 0, &pi_addr, 0, 0) || pi_addr == 0)
+		return false;
+
+	pi = (struct nova_inode *)nova_get_block(sb, pi_addr);
+	return pi->i_mode && pi->deleted == 0 && pi->valid == 0;
+}
+
+int nova_reclaim_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_reclaim_slot *slot;
+	unsigned long i;
+	u64 ino;
+
+	spin_lock_init(&sbi->reclaim_lock);
+	init_waitqueue_head(&sbi->reclaim_wait);
+	sbi->reclaim_inodes = 0;
+	sbi->reclaim_blocks = 0;
+
+	/* Formatted without a queue: every file is freed at eviction */
+	if (sbi->reclaim_start == 0)
+		return 0;
+
+	sbi->reclaim_slots = nova_get_block(sb, nova_get_block_off(sb,
+				sbi->reclaim_start, NOVA_BLOCK_TYPE_4K));
+	sbi->reclaim_nr_slots = (NOVA_RECLAIM_QUEUE_BLOCKS << PAGE_SHIFT) /
+				sizeof(struct nova_reclaim_slot);
+
+	/* A snapshot mount is read-only, leave the queue alone */
+	if (sbi->mount_snapshot)
+		return 0;
+
+	for (i = 0; i < sbi->reclaim_nr_slots; i++) {
+		slot = &sbi->reclaim_slots[i];
+		ino = le64_to_cpu(slot->ino);
+		if (ino == 0)
+			continue;
+
+		if (!nova_reclaim_slot_live(sb, ino)) {
+			slot->ino = 0;
+			nova_flush_buffer(&slot->ino, sizeof(slot->ino), false);
+			continue;
+		}
+
+		sbi->reclaim_inodes++;
+		sbi->reclaim_blocks += le64_to_cpu(slot->blocks);
+	}
+	PERSISTENT_BARRIER();
+
+	if (sbi->reclaim_inodes)
+		nova_info("%lu deleted inodes pending reclaim, %lu blocks\n",
+				sbi->reclaim_inodes, sbi->reclaim_blocks);
+
+	sbi->reclaim_thread = kthread_run(nova_reclaim, sb, "nova_reclaim");
+	if (IS_ERR(sbi->reclaim_thread)) {
+		sbi->reclaim_thread = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Finishes the inode in progress; queued ones resume at next mount */
+void nova_reclaim_stop(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	if (sbi->reclaim_thread) {
+		kthread_stop(sbi->reclaim_thread);
+		sbi->reclaim_thread = NULL;
+	}
+}
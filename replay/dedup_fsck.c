@@ -0,0 +1,940 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Offline checker and scrubber for the dedup entry table of a NOVA image
+ *
+ * Build: cc -O2 -pthread -o dedup_fsck dedup_fsck.c udedup.c
+ *
+ * The device or image file is mapped read-only. The inode logs are crawled
+ * for the blocks files and snapshots still reference, the way failure
+ * recovery does, then the entry table is checked in parallel slices:
+ *   - the refcount equals the number of references to the block
+ *   - the fingerprints the flag claims match the block content
+ *   - the flag is known and the block lies in the data area
+ *   - no block is owned by two entries and no strong fingerprint by two
+ *     blocks
+ * Blocks of equal content stored more than once are reported as space
+ * lost to missed dedup. Check unmounted images only: a mounted one keeps
+ * refcounts in per-CPU deltas.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "udedup.h"
+
+/* ======================= On-media layout ======================= */
+
+/* mirrors nova_def.h, super.h, inode.h and log.h */
+#define NOVA_SUPER_MAGIC	0x4E4F5641
+#define NOVA_BLOCK_SHIFT	12
+#define NOVA_INODE_BITS		7
+#define NOVA_INODE_SIZE		128
+#define HEAD_RESERVED_BLOCKS	64
+#define NOVA_FEATURE_RECLAIM_QUEUE	0x1
+#define NOVA_RECLAIM_QUEUE_BLOCKS	4
+#define RESERVE_INODE_START	1
+#define INODE_TABLE0_START	16
+#define NOVA_INODETABLE_INO	2
+#define NOVA_SNAPSHOT_INO	6
+#define MAX_CPUS		1024
+#define CACHELINE_SIZE		64
+#define LOG_BLOCK_TAIL		4064
+#define INODE_TABLE_CHUNK	(2UL << 20)	/* inode tables grow by 2 MiB */
+#define NOVA_BLOCK_TYPE_4K	0
+
+enum nova_entry_type {
+	FILE_WRITE = 1,
+	DIR_LOG,
+	SET_ATTR,
+	LINK_CHANGE,
+	MMAP_WRITE,
+	SNAPSHOT_INFO,
+	NEXT_PAGE,
+};
+
+struct nova_super_block {
+	uint32_t s_sum;
+	uint32_t s_magic;
+	uint32_t s_features;
+	uint32_t s_blocksize;
+	uint64_t s_size;
+	char s_volume_name[16];
+	uint64_t s_epoch_id;
+	uint32_t s_mtime;
+	uint32_t s_wtime;
+	uint8_t s_padding8;
+	uint8_t s_metadata_csum;
+	uint8_t s_data_csum;
+	uint8_t s_data_parity;
+} __attribute((__packed__));
+
+struct nova_inode {
+	uint8_t i_rsvd;
+	uint8_t valid;
+	uint8_t deleted;
+	uint8_t i_blk_type;
+	uint32_t i_flags;
+	uint64_t i_size;
+	uint32_t i_ctime;
+	uint32_t i_mtime;
+	uint32_t i_atime;
+	uint16_t i_mode;
+	uint16_t i_links_count;
+	uint64_t i_xattr;
+	uint32_t i_uid;
+	uint32_t i_gid;
+	uint32_t i_generation;
+	uint32_t i_create_time;
+	uint64_t nova_ino;
+	uint64_t log_head;
+	uint64_t log_tail;
+	uint64_t alter_log_head;
+	uint64_t alter_log_tail;
+	uint64_t create_epoch_id;
+	uint64_t delete_epoch_id;
+	uint32_t rdev;
+	uint32_t csum;
+} __attribute((__packed__));
+
+struct nova_inode_page_tail {
+	uint32_t invalid_entries;
+	uint32_t num_entries;
+	uint64_t epoch_id;
+	uint64_t alter_page;
+	uint64_t next_page;
+} __attribute((__packed__));
+
+struct nova_file_write_entry {
+	uint8_t entry_type;
+	uint8_t reassigned;
+	uint8_t updating;
+	uint8_t padding;
+	uint32_t num_pages;
+	uint64_t block;
+	uint64_t pgoff;
+	uint32_t invalid_pages;
+	uint32_t mtime;
+	uint64_t size;
+	uint64_t epoch_id;
+	uint64_t trans_id;
+	uint32_t csumpadding;
+	uint32_t csum;
+} __attribute((__packed__));
+
+struct nova_setattr_logentry {
+	uint8_t entry_type;
+	uint8_t attr;
+	uint16_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t atime;
+	uint32_t mtime;
+	uint32_t ctime;
+	uint64_t size;
+	uint64_t epoch_id;
+	uint64_t trans_id;
+	uint8_t invalid;
+	uint8_t paddings[3];
+	uint32_t csum;
+} __attribute((__packed__));
+
+struct nova_snapshot_info_entry {
+	uint8_t type;
+	uint8_t deleted;
+	uint8_t paddings[6];
+	uint64_t epoch_id;
+	uint64_t timestamp;
+	uint64_t nvmm_page_addr;
+	uint32_t csumpadding;
+	uint32_t csum;
+} __attribute((__packed__));
+
+/* sizes of the entries the checker steps over */
+#define LINK_CHANGE_ENTRY_SIZE	40
+#define MMAP_ENTRY_SIZE		40
+
+/* ======================= Checker state ======================= */
+
+enum fsck_problem {
+	bad_log = 0,
+	bad_flag,
+	bad_block,
+	orphan_entry,
+	refcount_mismatch,
+	deferred_refcount,
+	weak_fp_mismatch,
+	strong_fp_mismatch,
+	block_claimed_twice,
+	duplicate_strong_fp,
+	NR_PROBLEMS
+};
+
+static const char *problem_names[NR_PROBLEMS] = {
+	"corrupt inode log", "unknown entry flag", "block out of range",
+	"unreferenced entry", "refcount mismatch", "stale deferred refcount",
+	"weak fp mismatch", "strong fp mismatch", "block owned twice",
+	"strong fp on two blocks"
+};
+
+/* content or stored fingerprint of one block */
+struct fsck_fp {
+	struct nova_fp_strong fp;
+	uint64_t blocknr;
+};
+
+struct fsck_vec {
+	struct fsck_fp *v;
+	size_t nr, cap;
+};
+
+struct fsck_worker {
+	struct fsck *f;
+	pthread_t thread;
+	int id;
+
+	/* crawl */
+	struct { uint64_t blocknr, epoch; } *map;	/* pgoff -> block */
+	size_t map_cap;
+	unsigned long files;
+	unsigned long huge_files;
+
+	/* entries */
+	unsigned long in_use[3];	/* non_fin, weak, strong */
+	unsigned long free_entries;
+	unsigned long unindexed;
+	struct fsck_vec content;
+	struct fsck_vec strong;
+	unsigned long problems[NR_PROBLEMS];
+};
+
+struct fsck {
+	const char *path;
+	const char *base;
+	size_t size;
+	struct nova_super_block *super;
+
+	unsigned long num_blocks;
+	unsigned long metadata_start;
+	unsigned long num_entries;
+	unsigned long zero_blocknr;
+	unsigned long data_start;
+	struct nova_pmm_entry *pentries;
+
+	uint64_t *snapshots;		/* live snapshot epochs, ascending */
+	unsigned long nr_snapshots;
+
+	uint32_t *refs;			/* references per block */
+	uint32_t *owner;		/* entrynr + 1 owning each block */
+
+	int nr_threads;
+	struct fsck_worker *workers;
+
+	unsigned long max_reports;
+	unsigned long reports;
+	pthread_mutex_t report_lock;
+};
+
+static void report(struct fsck_worker *w, enum fsck_problem p,
+	const char *fmt, ...)
+{
+	struct fsck *f = w->f;
+	va_list ap;
+
+	w->problems[p]++;
+	pthread_mutex_lock(&f->report_lock);
+	if (f->reports++ < f->max_reports) {
+		printf("%-24s ", problem_names[p]);
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+		putchar('\n');
+	}
+	pthread_mutex_unlock(&f->report_lock);
+}
+
+static inline const void *nova_addr(struct fsck *f, uint64_t off, size_t len)
+{
+	if (off == 0 || off >= f->size || len > f->size - off)
+		return NULL;
+	return f->base + off;
+}
+
+static inline const void *nova_block(struct fsck *f, uint64_t blocknr)
+{
+	return f->base + (blocknr << NOVA_BLOCK_SHIFT);
+}
+
+static inline const struct nova_inode *nova_reserved_inode(struct fsck *f,
+	uint64_t ino)
+{
+	return (const struct nova_inode *)(f->base +
+		RESERVE_INODE_START * UDEDUP_BLOCK_SIZE + ino * NOVA_INODE_SIZE);
+}
+
+static int vec_push(struct fsck_vec *vec, const struct nova_fp_strong *fp,
+	uint64_t blocknr)
+{
+	struct fsck_fp *v;
+
+	if (vec->nr == vec->cap) {
+		vec->cap = vec->cap ? vec->cap * 2 : 4096;
+		v = realloc(vec->v, vec->cap * sizeof(*v));
+		if (v == NULL)
+			return -ENOMEM;
+		vec->v = v;
+	}
+	vec->v[vec->nr].fp = *fp;
+	vec->v[vec->nr++].blocknr = blocknr;
+	return 0;
+}
+
+/* ======================= Log crawl ======================= */
+
+/*
+ * Step to the next entry like goto_next_page()/next_log_page(). Returns 0
+ * at a broken page link.
+ */
+static uint64_t log_next(struct fsck *f, uint64_t curr)
+{
+	const struct nova_inode_page_tail *tail;
+	const uint8_t *type;
+
+	if ((curr & (UDEDUP_BLOCK_SIZE - 1)) + 32 <= LOG_BLOCK_TAIL) {
+		type = nova_addr(f, curr, 1);
+		if (type == NULL)
+			return 0;
+		if (*type != NEXT_PAGE)
+			return curr;
+	}
+	tail = nova_addr(f, (curr & ~(uint64_t)(UDEDUP_BLOCK_SIZE - 1)) +
+				LOG_BLOCK_TAIL, sizeof(*tail));
+	return tail ? tail->next_page : 0;
+}
+
+/* a log holds at most every block of the device */
+#define LOG_STEP_LIMIT(f)	((f)->num_blocks * (UDEDUP_BLOCK_SIZE / 32))
+
+static int load_snapshots(struct fsck *f)
+{
+	const struct nova_inode *pi = nova_reserved_inode(f, NOVA_SNAPSHOT_INO);
+	const struct nova_snapshot_info_entry *entry;
+	uint64_t curr = pi->log_head, *s;
+	unsigned long steps = 0;
+	size_t cap = 0;
+
+	if (curr == 0 && pi->log_tail == 0)
+		return 0;
+
+	while (curr != pi->log_tail) {
+		curr = log_next(f, curr);
+		entry = nova_addr(f, curr, sizeof(*entry));
+		if (entry == NULL || steps++ > LOG_STEP_LIMIT(f))
+			return -EINVAL;
+		if (entry->type == SNAPSHOT_INFO && entry->deleted == 0) {
+			if (f->nr_snapshots == cap) {
+				cap = cap ? cap * 2 : 64;
+				s = realloc(f->snapshots, cap * sizeof(*s));
+				if (s == NULL)
+					return -ENOMEM;
+				f->snapshots = s;
+			}
+			f->snapshots[f->nr_snapshots++] = entry->epoch_id;
+		}
+		curr += sizeof(*entry);
+	}
+	return 0;
+}
+
+/* nova_old_entry_deleteable(): a snapshot taken in [create, delete) */
+static bool snapshot_keeps(struct fsck *f, uint64_t create, uint64_t delete)
+{
+	unsigned long i;
+
+	if (create == delete)
+		return false;
+	for (i = 0; i < f->nr_snapshots; i++) {
+		if (f->snapshots[i] >= create)
+			return f->snapshots[i] < delete;
+	}
+	return false;
+}
+
+static inline void ref_block(struct fsck *f, uint64_t blocknr)
+{
+	if (blocknr < f->num_blocks)
+		__atomic_fetch_add(&f->refs[blocknr], 1, __ATOMIC_RELAXED);
+}
+
+/* The page at @pgoff is overwritten or truncated in epoch @epoch */
+static void drop_page(struct fsck_worker *w, uint64_t pgoff, uint64_t epoch)
+{
+	if (pgoff >= w->map_cap || w->map[pgoff].blocknr == 0)
+		return;
+	if (snapshot_keeps(w->f, w->map[pgoff].epoch, epoch))
+		ref_block(w->f, w->map[pgoff].blocknr);
+	w->map[pgoff].blocknr = 0;
+}
+
+static int grow_map(struct fsck_worker *w, uint64_t end)
+{
+	size_t cap = w->map_cap ? w->map_cap : 1024;
+	void *map;
+
+	/* refuse offsets no image of this size can back */
+	if (end > w->f->num_blocks * 64)
+		return -EINVAL;
+	while (cap < end)
+		cap *= 2;
+	map = realloc(w->map, cap * sizeof(*w->map));
+	if (map == NULL)
+		return -ENOMEM;
+	w->map = map;
+	memset(&w->map[w->map_cap], 0, (cap - w->map_cap) * sizeof(*w->map));
+	w->map_cap = cap;
+	return 0;
+}
+
+static int crawl_write(struct fsck_worker *w,
+	const struct nova_file_write_entry *entry, uint64_t *i_size)
+{
+	uint64_t pgoff, end = entry->pgoff + entry->num_pages;
+	uint64_t block = entry->block >> NOVA_BLOCK_SHIFT;
+
+	*i_size = entry->size;
+	if (entry->num_pages == entry->invalid_pages)
+		return 0;
+	if (end > w->map_cap && grow_map(w, end) < 0)
+		return -EINVAL;
+
+	for (pgoff = entry->pgoff; pgoff < end; pgoff++) {
+		drop_page(w, pgoff, entry->epoch_id);
+		w->map[pgoff].blocknr = block + pgoff - entry->pgoff;
+		w->map[pgoff].epoch = entry->epoch_id;
+	}
+	return 0;
+}
+
+static void crawl_setattr(struct fsck_worker *w,
+	const struct nova_setattr_logentry *entry, uint64_t *i_size)
+{
+	uint64_t pgoff, first, last;
+
+	if (*i_size > entry->size) {
+		first = (entry->size + UDEDUP_BLOCK_SIZE - 1) >> NOVA_BLOCK_SHIFT;
+		last = (*i_size - 1) >> NOVA_BLOCK_SHIFT;
+		for (pgoff = first; pgoff <= last && pgoff < w->map_cap; pgoff++)
+			drop_page(w, pgoff, entry->epoch_id);
+	}
+	*i_size = entry->size;
+}
+
+/* nova_traverse_file_inode_log() without the ring windows */
+static void crawl_file(struct fsck_worker *w, const struct nova_inode *pi)
+{
+	struct fsck *f = w->f;
+	uint64_t curr = pi->log_head, i_size = 0, pgoff;
+	unsigned long steps = 0;
+	const uint8_t *type;
+	size_t len;
+
+	if (curr == 0 && pi->log_tail == 0)
+		return;
+	if (pi->i_blk_type != NOVA_BLOCK_TYPE_4K) {
+		/* only 4 KiB blocks are deduplicated */
+		w->huge_files++;
+		return;
+	}
+	w->files++;
+
+	while (curr != pi->log_tail) {
+		curr = log_next(f, curr);
+		type = nova_addr(f, curr, 32);
+		if (type == NULL || steps++ > LOG_STEP_LIMIT(f))
+			goto corrupt;
+
+		switch (*type) {
+		case FILE_WRITE:
+			len = sizeof(struct nova_file_write_entry);
+			if (nova_addr(f, curr, len) == NULL ||
+			    crawl_write(w, (const void *)type, &i_size) < 0)
+				goto corrupt;
+			break;
+		case SET_ATTR:
+			len = sizeof(struct nova_setattr_logentry);
+			if (nova_addr(f, curr, len) == NULL)
+				goto corrupt;
+			crawl_setattr(w, (const void *)type, &i_size);
+			break;
+		case LINK_CHANGE:
+			len = LINK_CHANGE_ENTRY_SIZE;
+			break;
+		case MMAP_WRITE:
+			len = MMAP_ENTRY_SIZE;
+			break;
+		default:
+			goto corrupt;
+		}
+		curr += len;
+	}
+
+	for (pgoff = 0; pgoff < w->map_cap; pgoff++) {
+		if (w->map[pgoff].blocknr) {
+			ref_block(f, w->map[pgoff].blocknr);
+			w->map[pgoff].blocknr = 0;
+		}
+	}
+	return;
+
+corrupt:
+	report(w, bad_log, "inode %lu at 0x%lx",
+		(unsigned long)pi->nova_ino, (unsigned long)curr);
+	/* what was mapped before the damage is still referenced */
+	for (pgoff = 0; pgoff < w->map_cap; pgoff++) {
+		if (w->map[pgoff].blocknr) {
+			ref_block(f, w->map[pgoff].blocknr);
+			w->map[pgoff].blocknr = 0;
+		}
+	}
+}
+
+static void crawl_inode_table(struct fsck_worker *w, int cpu)
+{
+	struct fsck *f = w->f;
+	const struct nova_inode *table_pi;
+	const struct nova_inode *pi;
+	const uint64_t *head, *next;
+	unsigned long per_chunk, i, chunks = 0;
+	uint64_t curr;
+
+	head = (const uint64_t *)(f->base +
+		INODE_TABLE0_START * UDEDUP_BLOCK_SIZE + cpu * CACHELINE_SIZE);
+	table_pi = nova_reserved_inode(f, NOVA_INODETABLE_INO);
+	/* 2 MiB inode table blocks, as failure_thread_func() walks them */
+	per_chunk = 1UL << (table_pi->i_blk_type == NOVA_BLOCK_TYPE_4K ?
+			NOVA_BLOCK_SHIFT - NOVA_INODE_BITS :
+			21 - NOVA_INODE_BITS);
+
+	for (curr = *head; curr; curr = *next) {
+		if (nova_addr(f, curr, INODE_TABLE_CHUNK) == NULL ||
+		    chunks++ > f->num_blocks / 512) {
+			report(w, bad_log, "inode table of cpu %d at 0x%lx",
+				cpu, (unsigned long)curr);
+			return;
+		}
+		for (i = 0; i < per_chunk; i++) {
+			pi = (const void *)(f->base + curr + i * NOVA_INODE_SIZE);
+			if (pi->i_mode == 0 || pi->deleted)
+				continue;
+			/* directories only log dentries */
+			if ((pi->i_mode & S_IFMT) == S_IFDIR)
+				continue;
+			crawl_file(w, pi);
+		}
+		next = (const uint64_t *)(f->base + curr + INODE_TABLE_CHUNK - 8);
+	}
+}
+
+static void *crawl_thread(void *arg)
+{
+	struct fsck_worker *w = arg;
+	int cpu;
+
+	for (cpu = w->id; cpu < MAX_CPUS; cpu += w->f->nr_threads)
+		crawl_inode_table(w, cpu);
+	return NULL;
+}
+
+/* ======================= Entry table ======================= */
+
+static void check_entry(struct fsck_worker *w, entrynr_t idx)
+{
+	struct fsck *f = w->f;
+	const struct nova_pmm_entry *pentry = &f->pentries[idx];
+	struct nova_fp_strong fp_strong;
+	struct nova_fp_weak fp_weak;
+	uint64_t blocknr = pentry->blocknr;
+	uint32_t refs, owner;
+	const void *block;
+
+	if (pentry->refcount == 0) {
+		/* a freed entry keeps its flag, nova_free_data_blocks() only
+		 * clears the block */
+		if (blocknr == 0)
+			w->free_entries++;
+		else
+			report(w, orphan_entry, "entry %lu block %lu",
+				(unsigned long)idx, (unsigned long)blocknr);
+		return;
+	}
+
+	if (pentry->flag != NON_FIN_FLAG && pentry->flag != FP_WEAK_FLAG &&
+	    pentry->flag != FP_STRONG_FLAG && pentry->flag != FP_POISON_FLAG)
+		report(w, bad_flag, "entry %lu flag 0x%02x",
+			(unsigned long)idx, pentry->flag);
+
+	if (blocknr < f->data_start || blocknr >= f->num_blocks) {
+		report(w, bad_block, "entry %lu block %lu",
+			(unsigned long)idx, (unsigned long)blocknr);
+		return;
+	}
+
+	owner = 0;
+	if (!__atomic_compare_exchange_n(&f->owner[blocknr], &owner, idx + 1,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		report(w, block_claimed_twice, "entries %lu and %lu block %lu",
+			(unsigned long)owner - 1, (unsigned long)idx,
+			(unsigned long)blocknr);
+		return;
+	}
+
+	refs = f->refs[blocknr];
+	if (pentry->refcount != refs) {
+		if (pentry->tag_TXID & NOVA_REFCNT_DEFERRED)
+			report(w, deferred_refcount,
+				"entry %lu refcount %lu, %u references",
+				(unsigned long)idx,
+				(unsigned long)pentry->refcount, refs);
+		else
+			report(w, refcount_mismatch,
+				"entry %lu refcount %lu, %u references",
+				(unsigned long)idx,
+				(unsigned long)pentry->refcount, refs);
+	}
+
+	block = nova_block(f, blocknr);
+	udedup_fp_strong_calc(block, &fp_strong);
+	switch (pentry->flag) {
+	case FP_STRONG_FLAG:
+		w->in_use[udedup_mode_str_fin]++;
+		if (memcmp(&fp_strong, &pentry->fp_strong, sizeof(fp_strong)))
+			report(w, strong_fp_mismatch, "entry %lu block %lu",
+				(unsigned long)idx, (unsigned long)blocknr);
+		if (vec_push(&w->strong, &pentry->fp_strong, blocknr) < 0)
+			goto nomem;
+		/* fall through */
+	case FP_WEAK_FLAG:
+		if (pentry->flag == FP_WEAK_FLAG)
+			w->in_use[udedup_mode_weak_str_fin]++;
+		if (f->super->s_data_csum)
+			udedup_fp_weak_csum_calc(block, &fp_weak);
+		else
+			udedup_fp_weak_calc(block, &fp_weak);
+		if (fp_weak.u32 != pentry->fp_weak.u32)
+			report(w, weak_fp_mismatch, "entry %lu block %lu",
+				(unsigned long)idx, (unsigned long)blocknr);
+		break;
+	case NON_FIN_FLAG:
+		w->in_use[udedup_mode_non_fin]++;
+		break;
+	/* FP_POISON_FLAG: known bad, reported by the online scrubber */
+	}
+
+	if (vec_push(&w->content, &fp_strong, blocknr) < 0)
+		goto nomem;
+	return;
+
+nomem:
+	fprintf(stderr, "out of memory\n");
+	exit(2);
+}
+
+static void *check_thread(void *arg)
+{
+	struct fsck_worker *w = arg;
+	struct fsck *f = w->f;
+	unsigned long per = (f->num_entries + f->nr_threads - 1) / f->nr_threads;
+	unsigned long idx, end;
+
+	idx = w->id * per;
+	end = idx + per < f->num_entries ? idx + per : f->num_entries;
+	for (; idx < end; idx++)
+		check_entry(w, idx);
+	return NULL;
+}
+
+/* Referenced blocks no entry owns, e.g. written before dedup was on */
+static void *unindexed_thread(void *arg)
+{
+	struct fsck_worker *w = arg;
+	struct fsck *f = w->f;
+	unsigned long per = (f->num_blocks + f->nr_threads - 1) / f->nr_threads;
+	struct nova_fp_strong fp;
+	unsigned long blocknr, end;
+
+	blocknr = w->id * per;
+	if (blocknr < f->data_start)
+		blocknr = f->data_start;
+	end = w->id * per + per;
+	if (end > f->num_blocks)
+		end = f->num_blocks;
+	for (; blocknr < end; blocknr++) {
+		if (f->refs[blocknr] == 0 || f->owner[blocknr])
+			continue;
+		w->unindexed++;
+		udedup_fp_strong_calc(nova_block(f, blocknr), &fp);
+		if (vec_push(&w->content, &fp, blocknr) < 0) {
+			fprintf(stderr, "out of memory\n");
+			exit(2);
+		}
+	}
+	return NULL;
+}
+
+static int run_workers(struct fsck *f, void *(*fn)(void *))
+{
+	int i, ret;
+
+	for (i = 0; i < f->nr_threads; i++) {
+		ret = pthread_create(&f->workers[i].thread, NULL, fn,
+					&f->workers[i]);
+		if (ret) {
+			while (i--)
+				pthread_join(f->workers[i].thread, NULL);
+			return -ret;
+		}
+	}
+	for (i = 0; i < f->nr_threads; i++)
+		pthread_join(f->workers[i].thread, NULL);
+	return 0;
+}
+
+static int cmp_fsck_fp(const void *a, const void *b)
+{
+	const struct fsck_fp *x = a, *y = b;
+	int ret = memcmp(&x->fp, &y->fp, sizeof(x->fp));
+
+	if (ret)
+		return ret;
+	return x->blocknr < y->blocknr ? -1 : x->blocknr > y->blocknr;
+}
+
+static struct fsck_fp *merge(struct fsck *f, size_t offset, size_t *nr)
+{
+	struct fsck_vec *vec;
+	struct fsck_fp *all;
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < f->nr_threads; i++)
+		n += ((struct fsck_vec *)((char *)&f->workers[i] + offset))->nr;
+	all = malloc((n ? n : 1) * sizeof(*all));
+	if (all == NULL)
+		return NULL;
+	n = 0;
+	for (i = 0; i < f->nr_threads; i++) {
+		vec = (struct fsck_vec *)((char *)&f->workers[i] + offset);
+		memcpy(all + n, vec->v, vec->nr * sizeof(*all));
+		n += vec->nr;
+	}
+	qsort(all, n, sizeof(*all), cmp_fsck_fp);
+	*nr = n;
+	return all;
+}
+
+/* ======================= Driver ======================= */
+
+static int map_image(struct fsck *f)
+{
+	struct nova_super_block sb;
+	int fd;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+		close(fd);
+		return -EIO;
+	}
+	if (sb.s_magic != NOVA_SUPER_MAGIC || sb.s_blocksize != UDEDUP_BLOCK_SIZE ||
+	    sb.s_size < (HEAD_RESERVED_BLOCKS + 2) * UDEDUP_BLOCK_SIZE) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	f->size = sb.s_size;
+	f->base = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (f->base == MAP_FAILED)
+		return -errno;
+	f->super = (struct nova_super_block *)f->base;
+
+	/* same layout as nova_dedup_setup() */
+	f->num_blocks = f->size >> NOVA_BLOCK_SHIFT;
+	f->metadata_start = HEAD_RESERVED_BLOCKS;
+	f->num_entries = ((f->num_blocks * sizeof(struct nova_pmm_entry)) >>
+				NOVA_BLOCK_SHIFT) + 1;
+	f->zero_blocknr = f->metadata_start + f->num_entries;
+	f->data_start = f->zero_blocknr + 1;
+	if (f->super->s_features & NOVA_FEATURE_RECLAIM_QUEUE)
+		f->data_start += NOVA_RECLAIM_QUEUE_BLOCKS;
+	f->num_entries = (f->num_entries << NOVA_BLOCK_SHIFT) /
+				sizeof(struct nova_pmm_entry);
+	f->pentries = (struct nova_pmm_entry *)(f->base +
+				(f->metadata_start << NOVA_BLOCK_SHIFT));
+	if (f->data_start >= f->num_blocks)
+		return -EINVAL;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-j threads] [-n max_reports] device_or_image\n"
+		"  -j  worker threads, default: online CPUs\n"
+		"  -n  problems printed in detail, default 50\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct nova_fp_strong zero_fp;
+	unsigned long problems[NR_PROBLEMS] = { 0 };
+	unsigned long in_use[UDEDUP_NR_MODES] = { 0 };
+	unsigned long files = 0, huge_files = 0, free_entries = 0;
+	unsigned long unindexed = 0, referenced = 0, wasted = 0, total = 0;
+	struct fsck f = { .max_reports = 50 };
+	struct fsck_fp *all;
+	char zero_page[UDEDUP_BLOCK_SIZE] = { 0 };
+	size_t nr, i, j;
+	int opt, ret, p;
+
+	f.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:n:")) != -1) {
+		switch (opt) {
+		case 'j':
+			f.nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			f.max_reports = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || f.nr_threads < 1)
+		usage(argv[0]);
+	f.path = argv[optind];
+
+	ret = map_image(&f);
+	if (ret < 0) {
+		fprintf(stderr, "%s: %s\n", f.path, ret == -EINVAL ?
+			"not a NOVA image" : strerror(-ret));
+		return 2;
+	}
+	printf("image         %s: %lu blocks, entry table at block %lu, "
+		"%lu entries\n", f.path, f.num_blocks, f.metadata_start,
+		f.num_entries);
+
+	f.refs = calloc(f.num_blocks, sizeof(uint32_t));
+	f.owner = calloc(f.num_blocks, sizeof(uint32_t));
+	f.workers = calloc(f.nr_threads, sizeof(struct fsck_worker));
+	if (!f.refs || !f.owner || !f.workers) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	pthread_mutex_init(&f.report_lock, NULL);
+	for (p = 0; p < f.nr_threads; p++) {
+		f.workers[p].f = &f;
+		f.workers[p].id = p;
+	}
+
+	ret = load_snapshots(&f);
+	if (ret < 0) {
+		fprintf(stderr, "snapshot log: %s\n", strerror(-ret));
+		return 2;
+	}
+
+	/* the crc tables are set up lazily, do it before the threads run */
+	udedup_fp_weak_calc(zero_page, &(struct nova_fp_weak){ 0 });
+	udedup_fp_weak_csum_calc(zero_page, &(struct nova_fp_weak){ 0 });
+	udedup_fp_strong_calc(zero_page, &zero_fp);
+
+	if (run_workers(&f, crawl_thread) < 0 ||
+	    run_workers(&f, check_thread) < 0 ||
+	    run_workers(&f, unindexed_thread) < 0) {
+		fprintf(stderr, "cannot start workers\n");
+		return 2;
+	}
+
+	for (p = 0; p < f.nr_threads; p++) {
+		files += f.workers[p].files;
+		huge_files += f.workers[p].huge_files;
+		free_entries += f.workers[p].free_entries;
+		unindexed += f.workers[p].unindexed;
+		for (i = 0; i < UDEDUP_NR_MODES; i++)
+			in_use[i] += f.workers[p].in_use[i];
+		for (i = 0; i < NR_PROBLEMS; i++)
+			problems[i] += f.workers[p].problems[i];
+	}
+	for (i = f.data_start; i < f.num_blocks; i++)
+		referenced += f.refs[i] != 0;
+
+	/* a strong fingerprint must name one block */
+	all = merge(&f, offsetof(struct fsck_worker, strong), &nr);
+	if (all == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	for (i = 1; i < nr; i++) {
+		if (!memcmp(&all[i].fp, &all[i - 1].fp, sizeof(all[i].fp)) &&
+		    all[i].blocknr != all[i - 1].blocknr) {
+			problems[duplicate_strong_fp]++;
+			report(&f.workers[0], duplicate_strong_fp,
+				"blocks %lu and %lu",
+				(unsigned long)all[i - 1].blocknr,
+				(unsigned long)all[i].blocknr);
+		}
+	}
+	free(all);
+
+	/* every copy of a content but one is lost, all of a zero page */
+	all = merge(&f, offsetof(struct fsck_worker, content), &nr);
+	if (all == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr; j++) {
+			if (memcmp(&all[j].fp, &all[i].fp, sizeof(all[i].fp)))
+				break;
+		}
+		if (!memcmp(&all[i].fp, &zero_fp, sizeof(zero_fp)))
+			wasted += j - i;
+		else
+			wasted += j - i - 1;
+	}
+	free(all);
+
+	printf("files         %lu crawled, %lu with huge blocks skipped, "
+		"%lu snapshots\n", files, huge_files, f.nr_snapshots);
+	printf("entries       %lu non_fin, %lu weak, %lu strong, %lu free\n",
+		in_use[udedup_mode_non_fin], in_use[udedup_mode_weak_str_fin],
+		in_use[udedup_mode_str_fin], free_entries);
+	printf("blocks        %lu referenced, %lu without an entry\n",
+		referenced, unindexed);
+	for (i = 0; i < NR_PROBLEMS; i++) {
+		if (problems[i])
+			printf("%-24s %lu\n", problem_names[i], problems[i]);
+		total += problems[i];
+	}
+	printf("missed dedup  %lu blocks (%.1f MB, %.2f%% of referenced)\n",
+		wasted, wasted * (double)UDEDUP_BLOCK_SIZE / (1024 * 1024),
+		referenced ? 100.0 * wasted / referenced : 0);
+	printf("%s\n", total ? "inconsistencies found" : "clean");
+
+	return total ? 1 : 0;
+}
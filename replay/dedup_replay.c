@@ -0,0 +1,365 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Replay block traces through the userspace dedup engine
+ *
+ * Build: cc -O2 -o dedup_replay dedup_replay.c udedup.c
+ *
+ * Traces:
+ *   -g blocks:pct  synthetic 4 KiB buffers, pct percent of which repeat an
+ *                  earlier buffer, like fio's dedupe_percentage
+ *   -f file        content trace, the file is replayed in 4 KiB blocks
+ *   -H file        hash trace, one chunk per line with a hex fingerprint
+ *                  first (FSL fs-hasher style, ':' separators allowed);
+ *                  '#' lines are skipped
+ *   -C file        decision trace read from /proc/fs/NOVA/<dev>/dedup_trace,
+ *                  merged in time order with sort -n -k2; records without
+ *                  a strong fp (trace level 1, non_fin writes) are skipped
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "udedup.h"
+
+static const char *stage_names[UDEDUP_NR_STAGES] = {
+	"weak fp", "strong fp", "hash table", "upsert entry"
+};
+
+static const char *mode_names[UDEDUP_NR_MODES] = {
+	"non_fin", "weak_str_fin", "str_fin"
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int replay_chunk(struct udedup *d, struct udedup_chunk *chunk)
+{
+	unsigned long blocknr;
+	int ret;
+
+	ret = udedup_new_write(d, chunk, &blocknr);
+	if (ret < 0)
+		fprintf(stderr, "dedup write failed at block %lu: %s\n",
+			(unsigned long)d->stats.blocks, strerror(-ret));
+	return ret;
+}
+
+/* xorshift64*, one state per distinct buffer */
+static void fill_buffer(uint64_t *buf, uint64_t state)
+{
+	int i;
+
+	for (i = 0; i < UDEDUP_BLOCK_SIZE / 8; i++) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		buf[i] = state * 0x2545F4914F6CDD1DULL;
+	}
+}
+
+static int replay_generated(struct udedup *d, unsigned long blocks,
+	unsigned int pct, unsigned int seed)
+{
+	uint64_t buf[UDEDUP_BLOCK_SIZE / 8], *states;
+	struct udedup_chunk chunk = { .data = buf };
+	unsigned long i, nr_states = 0;
+	int ret = 0;
+
+	states = malloc(blocks * sizeof(uint64_t));
+	if (states == NULL)
+		return -ENOMEM;
+
+	srand(seed);
+	for (i = 0; i < blocks && ret >= 0; i++) {
+		/* as fio: repeat an earlier buffer by reusing its seed */
+		if (nr_states && (unsigned int)(rand() % 100) < pct) {
+			fill_buffer(buf, states[rand() % nr_states]);
+		} else {
+			states[nr_states] = ((uint64_t)rand() << 32) ^ rand() ^
+						(i + 1);
+			fill_buffer(buf, states[nr_states++]);
+		}
+		ret = replay_chunk(d, &chunk);
+	}
+
+	free(states);
+	return ret < 0 ? ret : 0;
+}
+
+static int replay_content(struct udedup *d, const char *path)
+{
+	char buf[UDEDUP_BLOCK_SIZE];
+	struct udedup_chunk chunk = { .data = buf };
+	FILE *fp;
+	size_t n;
+	int ret = 0;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return -errno;
+
+	while (ret >= 0 && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		/* a short tail is padded with zeroes like a partial block */
+		if (n < sizeof(buf))
+			memset(buf + n, 0, sizeof(buf) - n);
+		ret = replay_chunk(d, &chunk);
+	}
+
+	fclose(fp);
+	return ret < 0 ? ret : 0;
+}
+
+static int parse_hash(const char *s, struct nova_fp_strong *fp)
+{
+	uint8_t *out = (uint8_t *)fp->u64s;
+	int n = 0, hi = -1, v;
+
+	memset(fp, 0, sizeof(*fp));
+	for (; *s && !isspace((unsigned char)*s); s++) {
+		if (*s == ':')
+			continue;
+		if (!isxdigit((unsigned char)*s))
+			return -EINVAL;
+		v = isdigit((unsigned char)*s) ? *s - '0' :
+					tolower((unsigned char)*s) - 'a' + 10;
+		if (hi < 0) {
+			hi = v;
+		} else {
+			if (n < (int)sizeof(*fp))
+				out[n++] = hi << 4 | v;
+			hi = -1;
+		}
+	}
+	return n > 0 ? 0 : -EINVAL;
+}
+
+static int replay_hashes(struct udedup *d, const char *path)
+{
+	struct udedup_chunk chunk = { .data = NULL };
+	char line[512], *s;
+	unsigned long lineno = 0;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+
+	while (ret >= 0 && fgets(line, sizeof(line), fp)) {
+		lineno++;
+		for (s = line; isspace((unsigned char)*s); s++)
+			;
+		if (*s == '\0' || *s == '#')
+			continue;
+		if (parse_hash(s, &chunk.fp_strong) < 0) {
+			fprintf(stderr, "%s:%lu: bad fingerprint\n", path, lineno);
+			continue;
+		}
+		udedup_hash_fp_weak(&chunk.fp_strong, &chunk.fp_weak);
+		ret = replay_chunk(d, &chunk);
+	}
+
+	fclose(fp);
+	return ret < 0 ? ret : 0;
+}
+
+/* the NOVA_TRACE_* flags of dedup.h */
+#define TRACE_WEAK	0x1
+#define TRACE_STRONG	0x2
+
+static int replay_capture(struct udedup *d, const char *path)
+{
+	struct udedup_chunk chunk = { .data = NULL };
+	char line[512], mode[32], result[16];
+	unsigned long lineno = 0, records = 0, hits = 0, skipped = 0;
+	unsigned long time, strong, entrynr;
+	unsigned int weak, latency, flags;
+	int cpu, ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -errno;
+
+	while (ret >= 0 && fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%d %lu %31s %15s %x %lx %lu %u %x", &cpu,
+			   &time, mode, result, &weak, &strong, &entrynr,
+			   &latency, &flags) != 9) {
+			fprintf(stderr, "%s:%lu: bad record\n", path, lineno);
+			continue;
+		}
+
+		records++;
+		if (!strcmp(result, "hit"))
+			hits++;
+		if (!strcmp(result, "zero")) {
+			d->stats.blocks++;
+			d->stats.zero_blocks++;
+			continue;
+		}
+		if (!strcmp(result, "error") || !(flags & TRACE_STRONG)) {
+			skipped++;
+			continue;
+		}
+
+		memset(&chunk.fp_strong, 0, sizeof(chunk.fp_strong));
+		chunk.fp_strong.u64s[0] = strong;
+		if (flags & TRACE_WEAK)
+			chunk.fp_weak.u32 = weak;
+		else
+			udedup_hash_fp_weak(&chunk.fp_strong, &chunk.fp_weak);
+		ret = replay_chunk(d, &chunk);
+	}
+
+	printf("captured      %lu records, %lu hits, %lu skipped\n",
+		records, hits, skipped);
+	fclose(fp);
+	return ret < 0 ? ret : 0;
+}
+
+static void report(struct udedup *d, uint64_t nsec)
+{
+	struct udedup_stats *s = &d->stats;
+	double sec = nsec / 1e9;
+	double mb = s->blocks * (double)UDEDUP_BLOCK_SIZE / (1024 * 1024);
+	int i;
+
+	printf("blocks        %lu (%.1f MB) in %.3f s\n",
+		(unsigned long)s->blocks, mb, sec);
+	printf("throughput    %.1f MB/s, %.0f blocks/s\n",
+		sec > 0 ? mb / sec : 0, sec > 0 ? s->blocks / sec : 0);
+	printf("duplicates    %lu, zero %lu, new %lu\n",
+		(unsigned long)s->dup_blocks, (unsigned long)s->zero_blocks,
+		(unsigned long)s->new_blocks);
+	printf("dedup ratio   %.3f (%.1f%% space saved)\n",
+		s->new_blocks ? (double)s->blocks / s->new_blocks : 0,
+		s->blocks ? 100.0 * (s->blocks - s->new_blocks) / s->blocks : 0);
+
+	printf("%-14s %10s\n", "mode", "blocks");
+	for (i = 0; i < UDEDUP_NR_MODES; i++)
+		printf("%-14s %10lu\n", mode_names[i],
+			(unsigned long)s->mode_blocks[i]);
+
+	printf("%-14s %10s %10s %12s\n", "stage", "calls", "ns/call",
+		"ns/block");
+	for (i = 0; i < UDEDUP_NR_STAGES; i++)
+		printf("%-14s %10lu %10lu %12.1f\n", stage_names[i],
+			(unsigned long)s->stage_calls[i],
+			(unsigned long)(s->stage_calls[i] ?
+				s->stage_ns[i] / s->stage_calls[i] : 0),
+			s->blocks ? (double)s->stage_ns[i] / s->blocks : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t table] [-e entries] [-m mode] [-s seed]\n"
+		"          (-g blocks:pct | -f content_trace | -H hash_trace |\n"
+		"           -C captured_trace)\n"
+		"  -t  PM entry table file, default dedup_table.pm\n"
+		"  -e  number of entries (and data blocks), default 1048576\n"
+		"  -m  adaptive, non_fin, weak_str_fin or str_fin\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *table = "dedup_table.pm", *path = NULL;
+	unsigned long entries = 1UL << 20, blocks = 0;
+	unsigned int pct = 0, seed = 1;
+	uint32_t mode = 0;
+	char trace = 0;
+	struct udedup d;
+	uint64_t start;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "t:e:m:s:g:f:H:C:")) != -1) {
+		switch (opt) {
+		case 't':
+			table = optarg;
+			break;
+		case 'e':
+			entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "adaptive"))
+				mode = 0;
+			else if (!strcmp(optarg, "non_fin"))
+				mode = NON_FIN;
+			else if (!strcmp(optarg, "weak_str_fin"))
+				mode = WEAK_STR_FIN;
+			else if (!strcmp(optarg, "str_fin"))
+				mode = STR_FIN;
+			else
+				usage(argv[0]);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			if (sscanf(optarg, "%lu:%u", &blocks, &pct) != 2 ||
+			    pct > 100)
+				usage(argv[0]);
+			trace = 'g';
+			break;
+		case 'f':
+		case 'H':
+		case 'C':
+			path = optarg;
+			trace = opt;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!trace || entries == 0)
+		usage(argv[0]);
+
+	ret = udedup_open(&d, table, entries, trace == 'H' || trace == 'C');
+	if (ret < 0) {
+		fprintf(stderr, "cannot set up %s: %s\n", table, strerror(-ret));
+		return 1;
+	}
+	d.seed = seed;
+	if (mode) {
+		d.fixed_mode = mode;
+		d.dedup_mode = mode;
+	}
+
+	start = now_ns();
+	if (trace == 'g')
+		ret = replay_generated(&d, blocks, pct, seed);
+	else if (trace == 'f')
+		ret = replay_content(&d, path);
+	else if (trace == 'H')
+		ret = replay_hashes(&d, path);
+	else
+		ret = replay_capture(&d, path);
+	udedup_calc_non_fin(&d);
+
+	report(&d, now_ns() - start);
+	if (ret < 0 && ret != -ENOSPC)
+		fprintf(stderr, "replay aborted: %s\n", strerror(-ret));
+
+	udedup_close(&d);
+	return ret < 0;
+}
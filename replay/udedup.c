@@ -0,0 +1,693 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Userspace model of the NV-Dedup engine for trace replay
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "udedup.h"
+
+/* ======================= Fingerprints ======================= */
+
+static uint32_t crc32_table[256];
+
+static void crc32_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+		crc32_table[i] = crc;
+	}
+}
+
+/*
+ * Same value as the kernel "crc32" shash used by nova_fp_weak_calc:
+ * crc32_le seeded with ~0 and no final inversion.
+ */
+void udedup_fp_weak_calc(const void *addr, struct nova_fp_weak *fp)
+{
+	const uint8_t *p = addr;
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+
+	if (crc32_table[1] == 0)
+		crc32_init_table();
+
+	for (i = 0; i < UDEDUP_BLOCK_SIZE; i++)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ p[i]) & 0xFF];
+	fp->u32 = crc;
+}
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78 : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+/* nova_crc32c(): crc32c with the given seed and no final inversion */
+static uint32_t udedup_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	if (crc32c_table[1] == 0)
+		crc32c_init_table();
+
+	for (i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ p[i]) & 0xFF];
+	return crc;
+}
+
+/*
+ * Weak fingerprint of a data_csum file system, nova_dedup_fp_weak: the
+ * crc32c of the little-endian crc32c values of the 512 B stripes.
+ */
+void udedup_fp_weak_csum_calc(const void *addr, struct nova_fp_weak *fp)
+{
+	uint32_t csums[UDEDUP_BLOCK_SIZE / UDEDUP_STRIPE_SIZE];
+	unsigned int i;
+
+	for (i = 0; i < UDEDUP_BLOCK_SIZE / UDEDUP_STRIPE_SIZE; i++)
+		csums[i] = udedup_crc32c(1, (const uint8_t *)addr +
+					i * UDEDUP_STRIPE_SIZE,
+					UDEDUP_STRIPE_SIZE);
+	fp->u32 = udedup_crc32c(1, (const uint8_t *)csums, sizeof(csums));
+}
+
+/* md5 (RFC 1321), the kernel "md5" shash used by nova_fp_strong_calc */
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+	0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+	0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+	0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+	0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+	0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(uint32_t h[4], const uint8_t *block)
+{
+	uint32_t w[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+	int i, g;
+
+	for (i = 0; i < 16; i++)
+		w[i] = block[i * 4] | block[i * 4 + 1] << 8 |
+			block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+		}
+		t = d;
+		d = c;
+		c = b;
+		f += a + md5_k[i] + w[g];
+		b += (f << md5_r[i]) | (f >> (32 - md5_r[i]));
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+void udedup_fp_strong_calc(const void *addr, struct nova_fp_strong *fp)
+{
+	uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint8_t pad[64] = { 0x80 };
+	uint64_t bits = (uint64_t)UDEDUP_BLOCK_SIZE * 8;
+	uint8_t *out = (uint8_t *)fp->u64s;
+	int i;
+
+	for (i = 0; i < UDEDUP_BLOCK_SIZE; i += 64)
+		md5_block(h, (const uint8_t *)addr + i);
+
+	/* the block size is a multiple of 64, so padding is one block */
+	for (i = 0; i < 8; i++)
+		pad[56 + i] = bits >> (8 * i);
+	md5_block(h, pad);
+
+	memset(fp, 0, sizeof(*fp));
+	for (i = 0; i < 16; i++)
+		out[i] = h[i / 4] >> (8 * (i % 4));
+}
+
+/* hash traces carry no data, the weak fp is taken from the strong one */
+void udedup_hash_fp_weak(const struct nova_fp_strong *strong,
+	struct nova_fp_weak *weak)
+{
+	weak->u32 = (uint32_t)strong->u64s[0];
+}
+
+/* ======================= Helpers ======================= */
+
+static inline uint64_t udedup_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void udedup_end(struct udedup *d, enum udedup_stage stage,
+	uint64_t start)
+{
+	d->stats.stage_ns[stage] += udedup_now() - start;
+	d->stats.stage_calls[stage]++;
+}
+
+static inline bool cmp_fp_strong(const struct nova_fp_strong *a,
+	const struct nova_fp_strong *b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static inline uint64_t udedup_bucket(struct udedup *d, uint64_t fp)
+{
+	return fp & ((1UL << d->num_entries_bits) - 1);
+}
+
+static void udedup_hlist_add(struct udedup_hentry **table, uint64_t idx,
+	entrynr_t entrynr)
+{
+	struct udedup_hentry *hentry = malloc(sizeof(*hentry));
+
+	if (hentry == NULL)
+		abort();
+	hentry->entrynr = entrynr;
+	hentry->next = table[idx];
+	table[idx] = hentry;
+}
+
+static struct udedup_hentry *udedup_find_in_weak_hlist(struct udedup *d,
+	uint64_t idx, const struct nova_fp_weak *fp_weak)
+{
+	struct udedup_hentry *hentry;
+
+	for (hentry = d->weak_hash_table[idx]; hentry; hentry = hentry->next)
+		if (d->pentries[hentry->entrynr].fp_weak.u32 == fp_weak->u32)
+			return hentry;
+	return NULL;
+}
+
+static struct udedup_hentry *udedup_find_in_strong_hlist(struct udedup *d,
+	uint64_t idx, const struct nova_fp_strong *fp_strong)
+{
+	struct udedup_hentry *hentry;
+
+	for (hentry = d->strong_hash_table[idx]; hentry; hentry = hentry->next)
+		if (cmp_fp_strong(&d->pentries[hentry->entrynr].fp_strong,
+				  fp_strong))
+			return hentry;
+	return NULL;
+}
+
+static void udedup_chunk_fp_weak(struct udedup *d,
+	const struct udedup_chunk *chunk, struct nova_fp_weak *fp)
+{
+	uint64_t start = udedup_now();
+
+	if (chunk->data)
+		udedup_fp_weak_calc(chunk->data, fp);
+	else
+		*fp = chunk->fp_weak;
+	udedup_end(d, udedup_weak_fp, start);
+}
+
+static void udedup_chunk_fp_strong(struct udedup *d,
+	const struct udedup_chunk *chunk, struct nova_fp_strong *fp)
+{
+	uint64_t start = udedup_now();
+
+	if (chunk->data)
+		udedup_fp_strong_calc(chunk->data, fp);
+	else
+		*fp = chunk->fp_strong;
+	udedup_end(d, udedup_strong_fp, start);
+}
+
+/* strong fp of a stored block, recalculated from its data like kmem */
+static void udedup_block_fp_strong(struct udedup *d, unsigned long blocknr,
+	struct nova_fp_strong *fp)
+{
+	uint64_t start = udedup_now();
+
+	if (d->blocks)
+		udedup_fp_strong_calc(d->blocks +
+				blocknr * UDEDUP_BLOCK_SIZE, fp);
+	else
+		*fp = d->block_fps[blocknr];
+	udedup_end(d, udedup_strong_fp, start);
+}
+
+static int udedup_alloc_entry(struct udedup *d, entrynr_t *entrynr)
+{
+	if (d->nr_free == 0)
+		return -ENOSPC;
+	*entrynr = d->free_list[--d->nr_free];
+	return 0;
+}
+
+static int udedup_alloc_block_write(struct udedup *d,
+	const struct udedup_chunk *chunk, unsigned long *blocknr)
+{
+	if (d->next_blocknr >= d->num_blocks)
+		return -ENOSPC;
+
+	*blocknr = d->next_blocknr++;
+	if (d->blocks)
+		memcpy(d->blocks + *blocknr * UDEDUP_BLOCK_SIZE, chunk->data,
+							UDEDUP_BLOCK_SIZE);
+	else
+		d->block_fps[*blocknr] = chunk->fp_strong;
+	d->stats.new_blocks++;
+	return 1;
+}
+
+/* allocate an entry and a block, and fill the entry for a new block */
+static int udedup_new_entry(struct udedup *d, const struct udedup_chunk *chunk,
+	unsigned long *blocknr, entrynr_t *entrynr, uint8_t flag,
+	const struct nova_fp_weak *fp_weak,
+	const struct nova_fp_strong *fp_strong)
+{
+	struct nova_pmm_entry *pentry;
+	uint64_t start;
+	int allocated;
+
+	if (udedup_alloc_entry(d, entrynr) < 0)
+		return -ENOSPC;
+	allocated = udedup_alloc_block_write(d, chunk, blocknr);
+	if (allocated < 0) {
+		d->free_list[d->nr_free++] = *entrynr;
+		return allocated;
+	}
+
+	start = udedup_now();
+	pentry = d->pentries + *entrynr;
+	memset(pentry, 0, sizeof(*pentry));
+	pentry->flag = flag;
+	pentry->blocknr = *blocknr;
+	if (fp_weak)
+		pentry->fp_weak = *fp_weak;
+	if (fp_strong)
+		pentry->fp_strong = *fp_strong;
+	pentry->refcount = 1;
+	d->blocknr_to_entry[*blocknr] = *entrynr;
+	udedup_end(d, udedup_upsert_entry, start);
+
+	return allocated;
+}
+
+static void udedup_ref_entry(struct udedup *d, struct nova_pmm_entry *pentry,
+	unsigned long *blocknr)
+{
+	uint64_t start = udedup_now();
+
+	pentry->refcount++;
+	*blocknr = pentry->blocknr;
+	++d->dup_block;
+	d->stats.dup_blocks++;
+	udedup_end(d, udedup_upsert_entry, start);
+}
+
+/* ======================= Dedup modes ======================= */
+
+static int udedup_str_fin(struct udedup *d, const struct udedup_chunk *chunk,
+	unsigned long *blocknr)
+{
+	struct nova_fp_weak fp_weak;
+	struct nova_fp_strong fp_strong = {0}, entry_fp_strong = {0};
+	struct nova_pmm_entry *pentry;
+	struct udedup_hentry *weak_find_hentry, *strong_find_hentry;
+	uint64_t weak_idx, strong_idx, start;
+	entrynr_t strong_find_entry;
+	int allocated = 0;
+
+	udedup_chunk_fp_weak(d, chunk, &fp_weak);
+	udedup_chunk_fp_strong(d, chunk, &fp_strong);
+
+	start = udedup_now();
+	weak_idx = udedup_bucket(d, fp_weak.u32);
+	weak_find_hentry = udedup_find_in_weak_hlist(d, weak_idx, &fp_weak);
+	strong_idx = udedup_bucket(d, fp_strong.u64s[0]);
+	strong_find_hentry = udedup_find_in_strong_hlist(d, strong_idx,
+								&fp_strong);
+	udedup_end(d, udedup_hash_table, start);
+
+	if (strong_find_hentry) {
+		pentry = d->pentries + strong_find_hentry->entrynr;
+		udedup_ref_entry(d, pentry, blocknr);
+		pentry->fp_weak = fp_weak;
+		pentry->flag = FP_STRONG_FLAG;
+		strong_find_entry = strong_find_hentry->entrynr;
+	} else {
+		if (weak_find_hentry) {
+			pentry = d->pentries + weak_find_hentry->entrynr;
+			udedup_block_fp_strong(d, pentry->blocknr,
+							&entry_fp_strong);
+		}
+		if (weak_find_hentry &&
+		    cmp_fp_strong(&entry_fp_strong, &fp_strong)) {
+			pentry->fp_strong = entry_fp_strong;
+			pentry->flag = FP_STRONG_FLAG;
+			udedup_ref_entry(d, pentry, blocknr);
+			strong_find_entry = weak_find_hentry->entrynr;
+		} else {
+			allocated = udedup_new_entry(d, chunk, blocknr,
+					&strong_find_entry, FP_STRONG_FLAG,
+					&fp_weak, &fp_strong);
+			if (allocated < 0)
+				return allocated;
+		}
+		udedup_hlist_add(d->strong_hash_table, strong_idx,
+							strong_find_entry);
+	}
+
+	if (!weak_find_hentry)
+		udedup_hlist_add(d->weak_hash_table, weak_idx,
+							strong_find_entry);
+	return allocated;
+}
+
+static int udedup_weak_str_fin(struct udedup *d,
+	const struct udedup_chunk *chunk, unsigned long *blocknr)
+{
+	struct nova_fp_weak fp_weak;
+	struct nova_fp_strong fp_strong = {0}, entry_fp_strong = {0};
+	struct nova_pmm_entry *weak_entry;
+	struct udedup_hentry *weak_find_hentry, *strong_find_hentry;
+	uint64_t weak_idx, strong_idx, start;
+	entrynr_t alloc_entry;
+	int allocated = 0;
+
+	udedup_chunk_fp_weak(d, chunk, &fp_weak);
+
+	start = udedup_now();
+	weak_idx = udedup_bucket(d, fp_weak.u32);
+	weak_find_hentry = udedup_find_in_weak_hlist(d, weak_idx, &fp_weak);
+	udedup_end(d, udedup_hash_table, start);
+
+	if (!weak_find_hentry) {
+		/* unseen weak fp, skip the strong fingerprint */
+		allocated = udedup_new_entry(d, chunk, blocknr, &alloc_entry,
+					FP_WEAK_FLAG, &fp_weak, NULL);
+		if (allocated > 0)
+			udedup_hlist_add(d->weak_hash_table, weak_idx,
+								alloc_entry);
+		return allocated;
+	}
+
+	weak_entry = d->pentries + weak_find_hentry->entrynr;
+	if (weak_entry->flag == FP_STRONG_FLAG) {
+		entry_fp_strong = weak_entry->fp_strong;
+	} else if (weak_entry->flag == FP_WEAK_FLAG) {
+		udedup_block_fp_strong(d, weak_entry->blocknr, &entry_fp_strong);
+		weak_entry->flag = FP_STRONG_FLAG;
+		weak_entry->fp_strong = entry_fp_strong;
+		udedup_hlist_add(d->strong_hash_table,
+				udedup_bucket(d, entry_fp_strong.u64s[0]),
+				weak_find_hentry->entrynr);
+	}
+
+	udedup_chunk_fp_strong(d, chunk, &fp_strong);
+	if (cmp_fp_strong(&fp_strong, &entry_fp_strong)) {
+		udedup_ref_entry(d, weak_entry, blocknr);
+		return allocated;
+	}
+
+	start = udedup_now();
+	strong_idx = udedup_bucket(d, fp_strong.u64s[0]);
+	strong_find_hentry = udedup_find_in_strong_hlist(d, strong_idx,
+								&fp_strong);
+	udedup_end(d, udedup_hash_table, start);
+
+	if (strong_find_hentry) {
+		udedup_ref_entry(d, d->pentries + strong_find_hentry->entrynr,
+								blocknr);
+	} else {
+		allocated = udedup_new_entry(d, chunk, blocknr, &alloc_entry,
+					FP_STRONG_FLAG, &fp_weak, &fp_strong);
+		if (allocated > 0)
+			udedup_hlist_add(d->strong_hash_table, strong_idx,
+								alloc_entry);
+	}
+	return allocated;
+}
+
+static int udedup_non_fin(struct udedup *d, const struct udedup_chunk *chunk,
+	unsigned long *blocknr)
+{
+	entrynr_t alloc_entry;
+	int allocated;
+
+	allocated = udedup_new_entry(d, chunk, blocknr, &alloc_entry,
+					NON_FIN_FLAG, NULL, NULL);
+	if (allocated > 0)
+		d->non_fin[d->nr_non_fin++] = alloc_entry;
+	return allocated;
+}
+
+/*
+ * Background fingerprinting of NON_FIN entries, run inline where the
+ * kernel wakes its calc_non_fin thread. The kernel scans the whole entry
+ * table; only entries written in NON_FIN mode can match, so those are
+ * tracked on a list instead.
+ */
+void udedup_calc_non_fin(struct udedup *d)
+{
+	struct nova_pmm_entry *pentry;
+	struct nova_fp_weak fp_weak;
+	uint64_t weak_idx;
+	entrynr_t idx;
+
+	while (d->nr_non_fin) {
+		idx = d->non_fin[--d->nr_non_fin];
+		pentry = d->pentries + idx;
+		if (pentry->flag != NON_FIN_FLAG || pentry->refcount == 0 ||
+		    d->blocknr_to_entry[pentry->blocknr] != idx)
+			continue;
+
+		if (d->blocks)
+			udedup_fp_weak_calc(d->blocks +
+				pentry->blocknr * UDEDUP_BLOCK_SIZE, &fp_weak);
+		else
+			udedup_hash_fp_weak(&d->block_fps[pentry->blocknr],
+								&fp_weak);
+
+		weak_idx = udedup_bucket(d, fp_weak.u32);
+		if (udedup_find_in_weak_hlist(d, weak_idx, &fp_weak))
+			continue;
+
+		pentry->flag = FP_WEAK_FLAG;
+		pentry->fp_weak = fp_weak;
+		udedup_hlist_add(d->weak_hash_table, weak_idx, idx);
+	}
+}
+
+static inline bool udedup_is_zero_page(const void *data)
+{
+	const uint64_t *p = data;
+	const uint64_t *end = p + UDEDUP_BLOCK_SIZE / sizeof(uint64_t);
+
+	for (; p < end; p += 8) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+	}
+	return true;
+}
+
+/* mirrors nova_dedup_new_write */
+int udedup_new_write(struct udedup *d, const struct udedup_chunk *chunk,
+	unsigned long *blocknr)
+{
+	d->stats.blocks++;
+
+	if (chunk->data && udedup_is_zero_page(chunk->data)) {
+		*blocknr = UDEDUP_ZERO_BLOCKNR;
+		d->stats.zero_blocks++;
+		return 0;
+	}
+
+	++d->cur_block;
+	if (d->cur_block >= SAMPLE_BLOCK) {
+		if (d->dedup_mode == NON_FIN)
+			udedup_calc_non_fin(d);
+		if (d->fixed_mode)
+			d->dedup_mode = d->fixed_mode;
+		else if (d->dup_block > STR_FIN_THRESH)
+			d->dedup_mode = STR_FIN;
+		else if (d->dup_block > NON_FIN_THRESH)
+			d->dedup_mode = WEAK_STR_FIN;
+		else
+			d->dedup_mode = (rand_r(&d->seed) & 1) ?
+						NON_FIN : WEAK_STR_FIN;
+		d->cur_block = 0;
+		d->dup_block = 0;
+	}
+
+	if (d->dedup_mode & NON_FIN) {
+		d->stats.mode_blocks[udedup_mode_non_fin]++;
+		return udedup_non_fin(d, chunk, blocknr);
+	} else if (d->dedup_mode & WEAK_STR_FIN) {
+		d->stats.mode_blocks[udedup_mode_weak_str_fin]++;
+		return udedup_weak_str_fin(d, chunk, blocknr);
+	} else if (d->dedup_mode & STR_FIN) {
+		d->stats.mode_blocks[udedup_mode_str_fin]++;
+		return udedup_str_fin(d, chunk, blocknr);
+	}
+	return -ESRCH;
+}
+
+/* ======================= Setup ======================= */
+
+int udedup_open(struct udedup *d, const char *table_path,
+	unsigned long num_entries, bool hash_trace)
+{
+	size_t table_size = num_entries * sizeof(struct nova_pmm_entry);
+	unsigned long sz, i;
+
+	memset(d, 0, sizeof(*d));
+	d->num_entries = num_entries;
+	d->num_entries_bits = 32 - __builtin_clz(num_entries);
+	d->dedup_mode = NON_FIN;
+	d->seed = 1;
+	sz = 1UL << d->num_entries_bits;
+
+	/* a fresh table, as after mount -o init */
+	d->fd = open(table_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (d->fd < 0)
+		return -errno;
+	if (ftruncate(d->fd, table_size) < 0)
+		goto err;
+	d->pentries = mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+						MAP_SHARED, d->fd, 0);
+	if (d->pentries == MAP_FAILED) {
+		d->pentries = NULL;
+		goto err;
+	}
+
+	d->weak_hash_table = calloc(sz, sizeof(struct udedup_hentry *));
+	d->strong_hash_table = calloc(sz, sizeof(struct udedup_hentry *));
+	d->free_list = malloc(num_entries * sizeof(entrynr_t));
+	d->non_fin = malloc(num_entries * sizeof(entrynr_t));
+
+	/* one block per entry, after the reserved and zero blocks */
+	d->num_blocks = num_entries + UDEDUP_ZERO_BLOCKNR + 1;
+	d->next_blocknr = UDEDUP_ZERO_BLOCKNR + 1;
+	d->blocknr_to_entry = malloc(d->num_blocks * sizeof(entrynr_t));
+	if (hash_trace) {
+		d->block_fps = calloc(d->num_blocks,
+					sizeof(struct nova_fp_strong));
+	} else {
+		d->blocks = mmap(NULL, d->num_blocks * UDEDUP_BLOCK_SIZE,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				-1, 0);
+		if (d->blocks == MAP_FAILED)
+			d->blocks = NULL;
+	}
+	if (!d->weak_hash_table || !d->strong_hash_table || !d->free_list ||
+	    !d->non_fin || !d->blocknr_to_entry ||
+	    (!d->blocks && !d->block_fps)) {
+		errno = ENOMEM;
+		goto err;
+	}
+
+	/* hand out entries in ascending order */
+	for (i = 0; i < num_entries; i++)
+		d->free_list[i] = num_entries - 1 - i;
+	d->nr_free = num_entries;
+	for (i = 0; i < d->num_blocks; i++)
+		d->blocknr_to_entry[i] = -1;
+
+	return 0;
+
+err:
+	i = errno;
+	udedup_close(d);
+	return -i;
+}
+
+static void udedup_free_hlists(struct udedup_hentry **table, unsigned long sz)
+{
+	struct udedup_hentry *hentry, *next;
+	unsigned long i;
+
+	for (i = 0; i < sz; i++) {
+		for (hentry = table[i]; hentry; hentry = next) {
+			next = hentry->next;
+			free(hentry);
+		}
+	}
+	free(table);
+}
+
+void udedup_close(struct udedup *d)
+{
+	size_t table_size = d->num_entries * sizeof(struct nova_pmm_entry);
+	unsigned long sz = 1UL << d->num_entries_bits;
+
+	if (d->pentries) {
+		msync(d->pentries, table_size, MS_SYNC);
+		munmap(d->pentries, table_size);
+	}
+	if (d->fd >= 0)
+		close(d->fd);
+	if (d->weak_hash_table)
+		udedup_free_hlists(d->weak_hash_table, sz);
+	if (d->strong_hash_table)
+		udedup_free_hlists(d->strong_hash_table, sz);
+	if (d->blocks)
+		munmap(d->blocks, d->num_blocks * UDEDUP_BLOCK_SIZE);
+	free(d->block_fps);
+	free(d->blocknr_to_entry);
+	free(d->free_list);
+	free(d->non_fin);
+	memset(d, 0, sizeof(*d));
+	d->fd = -1;
+}
@@ -0,0 +1,136 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Userspace model of the NV-Dedup engine for trace replay
+ *
+ * The engine follows dedup.c and entry.c: the same fingerprints (crc32 weak,
+ * md5 strong), the same PM entry layout, bucket indexing and the sampling
+ * mode selector. The PM entry table is a file mapped with MAP_SHARED, and
+ * data blocks are only kept as far as the strong fingerprint of a stored
+ * block has to be recalculated. Keep it in sync with dedup.c when the
+ * write path changes.
+ *
+ * It is a separate single-threaded copy, not the kernel code. Kernel
+ * behaviours it leaves out are listed in UDEDUP_UNMODELED below, and replay
+ * numbers do not cover their costs or benefits.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __UDEDUP_H
+#define __UDEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../entry.h"
+
+#define UDEDUP_BLOCK_SIZE	4096
+#define UDEDUP_STRIPE_SIZE	512	/* NOVA_STRIPE_SIZE */
+#define UDEDUP_ZERO_BLOCKNR	1	/* shared all-zero block */
+
+/* Every NOVA_DEDUP_FEAT_* bit is either modelled or listed as left out */
+#define UDEDUP_MODELED \
+	(NOVA_DEDUP_FEAT_ZERO_BLOCK | NOVA_DEDUP_FEAT_CSUM_WEAK_FP)
+#define UDEDUP_UNMODELED \
+	(NOVA_DEDUP_FEAT_HOT_REFCOUNT | NOVA_DEDUP_FEAT_BATCHED_FLUSH | \
+	 NOVA_DEDUP_FEAT_NUMA_SHARDS | NOVA_DEDUP_FEAT_BATCHED_UNINDEX)
+
+_Static_assert((UDEDUP_MODELED | UDEDUP_UNMODELED) == NOVA_DEDUP_FEATURES &&
+	       !(UDEDUP_MODELED & UDEDUP_UNMODELED),
+	       "dedup engine changed: update replay/udedup.c and README.md");
+
+/* mirrors nova.h */
+#define SAMPLE_BLOCK 64
+#define NON_FIN_THRESH (unsigned int)((SAMPLE_BLOCK) * 0.25)
+#define STR_FIN_THRESH (unsigned int)((SAMPLE_BLOCK) * 0.65)
+
+#define NON_FIN 0x00000001
+#define WEAK_STR_FIN 0x00000002
+#define STR_FIN 0x00000004
+
+/* mirrors the dedup timing categories in stats.h */
+enum udedup_stage {
+	udedup_weak_fp = 0,
+	udedup_strong_fp,
+	udedup_hash_table,
+	udedup_upsert_entry,
+	UDEDUP_NR_STAGES
+};
+
+enum udedup_mode_id {
+	udedup_mode_non_fin = 0,
+	udedup_mode_weak_str_fin,
+	udedup_mode_str_fin,
+	UDEDUP_NR_MODES
+};
+
+/*
+ * One block of the trace. Content traces pass the data, hash traces pass
+ * the fingerprints instead and leave data NULL.
+ */
+struct udedup_chunk {
+	const void *data;
+	struct nova_fp_weak fp_weak;
+	struct nova_fp_strong fp_strong;
+};
+
+struct udedup_hentry {
+	struct udedup_hentry *next;
+	entrynr_t entrynr;
+};
+
+struct udedup_stats {
+	uint64_t blocks;		/* logical blocks written */
+	uint64_t dup_blocks;		/* blocks that hit an entry */
+	uint64_t zero_blocks;
+	uint64_t new_blocks;		/* physical blocks allocated */
+	uint64_t mode_blocks[UDEDUP_NR_MODES];
+	uint64_t stage_ns[UDEDUP_NR_STAGES];
+	uint64_t stage_calls[UDEDUP_NR_STAGES];
+};
+
+struct udedup {
+	int fd;
+	struct nova_pmm_entry *pentries;	/* mmap'd entry table */
+	unsigned long num_entries;
+	unsigned int num_entries_bits;
+	struct udedup_hentry **weak_hash_table;
+	struct udedup_hentry **strong_hash_table;
+
+	entrynr_t *free_list;			/* free entries, LIFO */
+	unsigned long nr_free;
+	entrynr_t *non_fin;			/* NON_FIN entries to finish */
+	unsigned long nr_non_fin;
+
+	unsigned long num_blocks;
+	unsigned long next_blocknr;
+	entrynr_t *blocknr_to_entry;
+	char *blocks;				/* data, content traces */
+	struct nova_fp_strong *block_fps;	/* fingerprints, hash traces */
+
+	uint32_t cur_block;
+	uint32_t dup_block;
+	uint32_t dedup_mode;
+	uint32_t fixed_mode;			/* 0 for the adaptive selector */
+	unsigned int seed;
+
+	struct udedup_stats stats;
+};
+
+void udedup_fp_weak_calc(const void *addr, struct nova_fp_weak *fp);
+void udedup_fp_weak_csum_calc(const void *addr, struct nova_fp_weak *fp);
+void udedup_fp_strong_calc(const void *addr, struct nova_fp_strong *fp);
+void udedup_hash_fp_weak(const struct nova_fp_strong *strong,
+	struct nova_fp_weak *weak);
+
+int udedup_open(struct udedup *d, const char *table_path,
+	unsigned long num_entries, bool hash_trace);
+void udedup_close(struct udedup *d);
+int udedup_new_write(struct udedup *d, const struct udedup_chunk *chunk,
+	unsigned long *blocknr);
+void udedup_calc_non_fin(struct udedup *d);
+
+#endif /* __UDEDUP_H */
@@ -18,10 +18,25 @@
  * warranty of any kind, whether express or implied.
  */
 
+#include <linux/kthread.h>
 #include "nova.h"
 #include "inode.h"
 #include "super.h"
 
+/*
+ * Snapshot lists are per-CPU, so deleted snapshots are cleaned by one
+ * thread per list. Each cleaning round is started by a snapshot deletion
+ * and covers sbi->curr_clean_snapshot_info, which is only read and changed
+ * under s_lock.
+ */
+struct nova_snapshot_cleaner {
+	struct super_block *sb;
+	struct task_struct *thread;
+	int list;			/* Index of the list it cleans */
+	unsigned long round;		/* Last round it ran */
+	struct nova_free_batch batch;	/* Blocks released by the round */
+};
+
 static inline u64 next_list_page(u64 curr_p)
 {
 	void *curr_addr = (void *)curr_p;
@@ -88,13 +103,223 @@ static int nova_insert_snapshot_info(struct super_block *sb,
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	int ret;
 
+	spin_lock(&sbi->snapshot_space_lock);
 	ret = radix_tree_insert(&sbi->snapshot_info_tree, info->epoch_id, info);
+	spin_unlock(&sbi->snapshot_space_lock);
 	if (ret)
 		nova_dbg("%s ERROR %d\n", __func__, ret);
 
 	return ret;
 }
 
+/*
+ * Snapshot space accounting
+ *
+ * Every snapshot counts the blocks its lists keep alive (held) and those of
+ * them no file or other snapshot references (exclusive). The exclusive
+ * blocks are tracked in sbi->snapshot_blocks, which maps a block to the
+ * epoch of the snapshot that took it, with bit 0 set while it is exclusive.
+ * A deleted snapshot hands its blocks to the next one, which is the first
+ * snapshot at or after the recorded epoch, so the map needs no update then.
+ * The dedup write path and the reference drops of files flip the bit.
+ *
+ * A block taken by several snapshots is charged to the last of them, and
+ * refcounts of hot dedup entries lag behind, so the numbers are estimates.
+ */
+#define NOVA_SPACE_EXCL		1UL
+
+/* Space lock held */
+static struct snapshot_info *nova_snapshot_space_owner(struct super_block *sb,
+	void *entry)
+{
+	struct snapshot_info *info = NULL;
+
+	nova_find_target_snapshot_info(sb, xa_to_value(entry) >> 1, &info);
+	return info;
+}
+
+static void nova_snapshot_space_charge(struct super_block *sb,
+	struct snapshot_info *info, unsigned long blocknr, unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct snapshot_info *owner;
+	unsigned long i, excl;
+	void *old;
+
+	spin_lock(&sbi->snapshot_space_lock);
+	info->held_blocks += num;
+	for (i = blocknr; i < blocknr + num; i++) {
+		if (nova_dedup_is_zero_block(sb, i))
+			continue;
+
+		/* The snapshot took over the reference of the file */
+		excl = nova_dedup_block_refs(sb, i) <= 1 ? NOVA_SPACE_EXCL : 0;
+		old = xa_load(&sbi->snapshot_blocks, i);
+		if (old) {
+			/* Taken by another snapshot before */
+			owner = nova_snapshot_space_owner(sb, old);
+			if (owner && (xa_to_value(old) & NOVA_SPACE_EXCL))
+				owner->exclusive_blocks--;
+			excl = 0;
+		}
+		if (xa_err(xa_store(&sbi->snapshot_blocks, i,
+				xa_mk_value(info->epoch_id << 1 | excl),
+				GFP_ATOMIC)))
+			continue;
+		if (excl)
+			info->exclusive_blocks++;
+	}
+	spin_unlock(&sbi->snapshot_space_lock);
+}
+
+/* The blocks leave @info, which may already be out of the snapshot tree */
+static void nova_snapshot_space_release(struct super_block *sb,
+	struct snapshot_info *info, unsigned long blocknr, unsigned long num)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	unsigned long i;
+	void *entry;
+
+	spin_lock(&sbi->snapshot_space_lock);
+	info->held_blocks -= min(info->held_blocks, num);
+	for (i = blocknr; i < blocknr + num; i++) {
+		entry = xa_load(&sbi->snapshot_blocks, i);
+		/* Taken again by a later snapshot */
+		if (!entry || (xa_to_value(entry) >> 1) > info->epoch_id)
+			continue;
+		if ((xa_to_value(entry) & NOVA_SPACE_EXCL) &&
+		    info->exclusive_blocks)
+			info->exclusive_blocks--;
+		xa_erase(&sbi->snapshot_blocks, i);
+	}
+	spin_unlock(&sbi->snapshot_space_lock);
+}
+
+static void nova_snapshot_space_mark(struct super_block *sb,
+	unsigned long blocknr, bool exclusive)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct snapshot_info *owner;
+	unsigned long val;
+	void *entry;
+
+	if (xa_empty(&sbi->snapshot_blocks))
+		return;
+
+	spin_lock(&sbi->snapshot_space_lock);
+	entry = xa_load(&sbi->snapshot_blocks, blocknr);
+	if (!entry || !!(xa_to_value(entry) & NOVA_SPACE_EXCL) == exclusive)
+		goto out;
+
+	val = xa_to_value(entry) ^ NOVA_SPACE_EXCL;
+	xa_store(&sbi->snapshot_blocks, blocknr, xa_mk_value(val), GFP_ATOMIC);
+	owner = nova_snapshot_space_owner(sb, entry);
+	if (!owner)
+		goto out;
+	if (exclusive)
+		owner->exclusive_blocks++;
+	else if (owner->exclusive_blocks)
+		owner->exclusive_blocks--;
+out:
+	spin_unlock(&sbi->snapshot_space_lock);
+}
+
+/* A write deduplicated against @blocknr */
+void nova_snapshot_space_share(struct super_block *sb, unsigned long blocknr)
+{
+	nova_snapshot_space_mark(sb, blocknr, false);
+}
+
+/* A reference to @blocknr was dropped and one is left */
+void nova_snapshot_space_unshare(struct super_block *sb, unsigned long blocknr)
+{
+	nova_snapshot_space_mark(sb, blocknr, true);
+}
+
+/*
+ * Fill @space for the first snapshot at or after space->epoch_id, so
+ * callers walk all snapshots by passing the last epoch ID plus one.
+ */
+int nova_snapshot_space_query(struct super_block *sb,
+	struct nova_snapshot_space *space)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct snapshot_info *info = NULL;
+	int ret = -ENOENT;
+
+	spin_lock(&sbi->snapshot_space_lock);
+	if (nova_find_target_snapshot_info(sb, space->epoch_id, &info)) {
+		space->epoch_id = info->epoch_id;
+		space->held_blocks = info->held_blocks;
+		space->exclusive_blocks = info->exclusive_blocks;
+		ret = 0;
+	}
+	spin_unlock(&sbi->snapshot_space_lock);
+
+	return ret;
+}
+
+static void nova_snapshot_space_charge_list(struct super_block *sb,
+	struct snapshot_info *info, struct snapshot_list *list)
+{
+	struct snapshot_file_write_entry *w_entry;
+	u64 curr_p = list->head;
+	u8 type;
+
+	if (curr_p == 0)
+		return;
+
+	while (curr_p != list->tail) {
+		if (goto_next_list_page(sb, curr_p)) {
+			curr_p = next_list_page(curr_p);
+			if (curr_p == list->tail || curr_p == 0)
+				break;
+		}
+
+		type = nova_get_entry_type((void *)curr_p);
+		if (type == SS_INODE) {
+			curr_p += sizeof(struct snapshot_inode_entry);
+			continue;
+		}
+
+		w_entry = (struct snapshot_file_write_entry *)curr_p;
+		if (type == SS_FILE_WRITE && w_entry->deleted == 0)
+			nova_snapshot_space_charge(sb, info, w_entry->nvmm,
+						w_entry->num_pages);
+		curr_p += sizeof(struct snapshot_file_write_entry);
+	}
+}
+
+/*
+ * The accounting lives in DRAM. Rebuild it from the restored snapshot lists
+ * once recovery has rebuilt the dedup refcounts.
+ */
+void nova_snapshot_space_init(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct snapshot_info *infos[FREE_BATCH];
+	struct snapshot_list *list;
+	int nr_infos;
+	u64 epoch_id = 0;
+	int i, j;
+
+	do {
+		nr_infos = radix_tree_gang_lookup(&sbi->snapshot_info_tree,
+					(void **)infos, epoch_id, FREE_BATCH);
+		for (i = 0; i < nr_infos; i++) {
+			epoch_id = infos[i]->epoch_id;
+			for (j = 0; j < sbi->cpus; j++) {
+				list = &infos[i]->lists[j];
+				mutex_lock(&list->list_mutex);
+				nova_snapshot_space_charge_list(sb, infos[i],
+								list);
+				mutex_unlock(&list->list_mutex);
+			}
+		}
+		epoch_id++;
+	} while (nr_infos == FREE_BATCH);
+}
+
 /* Reuse the inode log page structure */
 static inline void nova_set_link_page_epoch_id(struct super_block *sb,
 	struct nova_inode_log_page *curr_page, u64 epoch_id)
@@ -110,7 +335,7 @@ static inline void nova_set_next_link_page_address(struct super_block *sb,
 }
 
 static int nova_delete_snapshot_list_entries(struct super_block *sb,
-	struct snapshot_list *list)
+	struct snapshot_info *info, struct snapshot_list *list)
 {
 	struct snapshot_file_write_entry *w_entry = NULL;
 	struct snapshot_inode_entry *i_entry = NULL;
@@ -148,14 +373,17 @@ static int nova_delete_snapshot_list_entries(struct super_block *sb,
 		case SS_INODE:
 			i_entry = (struct snapshot_inode_entry *)addr;
 			if (i_entry->deleted == 0)
-				nova_delete_dead_inode(sb, i_entry->nova_ino);
+				nova_delete_dead_inode(sb, i_entry->nova_ino, 0);
 			curr_p += sizeof(struct snapshot_inode_entry);
 			continue;
 		case SS_FILE_WRITE:
 			w_entry = (struct snapshot_file_write_entry *)addr;
-			if (w_entry->deleted == 0)
+			if (w_entry->deleted == 0) {
+				nova_snapshot_space_release(sb, info,
+					w_entry->nvmm, w_entry->num_pages);
 				nova_free_data_blocks(sb, &sih, w_entry->nvmm,
 							w_entry->num_pages);
+			}
 			curr_p += sizeof(struct snapshot_file_write_entry);
 			continue;
 		default:
@@ -174,19 +402,23 @@ static inline int nova_background_clean_inode_entry(struct super_block *sb,
 	struct snapshot_inode_entry *i_entry, u64 epoch_id)
 {
 	if (i_entry->deleted == 0 && i_entry->delete_epoch_id <= epoch_id) {
-		nova_delete_dead_inode(sb, i_entry->nova_ino);
+		nova_delete_dead_inode(sb, i_entry->nova_ino, 0);
 		i_entry->deleted = 1;
 	}
 
 	return 0;
 }
 
+/* Drops the dedup references of the blocks, frees the last ones in @batch */
 static inline int nova_background_clean_write_entry(struct super_block *sb,
 	struct snapshot_file_write_entry *w_entry,
-	struct nova_inode_info_header *sih, u64 epoch_id)
+	struct nova_free_batch *batch, struct snapshot_info *info)
 {
-	if (w_entry->deleted == 0 && w_entry->delete_epoch_id <= epoch_id) {
-		nova_free_data_blocks(sb, sih, w_entry->nvmm,
+	if (w_entry->deleted == 0 &&
+	    w_entry->delete_epoch_id <= info->epoch_id) {
+		nova_snapshot_space_release(sb, info, w_entry->nvmm,
+					w_entry->num_pages);
+		nova_free_batch_add(sb, batch, w_entry->nvmm,
 					w_entry->num_pages);
 		w_entry->deleted = 1;
 	}
@@ -195,18 +427,15 @@ static inline int nova_background_clean_write_entry(struct super_block *sb,
 }
 
 static int nova_background_clean_snapshot_list(struct super_block *sb,
-	struct snapshot_list *list, u64 epoch_id)
+	struct snapshot_info *info, struct snapshot_list *list,
+	struct nova_free_batch *batch)
 {
 	struct nova_inode_log_page *curr_page;
-	struct nova_inode_info_header sih;
+	u64 epoch_id = info->epoch_id;
 	void *addr;
 	u64 curr_p;
 	u8 type;
 
-	sih.ino = NOVA_SNAPSHOT_INO;
-	sih.i_blk_type = NOVA_DEFAULT_BLOCK_TYPE;
-	sih.log_head = sih.log_tail = 0;
-
 	curr_p = list->head;
 	nova_dbg_verbose("Snapshot list head 0x%llx, tail 0x%lx\n",
 				curr_p, list->tail);
@@ -239,8 +468,8 @@ static int nova_background_clean_snapshot_list(struct super_block *sb,
 			curr_p += sizeof(struct snapshot_inode_entry);
 			continue;
 		case SS_FILE_WRITE:
-			nova_background_clean_write_entry(sb, addr, &sih,
-								epoch_id);
+			nova_background_clean_write_entry(sb, addr, batch,
+								info);
 			curr_p += sizeof(struct snapshot_file_write_entry);
 			continue;
 		default:
@@ -278,10 +507,11 @@ static int nova_delete_snapshot_list_pages(struct super_block *sb,
 }
 
 static int nova_delete_snapshot_list(struct super_block *sb,
-	struct snapshot_list *list, int delete_entries)
+	struct snapshot_info *info, struct snapshot_list *list,
+	int delete_entries)
 {
 	if (delete_entries)
-		nova_delete_snapshot_list_entries(sb, list);
+		nova_delete_snapshot_list_entries(sb, info, list);
 	nova_delete_snapshot_list_pages(sb, list);
 	return 0;
 }
@@ -296,7 +526,7 @@ static int nova_delete_snapshot_info(struct super_block *sb,
 	for (i = 0; i < sbi->cpus; i++) {
 		list = &info->lists[i];
 		mutex_lock(&list->list_mutex);
-		nova_delete_snapshot_list(sb, list, delete_entries);
+		nova_delete_snapshot_list(sb, info, list, delete_entries);
 		mutex_unlock(&list->list_mutex);
 	}
 
@@ -363,6 +593,8 @@ static int nova_initialize_snapshot_info(struct super_block *sb,
 		list = &info->lists[i];
 		mutex_init(&list->list_mutex);
 	}
+	info->held_blocks = 0;
+	info->exclusive_blocks = 0;
 
 	if (init_pages) {
 		ret = nova_initialize_snapshot_info_pages(sb, info, epoch_id);
@@ -517,6 +749,8 @@ static int nova_append_snapshot_file_write_entry(struct super_block *sb,
 
 	ret = nova_append_snapshot_list_entry(sb, info, &entry,
 			sizeof(struct snapshot_file_write_entry));
+	if (ret == 0)
+		nova_snapshot_space_charge(sb, info, nvmm, num_pages);
 
 	NOVA_END_TIMING(append_snapshot_file_t, append_time);
 	return ret;
@@ -975,12 +1209,11 @@ out:
 	return ret;
 }
 
+/* s_lock held */
 static void wakeup_snapshot_cleaner(struct nova_sb_info *sbi)
 {
-	if (!waitqueue_active(&sbi->snapshot_cleaner_wait))
-		return;
-
-	nova_dbg("Wakeup snapshot cleaner thread\n");
+	WRITE_ONCE(sbi->snapshot_clean_round, sbi->snapshot_clean_round + 1);
+	nova_dbg("Wakeup snapshot cleaner threads\n");
 	wake_up_interruptible(&sbi->snapshot_cleaner_wait);
 }
 
@@ -1069,9 +1302,19 @@ int nova_delete_snapshot(struct super_block *sb, u64 epoch_id)
 	} else {
 		/* Delete the last snapshot. Find the previous one. */
 		delete = 1;
+		/* Cleaners skip it from now on */
+		if (sbi->curr_clean_snapshot_info == info)
+			sbi->curr_clean_snapshot_info = NULL;
 	}
 
+	spin_lock(&sbi->snapshot_space_lock);
+	/* The next snapshot holds the blocks now */
+	if (next) {
+		next->held_blocks += info->held_blocks;
+		next->exclusive_blocks += info->exclusive_blocks;
+	}
 	radix_tree_delete(&sbi->snapshot_info_tree, epoch_id);
+	spin_unlock(&sbi->snapshot_space_lock);
 
 	nova_invalidate_snapshot_entry(sb, info);
 
@@ -1290,12 +1533,15 @@ static int nova_traverse_and_delete_snapshot_infos(struct super_block *sb,
 			if (save)
 				nova_save_snapshot_info(sb, info);
 			nova_delete_snapshot_info(sb, info, 0);
+			spin_lock(&sbi->snapshot_space_lock);
 			radix_tree_delete(&sbi->snapshot_info_tree, epoch_id);
+			spin_unlock(&sbi->snapshot_space_lock);
 			nova_free_snapshot_info(info);
 		}
 		epoch_id++;
 	} while (nr_infos == FREE_BATCH);
 
+	xa_destroy(&sbi->snapshot_blocks);
 	return 0;
 }
 
@@ -1303,8 +1549,7 @@ int nova_save_snapshots(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 
-	if (sbi->snapshot_cleaner_thread)
-		kthread_stop(sbi->snapshot_cleaner_thread);
+	nova_snapshot_cleaner_stop(sb);
 
 	if (sbi->mount_snapshot)
 		return 0;
@@ -1317,74 +1562,110 @@ int nova_destroy_snapshot_infos(struct super_block *sb)
 	return nova_traverse_and_delete_snapshot_infos(sb, 0);
 }
 
-static void snapshot_cleaner_try_sleeping(struct nova_sb_info *sbi)
+static int nova_clean_snapshot(struct nova_snapshot_cleaner *cleaner)
 {
-	DEFINE_WAIT(wait);
-
-	prepare_to_wait(&sbi->snapshot_cleaner_wait, &wait, TASK_INTERRUPTIBLE);
-	schedule();
-	finish_wait(&sbi->snapshot_cleaner_wait, &wait);
-}
-
-static int nova_clean_snapshot(struct nova_sb_info *sbi)
-{
-	struct super_block *sb = sbi->sb;
+	struct super_block *sb = cleaner->sb;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct snapshot_info *info;
-	struct snapshot_list *list;
-	int i;
+	struct snapshot_list *list = NULL;
 
-	if (!sbi->curr_clean_snapshot_info)
-		return 0;
+	cleaner->round = READ_ONCE(sbi->snapshot_clean_round);
 
+	/*
+	 * Lock the list before dropping s_lock: deleting the snapshot takes
+	 * every list mutex before the info is freed.
+	 */
+	mutex_lock(&sbi->s_lock);
 	info = sbi->curr_clean_snapshot_info;
-
-	for (i = 0; i < sbi->cpus; i++) {
-		list = &info->lists[i];
-
+	if (info) {
+		list = &info->lists[cleaner->list];
 		mutex_lock(&list->list_mutex);
-		nova_background_clean_snapshot_list(sb, list,
-							info->epoch_id);
-		mutex_unlock(&list->list_mutex);
 	}
+	mutex_unlock(&sbi->s_lock);
+
+	if (!list)
+		return 0;
+
+	nova_background_clean_snapshot_list(sb, info, list, &cleaner->batch);
+	nova_free_batch_flush(sb, &cleaner->batch);
+	mutex_unlock(&list->list_mutex);
 
-	sbi->curr_clean_snapshot_info = NULL;
+	NOVA_STATS_ADD(snapshot_clean_rounds, 1);
 	return 0;
 }
 
 static int nova_snapshot_cleaner(void *arg)
 {
-	struct nova_sb_info *sbi = arg;
+	struct nova_snapshot_cleaner *cleaner = arg;
+	struct nova_sb_info *sbi = NOVA_SB(cleaner->sb);
 
-	nova_dbg("Running snapshot cleaner thread\n");
+	nova_dbg("Running snapshot cleaner thread %d\n", cleaner->list);
 	for (;;) {
-		snapshot_cleaner_try_sleeping(sbi);
+		wait_event_interruptible(sbi->snapshot_cleaner_wait,
+			READ_ONCE(sbi->snapshot_clean_round) != cleaner->round ||
+			kthread_should_stop());
+
+		/* A pending round is finished before stopping */
+		if (READ_ONCE(sbi->snapshot_clean_round) != cleaner->round)
+			nova_clean_snapshot(cleaner);
 
 		if (kthread_should_stop())
 			break;
-
-		nova_clean_snapshot(sbi);
 	}
 
-	if (sbi->curr_clean_snapshot_info)
-		nova_clean_snapshot(sbi);
-
 	return 0;
 }
 
+void nova_snapshot_cleaner_stop(struct super_block *sb)
+{
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	int i;
+
+	if (!sbi->snapshot_cleaners)
+		return;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		if (sbi->snapshot_cleaners[i].thread)
+			kthread_stop(sbi->snapshot_cleaners[i].thread);
+	}
+
+	kfree(sbi->snapshot_cleaners);
+	sbi->snapshot_cleaners = NULL;
+}
+
 static int nova_snapshot_cleaner_init(struct nova_sb_info *sbi)
 {
-	int ret = 0;
+	struct nova_snapshot_cleaner *cleaner;
+	int i;
 
 	init_waitqueue_head(&sbi->snapshot_cleaner_wait);
+	sbi->snapshot_clean_round = 0;
 
-	sbi->snapshot_cleaner_thread = kthread_run(nova_snapshot_cleaner,
-		sbi, "nova_snapshot_cleaner");
-	if (IS_ERR(sbi->snapshot_cleaner_thread)) {
-		nova_info("Failed to start NOVA snapshot cleaner thread\n");
-		ret = -1;
+	sbi->snapshot_cleaners = kcalloc(sbi->cpus,
+			sizeof(struct nova_snapshot_cleaner), GFP_KERNEL);
+	if (!sbi->snapshot_cleaners)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->cpus; i++) {
+		cleaner = &sbi->snapshot_cleaners[i];
+		cleaner->sb = sbi->sb;
+		cleaner->list = i;
+		cleaner->thread = kthread_create_on_node(nova_snapshot_cleaner,
+				cleaner, cpu_to_node(i),
+				"nova_snapshot_cleaner/%d", i);
+		if (IS_ERR(cleaner->thread)) {
+			cleaner->thread = NULL;
+			nova_info("Failed to start NOVA snapshot cleaner thread\n");
+			nova_snapshot_cleaner_stop(sbi->sb);
+			return -1;
+		}
+		if (cpu_online(i))
+			kthread_bind(cleaner->thread, i);
+		wake_up_process(cleaner->thread);
 	}
-	nova_info("Start NOVA snapshot cleaner thread.\n");
-	return ret;
+
+	nova_info("Start %d NOVA snapshot cleaner threads.\n", sbi->cpus);
+	return 0;
 }
 
 int nova_snapshot_init(struct super_block *sb)
@@ -1402,6 +1683,8 @@ int nova_snapshot_init(struct super_block *sb)
 	sih->i_blk_type = NOVA_DEFAULT_BLOCK_TYPE;
 
 	INIT_RADIX_TREE(&sbi->snapshot_info_tree, GFP_ATOMIC);
+	spin_lock_init(&sbi->snapshot_space_lock);
+	xa_init(&sbi->snapshot_blocks);
 	init_waitqueue_head(&sbi->snapshot_mmap_wait);
 	ret = nova_snapshot_cleaner_init(sbi);
 
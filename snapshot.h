@@ -42,6 +42,10 @@ struct snapshot_info {
 				       */
 
 	struct snapshot_list *lists;	/* Per-CPU snapshot list */
+
+	/* Space accounting, under sbi->snapshot_space_lock */
+	unsigned long held_blocks;	/* Blocks kept alive by the lists */
+	unsigned long exclusive_blocks;	/* Of those, referenced only here */
 };
 
 
@@ -183,6 +183,7 @@ enum stats_category {
 	cow_write_breaks,
 	inplace_write_breaks,
 	read_bytes,
+	read_segs,
 	cow_write_bytes,
 	inplace_write_bytes,
 	fast_checked_pages,
@@ -192,13 +193,42 @@ enum stats_category {
 	dirty_pages,
 	protect_head,
 	protect_tail,
+	protect_dedup_skip,
 	block_csum_parity,
 	dax_cow_during_snapshot,
 	mapping_updated_pages,
 	cow_overlap_mmap,
 	dax_new_blocks,
+	dax_cow_shared,
 	inplace_new_blocks,
+	inplace_cow_shared,
 	fdatasync,
+	dedup_zero_pages,
+	dedup_refcount_deferred,
+	dedup_refcount_folds,
+	dedup_entry_fences,
+	dedup_remote_probes,
+	dedup_remote_entry_updates,
+	dedup_free_shared,
+	dedup_free_unindexed,
+	dedup_claimed,
+	write_entry_batches,
+	write_entries_batched,
+	reclaim_deferred,
+	reclaim_freed,
+	reclaim_queue_full,
+	read_cache_hits,
+	read_cache_misses,
+	read_cache_fills,
+	read_cache_evictions,
+	read_cache_invalidations,
+	log_gc_deferred,
+	log_gc_inline,
+	log_gc_background,
+	free_batch_flushes,
+	free_batch_ranges,
+	snapshot_clean_rounds,
+	inode_map_steals,
 
 	/* Sentinel */
 	STATS_NUM,
@@ -52,6 +52,9 @@ int data_csum;
 int data_parity;
 int dram_struct_csum;
 int support_clwb;
+unsigned int dedup_scrub_mbps;
+unsigned int read_cache_min_refs = 4;
+unsigned int log_gc_defer_pages = 1024;
 
 module_param(measure_timing, int, 0444);
 MODULE_PARM_DESC(measure_timing, "Timing measurement");
@@ -71,6 +74,15 @@ MODULE_PARM_DESC(data_parity, "Protect file data using RAID-5 style parity.");
 module_param(dram_struct_csum, int, 0444);
 MODULE_PARM_DESC(dram_struct_csum, "Protect key DRAM data structures with checksums");
 
+module_param(dedup_scrub_mbps, uint, 0444);
+MODULE_PARM_DESC(dedup_scrub_mbps, "Bandwidth budget in MB/s of the dedup scrubber, 0 to park it");
+
+module_param(read_cache_min_refs, uint, 0644);
+MODULE_PARM_DESC(read_cache_min_refs, "Blocks with more dedup references than this are kept in the read cache");
+
+module_param(log_gc_defer_pages, uint, 0444);
+MODULE_PARM_DESC(log_gc_defer_pages, "Log pages an inode may grow by before it is collected inline, 0 to disable background log GC");
+
 module_param(nova_dbgmask, int, 0444);
 MODULE_PARM_DESC(nova_dbgmask, "Control debugging output");
 
@@ -185,7 +197,7 @@ enum {
 	Opt_bpi, Opt_init, Opt_snapshot, Opt_mode, Opt_uid,
 	Opt_gid, Opt_dax, Opt_data_cow, Opt_wprotect,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
-	Opt_dbgmask, Opt_err
+	Opt_dbgmask, Opt_read_cache, Opt_err
 };
 
 static const match_table_t tokens = {
@@ -202,6 +214,7 @@ static const match_table_t tokens = {
 	{ Opt_err_panic,     "errors=panic"	  },
 	{ Opt_err_ro,	     "errors=remount-ro"  },
 	{ Opt_dbgmask,	     "dbgmask=%u"	  },
+	{ Opt_read_cache,    "read_cache=%u"	  },
 	{ Opt_err,	     NULL		  },
 };
 
@@ -293,6 +306,13 @@ static int nova_parse_options(char *options, struct nova_sb_info *sbi,
 				goto bad_val;
 			nova_dbgmask = option;
 			break;
+		case Opt_read_cache:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			if (remount && sbi->read_cache_mb != option)
+				goto bad_opt;
+			sbi->read_cache_mb = option;
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -390,23 +410,35 @@ static inline void nova_update_mount_time(struct super_block *sb)
 	nova_sync_super(sb);
 }
 
-static struct nova_inode *nova_init(struct super_block *sb,
-				      unsigned long size)
+/*
+ * Lay out the dedup entry table, the zero block and the reclaim queue behind
+ * the reserved head and set up the DRAM index. Runs on every mount: the
+ * layout is derived from sbi->num_blocks and the format features only, so a
+ * remount finds the table where format put it.
+ */
+static int nova_dedup_setup(struct super_block *sb)
 {
-	unsigned long blocksize;
-	struct nova_inode *root_i, *pi;
-	struct nova_super_block *super;
 	struct nova_sb_info *sbi = NOVA_SB(sb);
-	struct nova_inode_update update;
-	u64 epoch_id;
 	int retval;
 	size_t sz;
 	unsigned long i = 0;
-	INIT_TIMING(init_time);
 
-	NOVA_START_TIMING(new_init_t, init_time);
-	nova_info("creating an empty nova of size %lu\n", size);
-	sbi->num_blocks = ((unsigned long)(size) >> PAGE_SHIFT);
+	/* Set up on every mount, not only at format */
+	if( nova_fp_strong_ctx_init(&sbi->nova_fp_strong_ctx) < 0 ) {
+		nova_warn("strong fp init failed");
+	}
+
+	if( nova_fp_weak_ctx_init(&sbi->nova_fp_weak_ctx) < 0 ) {
+		nova_warn("weak fp init failed");
+	}
+
+	if( nova_fp_strong_ctx_init(&sbi->nova_non_fin_calc_str_ctx) < 0 ) {
+		nova_warn("non_fin_calc_str fp init failed");
+	}
+
+	if( nova_fp_weak_ctx_init(&sbi->nova_non_fin_calc_weak_ctx) < 0 ) {
+		nova_warn("non_fin_calc_weak fp init failed");
+	}
 
 	/*
 	* Author:Hsiao
@@ -416,6 +448,21 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	sbi->num_entries_blocks = ( ( sbi->num_blocks * sizeof(struct nova_pmm_entry) ) >> PAGE_SHIFT ) + 1 ;
 	sbi->head_reserved_blocks += sbi->num_entries_blocks;
 
+	/*
+	 * One zeroed block after the entry table backs every all-zero page.
+	 * The reserved head region is cleared at format, so it stays zero.
+	 */
+	sbi->zero_blocknr = sbi->head_reserved_blocks;
+	sbi->head_reserved_blocks += 1;
+
+	/* Images formatted before the reclaim queue keep data there */
+	if (le32_to_cpu(sbi->nova_sb->s_features) & NOVA_FEATURE_RECLAIM_QUEUE) {
+		sbi->reclaim_start = sbi->head_reserved_blocks;
+		sbi->head_reserved_blocks += NOVA_RECLAIM_QUEUE_BLOCKS;
+	} else {
+		sbi->reclaim_start = 0;
+	}
+
 	// nova_dbg("sbi->num_blocks:%lu metadata_start:%lu num_entries_block:%lu head_reserved_blocks:%lu",sbi->num_blocks, sbi->metadata_start, sbi->num_entries_blocks, sbi->head_reserved_blocks);
 
 	/**
@@ -424,12 +471,9 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	sbi->num_entries = ( sbi->num_entries_blocks << PAGE_SHIFT ) / sizeof(struct nova_pmm_entry) ;
 	sbi->num_entries_bits = 32 - __builtin_clz(sbi->num_entries);
 	sz = 1 << sbi->num_entries_bits;
-	for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
-		spin_lock_init(sbi->weak_hash_table_locks + i);
-	sbi->weak_hash_table = vzalloc(sizeof(struct hlist_head) * sz);
-	for (i = 0; i < HASH_TABLE_LOCK_NUM; ++i)
-		spin_lock_init(sbi->strong_hash_table_locks + i);
-	sbi->strong_hash_table = vzalloc(sizeof(struct hlist_head) * sz);
+	retval = nova_dedup_init_shards(sb, sz);
+	if(retval < 0)
+		return retval;
 	sbi->blocknr_to_entry = vzalloc(sizeof(u64) * sz);
 	for (i = 0; i < sz; i++)
 		sbi->blocknr_to_entry[i] = -1;
@@ -440,28 +484,54 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	nova_info("sbi->dup_block : %u sbi->dedup_mode: %u SAMPLE_BLOCK: %u NON_FIN: %u STR_FIN:%u", sbi->dup_block, NON_FIN, SAMPLE_BLOCK, NON_FIN_THRESH, STR_FIN_THRESH);
 	// nova_dbg("sbi->num_entries:%lu sbi->num_entries_bits:%lu",sbi->num_entries,sbi->num_entries_bits);
 
-	for(i = 0; i < sz; ++i) {
-		INIT_HLIST_HEAD(&sbi->weak_hash_table[i]);
-		INIT_HLIST_HEAD(&sbi->strong_hash_table[i]);
-	}
-	
 	/**
 	 * INIT_METADATA_FREELIST
 	 **/
 	retval = nova_init_entry_list(sb);
 	if(retval < 0)
-		return ERR_PTR(retval);
+		return retval;
+
+	retval = nova_entry_refcount_init(sb);
+	if(retval < 0)
+		return retval;
+
+	retval = nova_dedup_free_batch_init(sb);
+	if(retval < 0)
+		return retval;
 
 	retval = nova_calc_non_fin_thread_init(sb);
 	if(retval < 0)
-		return ERR_PTR(retval);
-	
+		return retval;
 
     sbi->nova_hentry_cachep = kmem_cache_create("nova_hentry_cache",
                                                 sizeof(struct nova_hentry),
                                                 0, 0, NULL);
     if(sbi->nova_hentry_cachep == NULL)
-        return ERR_PTR(-ENOMEM);
+        return -ENOMEM;
+
+	return 0;
+}
+
+static struct nova_inode *nova_init(struct super_block *sb,
+				      unsigned long size)
+{
+	unsigned long blocksize;
+	struct nova_inode *root_i, *pi;
+	struct nova_super_block *super;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+	struct nova_inode_update update;
+	u64 epoch_id;
+	int retval;
+	INIT_TIMING(init_time);
+
+	NOVA_START_TIMING(new_init_t, init_time);
+	nova_info("creating an empty nova of size %lu\n", size);
+	sbi->num_blocks = ((unsigned long)(size) >> PAGE_SHIFT);
+	sbi->nova_sb->s_features = cpu_to_le32(NOVA_FEATURE_RECLAIM_QUEUE);
+
+	retval = nova_dedup_setup(sb);
+	if (retval < 0)
+		return ERR_PTR(retval);
 
 	nova_dbgv("nova: Default block size set to 4K\n");
 	sbi->blocksize = blocksize = NOVA_DEF_BLOCK_SIZE_4K;
@@ -516,22 +586,6 @@ static struct nova_inode *nova_init(struct super_block *sb,
 	sbi->nova_sb->s_data_parity = data_parity;
 	nova_update_super_crc(sb);
 
-	if( nova_fp_strong_ctx_init(&sbi->nova_fp_strong_ctx) < 0 ) {
-		nova_warn("strong fp init failed");
-	}
-
-	if( nova_fp_weak_ctx_init(&sbi->nova_fp_weak_ctx) < 0 ) {
-		nova_warn("weak fp init failed");
-	}
-
-	if( nova_fp_strong_ctx_init(&sbi->nova_non_fin_calc_str_ctx) < 0 ) {
-		nova_warn("non_fin_calc_str fp init failed");
-	}
-
-	if( nova_fp_weak_ctx_init(&sbi->nova_non_fin_calc_weak_ctx) < 0 ) {
-		nova_warn("non_fin_calc_weak fp init failed");
-	}
-
 	nova_sync_super(sb);
 
 	root_i = nova_get_inode_by_ino(sb, NOVA_ROOT_INO);
@@ -571,7 +625,6 @@ static inline void set_default_opts(struct nova_sb_info *sbi)
 	sbi->tail_reserved_blocks = TAIL_RESERVED_BLOCKS;
 	sbi->cpus = num_online_cpus();
 	nova_info("%d cpus online\n", sbi->cpus);
-	sbi->map_id = 0;
 	sbi->snapshot_si = NULL;
 }
 
@@ -674,6 +727,8 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 	BUILD_BUG_ON(sizeof(struct nova_super_block) > NOVA_SB_SIZE);
 	BUILD_BUG_ON(sizeof(struct nova_inode) > NOVA_INODE_SIZE);
 	BUILD_BUG_ON(sizeof(struct nova_inode_log_page) != PAGE_SIZE);
+	BUILD_BUG_ON(sizeof(struct nova_file_extent) >
+			sizeof(struct nova_range_node));
 
 	BUILD_BUG_ON(sizeof(struct journal_ptr_pair) > CACHELINE_SIZE);
 	BUILD_BUG_ON(PAGE_SIZE/sizeof(struct nova_lite_journal_entry) <
@@ -812,6 +867,13 @@ static int nova_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	sbi->num_blocks = le64_to_cpu(sbi->nova_sb->s_size) >> PAGE_SHIFT;
+	retval = nova_dedup_setup(sb);
+	if (retval < 0) {
+		nova_err(sb, "Dedup initialization failed\n");
+		goto out;
+	}
+
 	if (nova_lite_journal_soft_init(sb)) {
 		retval = -EINVAL;
 		nova_err(sb, "Lite journal initialization failed\n");
@@ -853,6 +915,34 @@ setup_sb:
 	if ((sbi->s_mount_opt & NOVA_MOUNT_FORMAT) == 0)
 		nova_recovery(sb);
 
+	nova_snapshot_space_init(sb);
+
+	/* Scrub only once recovery has rebuilt the dedup index */
+	retval = nova_dedup_scrub_init(sb);
+	if (retval < 0) {
+		nova_err(sb, "Dedup scrubber initialization failed\n");
+		goto out;
+	}
+
+	retval = nova_rcache_init(sb);
+	if (retval < 0) {
+		nova_err(sb, "Read cache initialization failed\n");
+		goto out;
+	}
+
+	/* Stale slots are only known once recovery has run */
+	retval = nova_reclaim_init(sb);
+	if (retval < 0) {
+		nova_err(sb, "Reclaim queue initialization failed\n");
+		goto out;
+	}
+
+	retval = nova_log_gc_init(sb);
+	if (retval < 0) {
+		nova_err(sb, "Log GC daemon initialization failed\n");
+		goto out;
+	}
+
 	root_i = nova_iget(sb, NOVA_ROOT_INO);
 	if (IS_ERR(root_i)) {
 		retval = PTR_ERR(root_i);
@@ -903,7 +993,15 @@ out:
 	* Author:Hsiao
 	* free entry free list
 	*/
+	nova_log_gc_stop(sb);
+	nova_snapshot_cleaner_stop(sb);
+	nova_reclaim_stop(sb);
+	nova_dedup_scrub_stop(sb);
+	nova_dedup_free_batch_exit(sb);
+	nova_rcache_exit(sb);
 	nova_free_entry_list(sb);
+	nova_entry_refcount_exit(sb);
+	nova_dedup_free_shards(sb);
 
 	nova_sysfs_exit(sb);
 
@@ -922,9 +1020,14 @@ int nova_statfs(struct dentry *d, struct kstatfs *buf)
 	buf->f_bsize = sb->s_blocksize;
 
 	buf->f_blocks = sbi->num_blocks;
-	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb);
+	/*
+	 * Queued deletions are reported free already. Blocks still shared by
+	 * dedup stay allocated, so this is an upper bound.
+	 */
+	buf->f_bfree = buf->f_bavail = nova_count_free_blocks(sb) +
+						READ_ONCE(sbi->reclaim_blocks);
 	buf->f_files = LONG_MAX;
-	buf->f_ffree = LONG_MAX - sbi->s_inodes_used_count;
+	buf->f_ffree = LONG_MAX - nova_inodes_used(sb);
 	buf->f_namelen = NOVA_NAME_LEN;
 	nova_dbg_verbose("nova_stats: total 4k free blocks 0x%llx\n",
 		buf->f_bfree);
@@ -957,6 +1060,8 @@ static int nova_show_options(struct seq_file *seq, struct dentry *root)
 		seq_puts(seq, ",wprotect");
 	if (test_opt(root->d_sb, DAX))
 		seq_puts(seq, ",dax");
+	if (sbi->read_cache_mb)
+		seq_printf(seq, ",read_cache=%lu", sbi->read_cache_mb);
 
 	return 0;
 }
@@ -998,18 +1103,20 @@ static void nova_put_super(struct super_block *sb)
 {
 	struct nova_sb_info *sbi = NOVA_SB(sb);
 	struct inode_map *inode_map;
-	int i, i_hlist;
-	size_t sz;
-	struct hlist_head *hlist;
-	struct nova_hentry *hentry;
+	int i;
 
 	nova_print_curr_epoch_id(sb);
 
 	/* It's unmount time, so unmap the nova memory */
 //	nova_print_free_lists(sb);
 	if (sbi->virt_addr) {
+		nova_reclaim_stop(sb);
 		nova_save_snapshots(sb);
 		nova_calc_non_fin_stop(sb);
+		nova_dedup_scrub_stop(sb);
+		nova_dedup_free_batch_exit(sb);
+		nova_rcache_exit(sb);
+		nova_entry_refcount_exit(sb);
 		
 		kmem_cache_free(nova_inode_cachep, sbi->snapshot_si);
 		nova_save_inode_list_to_log(sb);
@@ -1021,28 +1128,9 @@ static void nova_put_super(struct super_block *sb)
 	nova_fp_hash_ctx_free(&sbi->nova_fp_strong_ctx);
 	nova_fp_hash_ctx_free(&sbi->nova_fp_weak_ctx);
 	nova_fp_hash_ctx_free(&sbi->nova_non_fin_calc_weak_ctx);
+	nova_fp_hash_ctx_free(&sbi->nova_non_fin_calc_str_ctx);
 	nova_free_entry_list(sb);
-	sz = 1 << sbi->num_entries_bits;
-	
-	for(i_hlist = 0; i_hlist < sz; ++i_hlist) {
-		hlist = &sbi->weak_hash_table[i_hlist];
-		while( !hlist_empty(hlist) ) {
-			hentry = hlist_entry_safe(hlist->first, typeof(*hentry), node);
-			hlist_del(&hentry->node);
-			kmem_cache_free(sbi->nova_hentry_cachep, hentry);
-		}
-	}
-
-	for(i_hlist = 0; i_hlist < sz; ++i_hlist) {
-		hlist = &sbi->strong_hash_table[i_hlist];
-		while( !hlist_empty(hlist) ) {
-			hentry = hlist_entry_safe(hlist->first, typeof(*hentry), node);
-			hlist_del(&hentry->node);
-			kmem_cache_free(sbi->nova_hentry_cachep, hentry);
-		}
-	}
-	vfree(sbi->weak_hash_table);
-	vfree(sbi->strong_hash_table);
+	nova_dedup_free_shards(sb);
 	vfree(sbi->blocknr_to_entry);
 	kmem_cache_destroy(sbi->nova_hentry_cachep);
 
@@ -1056,13 +1144,14 @@ static void nova_put_super(struct super_block *sb)
 
 	for (i = 0; i < sbi->cpus; i++) {
 		inode_map = &sbi->inode_maps[i];
-		nova_dbgv("CPU %d: inode allocated %d, freed %d\n",
+		nova_dbgv("CPU %d: inode allocated %lu, freed %lu\n",
 			i, inode_map->allocated, inode_map->freed);
 	}
 
 	kfree(sbi->inode_maps);
 
 	nova_sysfs_exit(sb);
+	nova_dedup_trace_exit(sb);
 
 	kfree(sbi->nova_sb);
 	kfree(sbi);
@@ -1091,6 +1180,11 @@ void nova_free_vma_item(struct super_block *sb,
 	nova_free_range_node((struct nova_range_node *)item);
 }
 
+void nova_free_file_extent(struct nova_file_extent *ext)
+{
+	nova_free_range_node((struct nova_range_node *)ext);
+}
+
 struct snapshot_info *nova_alloc_snapshot_info(struct super_block *sb)
 {
 	struct snapshot_info *p;
@@ -1152,6 +1246,12 @@ struct vma_item *nova_alloc_vma_item(struct super_block *sb)
 	return (struct vma_item *)nova_alloc_range_node(sb);
 }
 
+/* File tree updates may not sleep */
+struct nova_file_extent *nova_alloc_file_extent(struct super_block *sb)
+{
+	return (struct nova_file_extent *)nova_alloc_range_node_atomic(sb);
+}
+
 
 static struct inode *nova_alloc_inode(struct super_block *sb)
 {
@@ -1281,11 +1381,19 @@ static struct dentry *nova_mount(struct file_system_type *fs_type,
 	return mount_bdev(fs_type, flags, dev_name, data, nova_fill_super);
 }
 
+static void nova_kill_sb(struct super_block *sb)
+{
+	/* The log GC daemons pin inodes, stop them before eviction */
+	if (sb->s_root)
+		nova_log_gc_stop(sb);
+	kill_block_super(sb);
+}
+
 static struct file_system_type nova_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "NOVA",
 	.mount		= nova_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= nova_kill_sb,
 };
 
 static struct inode *nova_nfs_get_inode(struct super_block *sb,
@@ -20,7 +20,7 @@ struct nova_super_block {
 	 */
 	__le32		s_sum;			/* checksum of this sb */
 	__le32		s_magic;		/* magic signature */
-	__le32		s_padding32;
+	__le32		s_features;		/* NOVA_FEATURE_* of the format */
 	__le32		s_blocksize;		/* blocksize in bytes */
 	__le64		s_size;			/* total size of fs in bytes */
 	char		s_volume_name[16];	/* volume name */
@@ -65,6 +65,21 @@ struct nova_super_block {
 #define	INODE_TABLE1_START	32 // replica inode table
 #define	JOURNAL_START		48 // journal pointer table
 
+/* Layout features an image was formatted with, in s_features */
+#define NOVA_FEATURE_RECLAIM_QUEUE	0x1
+
+/*
+ * Deferred reclaim queue, laid out after the dedup zero block on images with
+ * NOVA_FEATURE_RECLAIM_QUEUE. A slot holds a deleted inode whose blocks are
+ * still to be freed, 0 if the slot is free.
+ */
+#define NOVA_RECLAIM_QUEUE_BLOCKS	4
+
+struct nova_reclaim_slot {
+	__le64	ino;
+	__le64	blocks;		/* i_blocks at eviction, for statfs */
+} __attribute((__packed__));
+
 /* For replica super block and replica reserved inodes */
 #define	TAIL_RESERVED_BLOCKS	2
 
@@ -94,6 +109,23 @@ struct nova_super_block {
 
 #define NON_DEDUP_FP_LOCK_BITS 6
 #define NON_DEDUP_FP_LOCK_NUM (1 << NON_DEDUP_FP_LOCK_BITS)
+
+/*
+ * Dedup index shard, one per online NUMA node. Bucket idx of the weak and
+ * strong tables lives in shard (idx % nr_shards). Entries of
+ * [entry_start, entry_end) are handed out to CPUs of this node.
+ */
+struct nova_dedup_shard {
+	int node;
+	struct spinlock weak_hash_table_locks[HASH_TABLE_LOCK_NUM];
+	struct hlist_head *weak_hash_table;
+	struct spinlock strong_hash_table_locks[HASH_TABLE_LOCK_NUM];
+	struct hlist_head *strong_hash_table;
+	struct list_head meta_free_list;
+	struct spinlock free_list_lock;
+	unsigned long entry_start;
+	unsigned long entry_end;
+};
 /*
  * NOVA super-block data in DRAM
  */
@@ -152,11 +184,16 @@ struct nova_sb_info {
 	int mount_snapshot;
 	u64 mount_snapshot_epoch_id;
 
-	struct task_struct *snapshot_cleaner_thread;
+	struct nova_snapshot_cleaner *snapshot_cleaners; /* One per list */
 	wait_queue_head_t snapshot_cleaner_wait;
+	unsigned long snapshot_clean_round;	/* Bumped per deletion */
 	wait_queue_head_t snapshot_mmap_wait;
 	void *curr_clean_snapshot_info;
 
+	/* Snapshot space accounting, see snapshot.c */
+	spinlock_t snapshot_space_lock;	/* Also guards snapshot_info_tree */
+	struct xarray snapshot_blocks;
+
 	/* DAX-mmap snapshot structures */
 	struct mutex vma_mutex;
 	struct list_head mmap_sih_list;
@@ -174,9 +211,6 @@ struct nova_sb_info {
 	/* Per-CPU inode map */
 	struct inode_map	*inode_maps;
 
-	/* Decide new inode map id */
-	unsigned long map_id;
-
 	/* Per-CPU free block list */
 	struct free_list *free_lists;
 	unsigned long per_list_blocks;
@@ -187,23 +221,54 @@ struct nova_sb_info {
 
 	unsigned long	metadata_start;
 	struct nova_entry_node *free_list_buf;
-	struct list_head meta_free_list;
-	struct spinlock free_list_lock;
 	unsigned long num_entries_blocks;
 	unsigned long num_entries;
 	unsigned int num_entries_bits;
-	struct spinlock weak_hash_table_locks[HASH_TABLE_LOCK_NUM];
-	struct hlist_head *weak_hash_table;
-	struct spinlock strong_hash_table_locks[HASH_TABLE_LOCK_NUM];
-	struct hlist_head *strong_hash_table;
+	struct nova_dedup_shard **dedup_shards;
+	int dedup_nr_shards;
+	int *node_to_shard;
+	unsigned long shard_entries;	/* Entries per shard */
 	int64_t *blocknr_to_entry;
+	unsigned long zero_blocknr;	/* Shared all-zero block, never freed */
+	struct nova_refcount_cache __percpu *refcount_deltas;
+	int64_t refcount_hot_thresh;
 	struct spinlock non_dedup_fp_locks[HASH_TABLE_LOCK_NUM];
 	u32 dup_block;
 	u32 cur_block;
 	u32 dedup_mode;
+	int dedup_trace_level;		/* 0: decision trace off */
+	struct nova_dedup_trace_ring __percpu *dedup_trace;
 	struct task_struct *calc_non_fin_thread;
 	wait_queue_head_t calc_non_fin_wait;
 	int should_non_fin_thread_done;
+	struct task_struct *dedup_scrub_thread;
+	wait_queue_head_t dedup_scrub_wait;
+	void *dedup_scrub_buf;
+	unsigned int dedup_scrub_mbps;	/* Scrub budget, 0: parked */
+	unsigned long dedup_scrub_pos;	/* Next entry to verify */
+	unsigned long dedup_scrub_passes;
+	unsigned long dedup_scrub_verified;
+	unsigned long dedup_scrub_mismatches;
+	unsigned long dedup_scrub_repaired;
+	unsigned long dedup_scrub_poisoned;
+	struct nova_dedup_free_batch __percpu *dedup_free_batch;
+
+	/* DRAM copies of shared blocks, read_cache=<MB> */
+	unsigned long read_cache_mb;
+	struct nova_read_cache *read_cache;
+
+	/* Per-CPU background log GC, see gc.c */
+	struct nova_log_gc_queue *log_gc_queues;
+
+	/* Deferred reclaim of deleted files */
+	unsigned long reclaim_start;
+	struct nova_reclaim_slot *reclaim_slots;
+	unsigned long reclaim_nr_slots;
+	spinlock_t reclaim_lock;
+	unsigned long reclaim_inodes;		/* Queued inodes */
+	unsigned long reclaim_blocks;		/* Their blocks, pending free */
+	struct task_struct *reclaim_thread;
+	wait_queue_head_t reclaim_wait;
 	struct kmem_cache *nova_hentry_cachep;
 };
 
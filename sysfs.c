@@ -20,6 +20,7 @@
 
 #include "nova.h"
 #include "inode.h"
+#include "dedup.h"
 
 const char *proc_dirname = "fs/NOVA";
 struct proc_dir_entry *nova_proc_root;
@@ -138,10 +139,11 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 	seq_puts(seq, "\n");
 
 	seq_puts(seq, "================ NOVA I/O stats ================\n\n");
-	seq_printf(seq, "Read %llu, bytes %llu, average %llu\n",
+	seq_printf(seq, "Read %llu, bytes %llu, average %llu, segments %llu\n",
 		Countstats[dax_read_t], IOstats[read_bytes],
 		Countstats[dax_read_t] ?
-			IOstats[read_bytes] / Countstats[dax_read_t] : 0);
+			IOstats[read_bytes] / Countstats[dax_read_t] : 0,
+		IOstats[read_segs]);
 	seq_printf(seq, "COW write %llu, bytes %llu, average %llu, write breaks %llu, average %llu\n",
 		Countstats[do_cow_write_t], IOstats[cow_write_bytes],
 		Countstats[do_cow_write_t] ?
@@ -149,6 +151,8 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 		IOstats[cow_write_breaks], Countstats[do_cow_write_t] ?
 			IOstats[cow_write_breaks] / Countstats[do_cow_write_t]
 			: 0);
+	seq_printf(seq, "COW write entries %llu, appended in %llu batches\n",
+		IOstats[write_entries_batched], IOstats[write_entry_batches]);
 	seq_printf(seq, "Inplace write %llu, bytes %llu, average %llu, write breaks %llu, average %llu\n",
 		Countstats[inplace_write_t], IOstats[inplace_write_bytes],
 		Countstats[inplace_write_t] ?
@@ -157,14 +161,17 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 		IOstats[inplace_write_breaks], Countstats[inplace_write_t] ?
 			IOstats[inplace_write_breaks] /
 			Countstats[inplace_write_t] : 0);
-	seq_printf(seq, "Inplace write %llu, allocate new blocks %llu\n",
+	seq_printf(seq, "Inplace write %llu, allocate new blocks %llu, copy shared blocks %llu\n",
 			Countstats[inplace_write_t],
-			IOstats[inplace_new_blocks]);
-	seq_printf(seq, "DAX get blocks %llu, allocate new blocks %llu\n",
-			Countstats[dax_get_block_t], IOstats[dax_new_blocks]);
+			IOstats[inplace_new_blocks],
+			IOstats[inplace_cow_shared]);
+	seq_printf(seq, "DAX get blocks %llu, allocate new blocks %llu, copy shared blocks %llu\n",
+			Countstats[dax_get_block_t], IOstats[dax_new_blocks],
+			IOstats[dax_cow_shared]);
 	seq_printf(seq, "Dirty pages %llu\n", IOstats[dirty_pages]);
-	seq_printf(seq, "Protect head %llu, tail %llu\n",
-			IOstats[protect_head], IOstats[protect_tail]);
+	seq_printf(seq, "Protect head %llu, tail %llu, skipped on dedup hit %llu\n",
+			IOstats[protect_head], IOstats[protect_tail],
+			IOstats[protect_dedup_skip]);
 	seq_printf(seq, "Block csum parity %llu\n", IOstats[block_csum_parity]);
 	seq_printf(seq, "Page fault %llu, dax cow fault %llu, dax cow fault during snapshot creation %llu\n"
 			"CoW write overlap mmap range %llu, mapping/pfn updated pages %llu\n",
@@ -174,6 +181,34 @@ static int nova_seq_IO_show(struct seq_file *seq, void *v)
 			IOstats[mapping_updated_pages]);
 	seq_printf(seq, "fsync %llu, fdatasync %llu\n",
 			Countstats[fsync_t], IOstats[fdatasync]);
+	seq_printf(seq, "Dedup zero pages %llu\n", IOstats[dedup_zero_pages]);
+	seq_printf(seq, "Dedup refcount deferred %llu, folded %llu, entry fences %llu\n",
+			IOstats[dedup_refcount_deferred],
+			IOstats[dedup_refcount_folds],
+			IOstats[dedup_entry_fences]);
+	seq_printf(seq, "Dedup cross-node probes %llu, entry updates %llu\n",
+			IOstats[dedup_remote_probes],
+			IOstats[dedup_remote_entry_updates]);
+	seq_printf(seq, "Dedup free shared refs %llu, batched unindex %llu, claimed for write %llu\n",
+			IOstats[dedup_free_shared],
+			IOstats[dedup_free_unindexed],
+			IOstats[dedup_claimed]);
+	seq_printf(seq, "Reclaim deferred %llu, freed %llu, queue full %llu\n",
+			IOstats[reclaim_deferred], IOstats[reclaim_freed],
+			IOstats[reclaim_queue_full]);
+	seq_printf(seq, "Read cache hits %llu, misses %llu, fills %llu, evictions %llu, invalidations %llu\n",
+			IOstats[read_cache_hits], IOstats[read_cache_misses],
+			IOstats[read_cache_fills],
+			IOstats[read_cache_evictions],
+			IOstats[read_cache_invalidations]);
+	seq_printf(seq, "Log GC deferred %llu, inline over budget %llu, background %llu\n",
+			IOstats[log_gc_deferred], IOstats[log_gc_inline],
+			IOstats[log_gc_background]);
+	seq_printf(seq, "Snapshot cleaning rounds %llu, batched frees %llu, freed ranges %llu\n",
+			IOstats[snapshot_clean_rounds],
+			IOstats[free_batch_flushes], IOstats[free_batch_ranges]);
+	seq_printf(seq, "Inode numbers taken from another CPU's map %llu\n",
+			IOstats[inode_map_steals]);
 
 	seq_puts(seq, "\n");
 
@@ -362,9 +397,12 @@ static const struct file_operations nova_seq_show_snapshots_fops = {
 /* ====================== Performance ======================== */
 static int nova_seq_test_perf_show(struct seq_file *seq, void *v)
 {
-	seq_printf(seq, "Echo function:poolmb:size:disks to test function performance working on size of data.\n"
+	seq_printf(seq, "Echo function:poolmb:size:disks[:dup:threads:load] to test function performance working on size of data.\n"
 			"    example: echo 1:128:4096:8 > /proc/fs/NOVA/pmem0/test_perf\n"
+			"    example: echo 25:128:4096:1:50:4:100 > /proc/fs/NOVA/pmem0/test_perf\n"
 			"The disks value only matters for raid functions.\n"
+			"Dedup functions work on 4 KiB pages, dup percent of which are duplicates,\n"
+			"spread over threads; load is the index entries per bucket in percent.\n"
 			"Set function to 0 to test all functions.\n");
 	return 0;
 }
@@ -382,9 +420,14 @@ ssize_t nova_seq_test_perf(struct file *filp, const char __user *buf,
 	struct super_block *sb = PDE_DATA(inode);
 	size_t size;
 	unsigned int func_id, poolmb, disks;
-
-	if (sscanf(buf, "%u:%u:%zu:%u", &func_id, &poolmb, &size, &disks) == 4)
-		nova_test_perf(sb, func_id, poolmb, size, disks);
+	unsigned int dup = 0, threads = 1, load = 100;
+	int n;
+
+	n = sscanf(buf, "%u:%u:%zu:%u:%u:%u:%u", &func_id, &poolmb, &size,
+					&disks, &dup, &threads, &load);
+	if (n == 4 || n == 7)
+		nova_test_perf(sb, func_id, poolmb, size, disks,
+					dup, threads, load);
 	else
 		nova_warn("Couldn't parse test_perf request: %s", buf);
 
@@ -495,6 +538,183 @@ static const struct file_operations nova_seq_gc_fops = {
 	.release	= single_release,
 };
 
+/* ====================== Dedup trace ======================== */
+
+/*
+ * Echo 1 to trace dedup decisions, 2 to also fill in skipped fingerprints
+ * so every record can be replayed, 0 to stop. Reading dumps the per-CPU
+ * rings, oldest record first within each CPU.
+ */
+struct nova_dedup_trace_iter {
+	struct super_block *sb;
+	int cpu;
+};
+
+static const char *nova_dedup_trace_mode(u8 mode)
+{
+	switch (mode) {
+	case NON_FIN:
+		return "non_fin";
+	case WEAK_STR_FIN:
+		return "weak_str_fin";
+	case STR_FIN:
+		return "str_fin";
+	default:
+		return "none";
+	}
+}
+
+static const char * const nova_dedup_trace_results[] = {
+	"miss", "hit", "zero", "error"
+};
+
+/* seq position 0 is the header, records start at 1 */
+static void *nova_seq_dedup_trace_start(struct seq_file *seq, loff_t *pos)
+{
+	struct nova_dedup_trace_iter *iter = seq->private;
+	struct nova_dedup_trace_rec *rec;
+	loff_t rpos;
+
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+
+	rpos = *pos - 1;
+	rec = nova_dedup_trace_get(iter->sb, &rpos, &iter->cpu);
+	*pos = rpos + 1;
+	return rec;
+}
+
+static void *nova_seq_dedup_trace_next(struct seq_file *seq, void *v,
+	loff_t *pos)
+{
+	++*pos;
+	return nova_seq_dedup_trace_start(seq, pos);
+}
+
+static void nova_seq_dedup_trace_stop(struct seq_file *seq, void *v)
+{
+}
+
+static int nova_seq_dedup_trace_show(struct seq_file *seq, void *v)
+{
+	struct nova_dedup_trace_iter *iter = seq->private;
+	struct nova_dedup_trace_rec *rec = v;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(seq, "# cpu time_ns mode result fp_weak fp_strong entrynr latency_ns flags\n");
+		return 0;
+	}
+
+	seq_printf(seq, "%d %llu %s %s %08x %016llx %llu %u %x\n",
+		   iter->cpu, rec->time, nova_dedup_trace_mode(rec->mode),
+		   nova_dedup_trace_results[rec->result & 3], rec->fp_weak,
+		   rec->fp_strong, rec->entrynr, rec->latency, rec->flags);
+	return 0;
+}
+
+static const struct seq_operations nova_seq_dedup_trace_ops = {
+	.start	= nova_seq_dedup_trace_start,
+	.next	= nova_seq_dedup_trace_next,
+	.stop	= nova_seq_dedup_trace_stop,
+	.show	= nova_seq_dedup_trace_show,
+};
+
+static int nova_seq_dedup_trace_open(struct inode *inode, struct file *file)
+{
+	struct nova_dedup_trace_iter *iter;
+
+	iter = __seq_open_private(file, &nova_seq_dedup_trace_ops,
+				  sizeof(struct nova_dedup_trace_iter));
+	if (iter == NULL)
+		return -ENOMEM;
+
+	iter->sb = PDE_DATA(inode);
+	return 0;
+}
+
+ssize_t nova_seq_dedup_trace(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct super_block *sb = PDE_DATA(inode);
+	int level, ret;
+
+	ret = kstrtoint_from_user(buf, len, 0, &level);
+	if (ret == 0)
+		ret = nova_dedup_trace_set(sb, level);
+	if (ret < 0) {
+		nova_warn("Couldn't set dedup trace level: %d\n", ret);
+		return ret;
+	}
+
+	return len;
+}
+
+static const struct file_operations nova_seq_dedup_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_dedup_trace_open,
+	.read		= seq_read,
+	.write		= nova_seq_dedup_trace,
+	.llseek		= seq_lseek,
+	.release	= seq_release_private,
+};
+
+/* ====================== Dedup scrub ======================== */
+
+static int nova_seq_dedup_scrub_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct nova_sb_info *sbi = NOVA_SB(sb);
+
+	seq_printf(seq, "budget %u MB/s%s\n", READ_ONCE(sbi->dedup_scrub_mbps),
+		   READ_ONCE(sbi->dedup_scrub_mbps) ? "" : " (parked)");
+	seq_printf(seq, "progress %lu/%lu, passes %lu\n",
+		   READ_ONCE(sbi->dedup_scrub_pos), sbi->num_entries,
+		   READ_ONCE(sbi->dedup_scrub_passes));
+	seq_printf(seq, "verified %lu, mismatches %lu, repaired %lu, poisoned %lu\n",
+		   READ_ONCE(sbi->dedup_scrub_verified),
+		   READ_ONCE(sbi->dedup_scrub_mismatches),
+		   READ_ONCE(sbi->dedup_scrub_repaired),
+		   READ_ONCE(sbi->dedup_scrub_poisoned));
+	seq_printf(seq, "Echo a budget in MB/s to change it, 0 to park\n"
+		   "    example: echo 64 > /proc/fs/NOVA/pmem0/dedup_scrub\n");
+	return 0;
+}
+
+static int nova_seq_dedup_scrub_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nova_seq_dedup_scrub_show, PDE_DATA(inode));
+}
+
+ssize_t nova_seq_dedup_scrub(struct file *filp, const char __user *buf,
+	size_t len, loff_t *ppos)
+{
+	struct address_space *mapping = filp->f_mapping;
+	struct inode *inode = mapping->host;
+	struct super_block *sb = PDE_DATA(inode);
+	unsigned int mbps;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, len, 0, &mbps);
+	if (ret < 0) {
+		nova_warn("Couldn't set dedup scrub budget: %d\n", ret);
+		return ret;
+	}
+
+	nova_dedup_scrub_set(sb, mbps);
+	return len;
+}
+
+static const struct file_operations nova_seq_dedup_scrub_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nova_seq_dedup_scrub_open,
+	.read		= seq_read,
+	.write		= nova_seq_dedup_scrub,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 /* ====================== Setup/teardown======================== */
 void nova_sysfs_init(struct super_block *sb)
 {
@@ -519,6 +739,10 @@ void nova_sysfs_init(struct super_block *sb)
 				 &nova_seq_show_snapshots_fops, sb);
 		proc_create_data("test_perf", 0444, sbi->s_proc,
 				 &nova_seq_test_perf_fops, sb);
+		proc_create_data("dedup_trace", 0444, sbi->s_proc,
+				 &nova_seq_dedup_trace_fops, sb);
+		proc_create_data("dedup_scrub", 0444, sbi->s_proc,
+				 &nova_seq_dedup_scrub_fops, sb);
 		proc_create_data("gc", 0444, sbi->s_proc,
 				 &nova_seq_gc_fops, sb);
 	}
@@ -536,6 +760,8 @@ void nova_sysfs_exit(struct super_block *sb)
 		remove_proc_entry("delete_snapshot", sbi->s_proc);
 		remove_proc_entry("snapshots", sbi->s_proc);
 		remove_proc_entry("test_perf", sbi->s_proc);
+		remove_proc_entry("dedup_trace", sbi->s_proc);
+		remove_proc_entry("dedup_scrub", sbi->s_proc);
 		remove_proc_entry("gc", sbi->s_proc);
 		remove_proc_entry(sbi->s_bdev->bd_disk->disk_name,
 					nova_proc_root);